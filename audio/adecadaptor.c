@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "AmTsPlayer.h"
@@ -34,9 +35,16 @@
 // extern "C" {
 // #endif
 
+/*
+ * Locking, outer to inner: write_lock, lock, cancel_lock.
+ * write_lock is the data path lock, held across decoder writes and taken
+ * before lock by configure, switch, flush, stop and deinit. lock is held
+ * only for short calls, so volume, mute and the buffer queries do not
+ * wait behind a write that waits for decoder buffer space.
+ */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static int initialized = 0;
-static int in_deinit = 0;
 static int ready = 0;
 static am_tsplayer_handle session = 0;
 static am_tsplayer_audio_codec g_acodec = AV_AUDIO_CODEC_AUTO;
@@ -44,12 +52,67 @@ static am_tsplayer_audio_codec g_acodec = AV_AUDIO_CODEC_AUTO;
 static uint64_t timeout_ms = 10;
 static uint32_t sleep_us = 1000;
 
+/* low latency: do not wait for decoder buffer space */
+static int low_latency = 0;
+/* pts of the first and the last frame accepted since the decoder (re)started */
+static uint64_t first_write_pts = 0;
+static uint64_t last_write_pts = 0;
+/* bitstream output of ac3/eac3/dts to hdmi/spdif */
+static int passthrough = 0;
+
+/* cancellation of a blocked write, see set_adec_cancel() */
+static pthread_mutex_t cancel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cancel_cond = PTHREAD_COND_INITIALIZER;
+static int cancelled = 0;
+static int in_deinit = 0;
+
 #ifdef DEBUG
 #define LOG(fmt, arg...) fprintf(stdout, "[adecadaptor] %s:%d, " fmt, __FUNCTION__, __LINE__, ##arg);
 #else
 #define LOG(fmt, arg...)
 #endif
 
+static int write_cancelled()
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&cancel_lock);
+    ret = (cancelled != 0) || (in_deinit != 0);
+    pthread_mutex_unlock(&cancel_lock);
+
+    return ret;
+}
+
+/* sleep between write attempts, returns non-zero when cancelled */
+static int wait_cancel(uint32_t us)
+{
+    struct timespec ts;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)us * 1000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&cancel_lock);
+    if (cancelled == 0 && in_deinit == 0)
+    {
+        pthread_cond_timedwait(&cancel_cond, &cancel_lock, &ts);
+    }
+    ret = (cancelled != 0) || (in_deinit != 0);
+    pthread_mutex_unlock(&cancel_lock);
+
+    return ret;
+}
+
+static void set_in_deinit(int deinit)
+{
+    pthread_mutex_lock(&cancel_lock);
+    in_deinit = deinit;
+    pthread_cond_broadcast(&cancel_cond);
+    pthread_mutex_unlock(&cancel_lock);
+}
+
 int init_adec()
 {
     int ret = ERROR_CODE_OK;
@@ -76,9 +139,10 @@ int init_adec()
 
 int deinit_adec()
 {
-    in_deinit = 1;
     int ret = ERROR_CODE_OK;
+    set_in_deinit(1);
 
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
     LOG("enter!\n");
 
@@ -87,8 +151,9 @@ int deinit_adec()
         ret = release_session();
         if (ret != ERROR_CODE_OK)
         {
-            in_deinit = 0;
             pthread_mutex_unlock(&lock);
+            pthread_mutex_unlock(&write_lock);
+            set_in_deinit(0);
             LOG("release_session failed: %d\n", ret);
             return ret;
         }
@@ -96,9 +161,11 @@ int deinit_adec()
         initialized = 0;
     }
 
-    in_deinit = 0;
     pthread_mutex_unlock(&lock);
 
+    pthread_mutex_unlock(&write_lock);
+    set_in_deinit(0);
+
     return ERROR_CODE_OK;
 }
 
@@ -187,8 +254,25 @@ static am_tsplayer_audio_codec codec_char_to_enum(const char *codec)
     return AV_AUDIO_CODEC_AUTO;
 }
 
+/* pick pcm or bitstream output for g_acodec, with lock held */
+static am_tsplayer_result apply_out_mode()
+{
+    am_tsplayer_audio_out_mode mode = AV_AUDIO_OUT_PCM;
+
+    if (passthrough != 0 &&
+        (g_acodec == AV_AUDIO_CODEC_AC3 || g_acodec == AV_AUDIO_CODEC_EAC3 ||
+         g_acodec == AV_AUDIO_CODEC_DTS))
+    {
+        mode = AV_AUDIO_OUT_PASSTHROUGH;
+    }
+
+    LOG("acodec:%d, out mode:%d\n", g_acodec, mode);
+    return AmTsPlayer_setAudioOutMode(session, mode);
+}
+
 int configure_adec(const char *codec)
 {
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
 
     g_acodec = codec_char_to_enum(codec);
@@ -200,6 +284,7 @@ int configure_adec(const char *codec)
     if (initialized == 0)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("uninitialized!\n");
         return ERROR_CODE_INVALID_OPERATION;
     }
@@ -208,12 +293,15 @@ int configure_adec(const char *codec)
     if (ret != AM_TSPLAYER_OK)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("AmTsPlayer_setAudioParams failed: %d\n", ret);
         return ERROR_CODE_BASE_ERROR;
     }
 
     pthread_mutex_unlock(&lock);
 
+    pthread_mutex_unlock(&write_lock);
+
     return ERROR_CODE_OK;
 }
 
@@ -247,6 +335,7 @@ int set_audio_rate(double rate)
 int start_adec()
 {
     am_tsplayer_result ret = AM_TSPLAYER_OK;
+    am_tsplayer_avsync_mode mode = TS_SYNC_AMASTER;
 
     pthread_mutex_lock(&lock);
     LOG("enter!\n");
@@ -258,7 +347,12 @@ int start_adec()
         return ERROR_CODE_INVALID_OPERATION;
     }
 
-    AmTsPlayer_setSyncMode(session, TS_SYNC_AMASTER);
+    get_session_sync_mode(1, &mode);
+    AmTsPlayer_setSyncMode(session, mode);
+    if (apply_out_mode() != AM_TSPLAYER_OK)
+    {
+        LOG("AmTsPlayer_setAudioOutMode failed, decode to pcm\n");
+    }
     ret = AmTsPlayer_startAudioDecoding(session);
     if (ret != AM_TSPLAYER_OK)
     {
@@ -332,6 +426,7 @@ int flush_adec()
 {
     am_tsplayer_result ret = AM_TSPLAYER_OK;
 
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
     LOG("enter!\n");
 
@@ -340,6 +435,7 @@ int flush_adec()
     if (initialized == 0)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("uninitialized!\n");
         return ERROR_CODE_INVALID_OPERATION;
     }
@@ -350,10 +446,64 @@ int flush_adec()
     if (ret != AM_TSPLAYER_OK)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("AmTsPlayer stop&start failed: %d\n", ret);
         return ERROR_CODE_BASE_ERROR;
     }
+    first_write_pts = 0;
+    last_write_pts = 0;
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&write_lock);
+
+    return ERROR_CODE_OK;
+}
+
+/*
+ * Restart the decoder on another codec for a track switch. Unlike
+ * flush_adec() + configure_adec() + start_adec(), this keeps the session
+ * sync mode and the volume untouched, so video keeps running and the
+ * output is not muted around the switch.
+ */
+int switch_adec(const char *codec)
+{
+    am_tsplayer_result ret = AM_TSPLAYER_OK;
+    am_tsplayer_audio_params param = {AV_AUDIO_CODEC_AUTO, 0x101, 0};
+
+    pthread_mutex_lock(&write_lock);
+    pthread_mutex_lock(&lock);
+    LOG("enter, codec:%s!\n", codec ? codec : "null");
+
+    if (initialized == 0)
+    {
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
+        LOG("uninitialized!\n");
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    g_acodec = codec_char_to_enum(codec);
+    param.codectype = g_acodec;
+
+    ret = AmTsPlayer_stopAudioDecoding(session);
+    ret |= AmTsPlayer_setAudioParams(session, &param);
+    if (apply_out_mode() != AM_TSPLAYER_OK)
+    {
+        LOG("AmTsPlayer_setAudioOutMode failed, decode to pcm\n");
+    }
+    ret |= AmTsPlayer_startAudioDecoding(session);
+    if (ret != AM_TSPLAYER_OK)
+    {
+        ready = 0;
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
+        LOG("AmTsPlayer switch to acodec %d failed: %d\n", g_acodec, ret);
+        return ERROR_CODE_BASE_ERROR;
+    }
+    ready = 1;
+    first_write_pts = 0;
+    last_write_pts = 0;
     pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&write_lock);
 
     return ERROR_CODE_OK;
 }
@@ -362,12 +512,14 @@ int stop_adec()
 {
     am_tsplayer_result ret = AM_TSPLAYER_OK;
 
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
     LOG("enter!\n");
 
     if (initialized == 0)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("uninitialized!\n");
         return ERROR_CODE_INVALID_OPERATION;
     }
@@ -376,58 +528,162 @@ int stop_adec()
     if (ret != AM_TSPLAYER_OK)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("AmTsPlayer_stopAudioDecoding failed: %d\n", ret);
         return ERROR_CODE_BASE_ERROR;
     }
     ready = 0;
+    first_write_pts = 0;
+    last_write_pts = 0;
 
     pthread_mutex_unlock(&lock);
 
+    pthread_mutex_unlock(&write_lock);
+
     return ERROR_CODE_OK;
 }
 
-int decode_audio(void *data, int32_t size, uint64_t pts)
+/*
+ * Write one chunk to the decoder, with write_lock held, which keeps the
+ * session from being released underneath. With may_drop set a
+ * full decoder buffer returns ERROR_CODE_RETRY at once, otherwise the
+ * write is retried for a while, or until cancelled.
+ */
+static int write_frame(void *data, int32_t size, uint64_t pts, int may_drop)
 {
     am_tsplayer_input_frame_buffer frame =
         {TS_INPUT_BUFFER_TYPE_NORMAL, data, size, pts, 0};
     am_tsplayer_result ret = AM_TSPLAYER_OK;
     int retry = 100;
 
+    if (write_cancelled())
+    {
+        return ERROR_CODE_CANCELLED;
+    }
+
+    if (may_drop != 0)
+    {
+        /* a full decoder buffer means we are late, let the caller drop */
+        ret = AmTsPlayer_writeFrameData(session, &frame, timeout_ms);
+        if (AM_TSPLAYER_ERROR_RETRY == ret)
+        {
+            return ERROR_CODE_RETRY;
+        }
+    }
+    else
+    {
+        do
+        {
+            ret = AmTsPlayer_writeFrameData(session, &frame, timeout_ms);
+            if (AM_TSPLAYER_ERROR_RETRY != ret)
+            {
+                break;
+            }
+            if (wait_cancel(sleep_us))
+            {
+                LOG("write cancelled, pts: %llu\n", (unsigned long long)pts);
+                return ERROR_CODE_CANCELLED;
+            }
+        } while (retry-- > 0);
+    }
+
+    if (ret != AM_TSPLAYER_OK)
+    {
+        LOG("AmTsPlayer_writeFrameData failed: %d\n", ret);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    return ERROR_CODE_OK;
+}
+
+int decode_audio(void *data, int32_t size, uint64_t pts)
+{
+    int ret = ERROR_CODE_OK;
+    int may_drop = 0;
+
     if (data == NULL || size < 0)
     {
         LOG("bad parameter!\n");
         return ERROR_CODE_BAD_PARAMETER;
     }
 
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
     if (initialized == 0 || ready == 0)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("---uninitialized or not ready!\n");
         return ERROR_CODE_INVALID_OPERATION;
     }
+    may_drop = low_latency;
+    pthread_mutex_unlock(&lock);
 
-    do
+    ret = write_frame(data, size, pts, may_drop);
+    if (ret != ERROR_CODE_OK)
     {
-        ret = AmTsPlayer_writeFrameData(session, &frame, timeout_ms);
-        if ((AM_TSPLAYER_ERROR_RETRY == ret) && (0 == in_deinit))
-        {
-            usleep(sleep_us);
-        }
-        else
-        {
-            break;
-        }
-    } while ((retry-- > 0) && ret);
+        pthread_mutex_unlock(&write_lock);
+        return ret;
+    }
+    pthread_mutex_lock(&lock);
+    if (first_write_pts == 0)
+    {
+        first_write_pts = pts;
+    }
+    last_write_pts = pts;
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&write_lock);
 
-    if (ret != AM_TSPLAYER_OK)
+    return ERROR_CODE_OK;
+}
+
+/*
+ * Write a frame given as header and payload, e.g. a synthesized adts
+ * header and a raw aac frame, without joining them into one buffer.
+ * Both parts go in under one write_lock hold so nothing lands in between.
+ */
+int decode_audio_gather(void *header, int32_t header_size, void *data, int32_t size, uint64_t pts)
+{
+    int ret = ERROR_CODE_OK;
+    int may_drop = 0;
+
+    if (header == NULL || header_size < 0 || data == NULL || size < 0)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&write_lock);
+    pthread_mutex_lock(&lock);
+    if (initialized == 0 || ready == 0)
     {
         pthread_mutex_unlock(&lock);
-        LOG("AmTsPlayer_writeFrameData failed: %d\n", ret);
-        return ERROR_CODE_BASE_ERROR;
+        pthread_mutex_unlock(&write_lock);
+        LOG("---uninitialized or not ready!\n");
+        return ERROR_CODE_INVALID_OPERATION;
     }
+    may_drop = low_latency;
+    pthread_mutex_unlock(&lock);
 
+    ret = write_frame(header, header_size, pts, may_drop);
+    if (ret == ERROR_CODE_OK)
+    {
+        /* the header is in, the payload has to follow it */
+        ret = write_frame(data, size, pts, 0);
+    }
+    if (ret != ERROR_CODE_OK)
+    {
+        pthread_mutex_unlock(&write_lock);
+        return ret;
+    }
+    pthread_mutex_lock(&lock);
+    if (first_write_pts == 0)
+    {
+        first_write_pts = pts;
+    }
+    last_write_pts = pts;
     pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&write_lock);
 
     return ERROR_CODE_OK;
 }
@@ -554,6 +810,139 @@ int set_volume(int32_t volume)
     return ERROR_CODE_OK;
 }
 
+int set_adec_passthrough(int32_t enable)
+{
+    am_tsplayer_result ret = AM_TSPLAYER_OK;
+
+    pthread_mutex_lock(&lock);
+    LOG("enter, passthrough:%d!\n", enable);
+
+    passthrough = (enable != 0);
+
+    /* otherwise applied by start_adec() */
+    if (initialized != 0 && ready != 0)
+    {
+        ret = apply_out_mode();
+        if (ret != AM_TSPLAYER_OK)
+        {
+            pthread_mutex_unlock(&lock);
+            LOG("AmTsPlayer_setAudioOutMode failed: %d\n", ret);
+            return ERROR_CODE_BASE_ERROR;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
+/*
+ * Cancel, or re-arm with 0, the writes of decode_audio(). A cancelled
+ * writer returns ERROR_CODE_CANCELLED without waiting for buffer space,
+ * so the sink can leave render when it is unlocked.
+ */
+int set_adec_cancel(int32_t cancel)
+{
+    pthread_mutex_lock(&cancel_lock);
+    cancelled = (cancel != 0);
+    pthread_cond_broadcast(&cancel_cond);
+    pthread_mutex_unlock(&cancel_lock);
+
+    return ERROR_CODE_OK;
+}
+
+int set_adec_sync_mode(int32_t mode)
+{
+    LOG("enter, mode:%d!\n", mode);
+
+    return set_session_sync_mode(mode);
+}
+
+int set_adec_low_latency(int32_t enable)
+{
+    pthread_mutex_lock(&lock);
+    LOG("enter, enable:%d!\n", enable);
+    low_latency = enable ? 1 : 0;
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
+/*
+ * Decoder buffer depth: pts of the last written frame minus current apts.
+ * ERROR_CODE_RETRY until the decoder plays a frame written since it started.
+ */
+int get_audio_buffered_ms(int32_t *buffered_ms)
+{
+    am_tsplayer_result ret = AM_TSPLAYER_OK;
+    uint64_t apts = 0;
+
+    if (buffered_ms == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (initialized == 0 || ready == 0)
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    ret = AmTsPlayer_getPts(session, TS_STREAM_AUDIO, &apts);
+    if (ret != AM_TSPLAYER_OK)
+    {
+        pthread_mutex_unlock(&lock);
+        LOG("AmTsPlayer_getPts failed: %d\n", ret);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    /* the decoder has not shown anything written since the (re)start yet */
+    if (apts == 0 || first_write_pts == 0 || apts < first_write_pts)
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_RETRY;
+    }
+
+    *buffered_ms = (last_write_pts > apts) ? (int32_t)((last_write_pts - apts) / 90) : 0;
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
+int get_audio_buffer_level(int32_t *level)
+{
+    am_tsplayer_result ret = AM_TSPLAYER_OK;
+    am_tsplayer_buffer_stat stat;
+
+    if (level == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (initialized == 0 || ready == 0)
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    /* polled periodically, so stay quiet on failure */
+    memset(&stat, 0, sizeof(stat));
+    ret = AmTsPlayer_getBufferStat(session, TS_STREAM_AUDIO, &stat);
+    if (ret != AM_TSPLAYER_OK || stat.size == 0)
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    *level = (int32_t)((uint64_t)stat.data_len * 100 / stat.size);
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
 int get_audio_pts(uint64_t *apts)
 {
     am_tsplayer_result ret = AM_TSPLAYER_OK;
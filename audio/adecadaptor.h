@@ -22,11 +22,15 @@
 #define __ADECADAPTOR_H__
 
 #include <stdint.h>
+#include "AmTsPlayer.h"
+#include "mediasession.h"
 
 #define ERROR_CODE_OK 0
 #define ERROR_CODE_BAD_PARAMETER -1
 #define ERROR_CODE_INVALID_OPERATION -2
 #define ERROR_CODE_BASE_ERROR -3
+#define ERROR_CODE_RETRY -4
+#define ERROR_CODE_CANCELLED -5
 
 // #ifdef __cplusplus
 // extern "C" {
@@ -42,9 +46,11 @@ int start_adec();
 int pause_adec();
 int resume_adec();
 int flush_adec();
+int switch_adec(const char *codec);
 int stop_adec();
 
 int decode_audio(void *data, int32_t size, uint64_t pts);
+int decode_audio_gather(void *header, int32_t header_size, void *data, int32_t size, uint64_t pts);
 int mute_audio(int32_t mute);
 
 int get_playing_position(int64_t *position_us);
@@ -54,6 +60,13 @@ int set_volume(int32_t volume);
 
 int get_audio_pts(uint64_t *apts);
 
+int set_adec_low_latency(int32_t enable);
+int set_adec_sync_mode(int32_t mode);
+int set_adec_passthrough(int32_t enable);
+int set_adec_cancel(int32_t cancel);
+int get_audio_buffered_ms(int32_t *buffered_ms);
+int get_audio_buffer_level(int32_t *level);
+
 // #ifdef __cplusplus
 // }
 // #endif
@@ -37,7 +37,9 @@
 
 #include <gst/gst.h>
 #include <gst/base/gstbasesink.h>
+#include <gst/audio/gstaudioclock.h>
 
+#include <stdio.h>
 #include <sys/prctl.h>
 #include "adecadaptor.h"
 #include "gstamltspasink.h"
@@ -51,6 +53,27 @@ GST_DEBUG_CATEGORY_STATIC(gst_amltspasink_debug_category);
 #define MAX_VOLUME 100
 #define DEFAULT_VOLUME 30
 
+#define DEFAULT_LATENCY_TARGET 150
+#define MIN_LATENCY_TARGET 20
+#define MAX_LATENCY_TARGET 2000
+
+/* raw aac framed as adts, frame_length is 13 bits */
+#define ADTS_MAX_FRAME_LEN 0x1fff
+
+/* audio track switch */
+#define SWITCH_QUEUE_MAX 64    /* buffers held for the new track */
+#define SWITCH_DRAIN_MS 40     /* old track left in the decoder */
+
+/* pts discontinuity, 90KHz */
+#define PTS_DISCONT_THRESHOLD 90000        /* jumps past 1s re-anchor sync */
+#define PTS_DISCONT_THRESHOLD_FLAGGED 27000 /* past 300ms on a DISCONT buffer */
+
+/* audio clock */
+#define CLOCK_SAMPLE_INTERVAL_US 20000              /* decoder pts read at most this often */
+#define CLOCK_SMOOTHING 8                           /* part of the error corrected per read */
+#define CLOCK_MAX_STEP (2 * GST_MSECOND)            /* max correction per read */
+#define CLOCK_SNAP_THRESHOLD (500 * GST_MSECOND)    /* jump forward when this far behind */
+
 #ifndef UNUSED
 #define UNUSED(x) (void)(x)
 #endif
@@ -66,6 +89,7 @@ static void gst_amltspasink_finalize(GObject *object);
 
 static GstStateChangeReturn gst_amltspasink_change_state(GstElement *element,
                                                          GstStateChange transition);
+static GstClock *gst_amltspasink_provide_clock(GstElement *element);
 
 static GstCaps *gst_amltspasink_get_caps(GstBaseSink *sink, GstCaps *filter);
 static gboolean gst_amltspasink_set_caps(GstBaseSink *sink, GstCaps *caps);
@@ -89,13 +113,44 @@ static GstFlowReturn gst_amltspasink_render(GstBaseSink *sink, GstBuffer *buffer
 static GstFlowReturn gst_amltspasink_render_list(GstBaseSink *sink,
                                                  GstBufferList *buffer_list);
 
+static gboolean switch_track(GstAmltspasink *amltspasink);
+
 enum
 {
     PROP_0,
     PROP_VOLUME,
     PROP_MUTE,
+    PROP_LOW_LATENCY,
+    PROP_LATENCY_TARGET,
+    PROP_BUFFERED_TIME,
+    PROP_SYNC_MODE,
+    PROP_DRIFT_COMPENSATION,
+    PROP_BUFFER_LEVEL,
+    PROP_BUFFER_WATERMARKS,
+    PROP_PASSTHROUGH,
+    PROP_GAPLESS,
 };
 
+#define GST_TYPE_AMLTSPASINK_SYNC_MODE (gst_amltspasink_sync_mode_get_type())
+static GType
+gst_amltspasink_sync_mode_get_type(void)
+{
+    static GType sync_mode_type = 0;
+    static const GEnumValue sync_modes[] = {
+        {SESSION_SYNC_AUTO, "Audio master once audio starts", "auto"},
+        {SESSION_SYNC_VMASTER, "Video master", "vmaster"},
+        {SESSION_SYNC_AMASTER, "Audio master", "amaster"},
+        {SESSION_SYNC_PCRMASTER, "PCR master, for live sources", "pcrmaster"},
+        {SESSION_SYNC_NOSYNC, "No sync", "nosync"},
+        {0, NULL, NULL}};
+
+    if (!sync_mode_type)
+    {
+        sync_mode_type = g_enum_register_static("GstAmltspasinkSyncMode", sync_modes);
+    }
+    return sync_mode_type;
+}
+
 /* pad templates */
 
 static GstStaticPadTemplate gst_amltspasink_sink_template =
@@ -113,11 +168,19 @@ static GstStaticPadTemplate gst_amltspasink_sink_template =
                                 "audio/mpeg, "
                                 "mpegversion = (int) {2, 4}, "
                                 "framed = (boolean) true, "
-                                "stream-format = { adts },"
+                                "stream-format = { adts, raw },"
                                 "channels = (int) [ 1, MAX ], "
                                 "rate = (int) [ 1, MAX ]"
                                 " ;"
-#if 0
+
+                                "audio/mpeg, "
+                                "mpegversion = (int) 4, "
+                                "framed = (boolean) true, "
+                                "stream-format = loas,"
+                                "channels = (int) [ 1, MAX ], "
+                                "rate = (int) [ 1, MAX ]"
+                                " ;"
+
                                 "audio/x-ac3, "
                                 "framed = (boolean) true, "
                                 "channels = (int) [ 1, MAX ], "
@@ -135,7 +198,27 @@ static GstStaticPadTemplate gst_amltspasink_sink_template =
                                 "channels = (int) [ 1, MAX ], "
                                 "rate = (int) [ 1, MAX ]"
                                 " ;"
-#endif
+
+                                "audio/ac4"
+                                " ;"
+
+                                "audio/x-ac4"
+                                " ;"
+
+                                "audio/x-dra"
+                                " ;"
+                                "audio/x-opus"
+                                " ;"
+
+                                "audio/x-flac, "
+                                "framed = (boolean) true, "
+                                "channels = (int) [ 1, MAX ], "
+                                "rate = (int) [ 1, MAX ]"
+                                " ;"
+
+                                "audio/x-vorbis"
+                                " ;"
+
                                 "audio/x-raw, "
                                 "format = (string) S16LE, "
                                 "layout = (string) interleaved, "
@@ -233,6 +316,536 @@ static int stop_eos_thread(GstAmltspasink *amltspasink)
     GST_OBJECT_UNLOCK(amltspasink);
     return 0;
 }
+
+static void post_buffer_level(GstAmltspasink *amltspasink, gint level,
+                              gint low, gint high, gint state)
+{
+    GstStructure *structure;
+
+    structure = gst_structure_new("buffer-level",
+                                  "level", G_TYPE_INT, level,
+                                  "low-watermark", G_TYPE_INT, low,
+                                  "high-watermark", G_TYPE_INT, high,
+                                  "state", G_TYPE_STRING, buffer_level_state_name(state),
+                                  NULL);
+    gst_element_post_message(GST_ELEMENT_CAST(amltspasink),
+                             gst_message_new_element(GST_OBJECT_CAST(amltspasink), structure));
+}
+
+/* sample decoder buffer level and latency, wake up the paced render */
+static gpointer audio_monitor_thread(gpointer data)
+{
+    GstAmltspasink *amltspasink = (GstAmltspasink *)data;
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+
+    prctl(PR_SET_NAME, "amltspasink_mon_t");
+    GST_INFO("enter");
+
+    g_mutex_lock(&priv->level_lock);
+    while (!priv->quit_monitor)
+    {
+        int32_t level = -1;
+        int32_t buffered_ms = -1;
+        gint low, high, state;
+        gboolean changed;
+
+        g_mutex_unlock(&priv->level_lock);
+        if (ERROR_CODE_OK != get_audio_buffer_level(&level))
+        {
+            level = -1;
+        }
+        if (ERROR_CODE_OK != get_audio_buffered_ms(&buffered_ms))
+        {
+            buffered_ms = -1;
+        }
+        g_mutex_lock(&priv->level_lock);
+        /* the adaptor measures nothing before the first written frame plays */
+        if (buffered_ms >= 0)
+        {
+            priv->first_frame = TRUE;
+        }
+
+        low = priv->low_watermark;
+        high = priv->high_watermark;
+        state = buffer_level_state(level, low, high);
+        changed = (state != priv->level_state);
+        priv->buffer_level = level;
+        priv->level_state = state;
+        g_cond_broadcast(&priv->level_cond);
+
+        if (changed && LEVEL_STATE_UNKNOWN != state)
+        {
+            GST_DEBUG_OBJECT(amltspasink, "buffer level %d%%, %s", level, buffer_level_state_name(state));
+            g_mutex_unlock(&priv->level_lock);
+            post_buffer_level(amltspasink, level, low, high, state);
+            g_mutex_lock(&priv->level_lock);
+        }
+
+        if (!priv->first_frame)
+        {
+            /* the delay up to the first frame is startup, not latency */
+            latency_window_reset(&priv->latency, g_get_monotonic_time());
+        }
+        else if (latency_window_sample(&priv->latency, g_get_monotonic_time(), buffered_ms))
+        {
+            GST_INFO_OBJECT(amltspasink, "latency %d-%d ms", priv->latency.min_ms, priv->latency.max_ms);
+            g_mutex_unlock(&priv->level_lock);
+            gst_element_post_message(GST_ELEMENT(amltspasink), gst_message_new_latency(GST_OBJECT(amltspasink)));
+            g_mutex_lock(&priv->level_lock);
+        }
+
+        g_cond_wait_until(&priv->level_cond, &priv->level_lock,
+                          g_get_monotonic_time() + BUFFER_MONITOR_INTERVAL_US);
+    }
+    priv->buffer_level = -1;
+    priv->level_state = LEVEL_STATE_UNKNOWN;
+    g_cond_broadcast(&priv->level_cond);
+    g_mutex_unlock(&priv->level_lock);
+
+    GST_INFO("quit");
+    return NULL;
+}
+
+/* start audio buffer level monitor thread */
+static int start_monitor_thread(GstAmltspasink *amltspasink)
+{
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+
+    g_mutex_lock(&priv->level_lock);
+    priv->quit_monitor = FALSE;
+    priv->first_frame = FALSE;
+    latency_window_reset(&priv->latency, g_get_monotonic_time());
+    g_mutex_unlock(&priv->level_lock);
+
+    priv->monitor_thread = g_thread_new("audio monitor thread", audio_monitor_thread, amltspasink);
+    if (!priv->monitor_thread)
+    {
+        GST_ERROR_OBJECT(amltspasink, "fail to create thread");
+        return -1;
+    }
+    return 0;
+}
+
+/* stop audio buffer level monitor thread */
+static int stop_monitor_thread(GstAmltspasink *amltspasink)
+{
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+
+    g_mutex_lock(&priv->level_lock);
+    priv->quit_monitor = TRUE;
+    g_cond_broadcast(&priv->level_cond);
+    g_mutex_unlock(&priv->level_lock);
+
+    if (priv->monitor_thread)
+    {
+        g_thread_join(priv->monitor_thread);
+        priv->monitor_thread = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Hold the stream thread once the decoder buffer reaches the high
+ * watermark, until it is back under the low one, instead of spinning in
+ * decode_audio. Returns FALSE when interrupted by a flush.
+ */
+static gboolean wait_for_buffer_space(GstAmltspasink *amltspasink)
+{
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+    gboolean pacing = FALSE;
+    gboolean ret;
+
+    g_mutex_lock(&priv->level_lock);
+    while (!priv->flushing && !priv->quit_monitor &&
+           buffer_level_pacing(priv->buffer_level, priv->low_watermark,
+                               priv->high_watermark, pacing))
+    {
+        pacing = TRUE;
+        g_cond_wait_until(&priv->level_cond, &priv->level_lock,
+                          g_get_monotonic_time() + BUFFER_PACING_WAIT_US);
+    }
+    ret = !priv->flushing;
+    g_mutex_unlock(&priv->level_lock);
+
+    return ret;
+}
+
+static guint32 bits_read(const guint8 *data, gsize size, gsize *pos, guint n)
+{
+    guint32 val = 0;
+
+    while (n--)
+    {
+        guint bit = 0;
+
+        if (*pos < size * 8)
+        {
+            bit = (data[*pos / 8] >> (7 - *pos % 8)) & 1;
+        }
+        val = (val << 1) | bit;
+        (*pos)++;
+    }
+    return val;
+}
+
+static gint aac_sample_rate_index(guint32 rate)
+{
+    static const guint32 rates[] = {96000, 88200, 64000, 48000, 44100, 32000,
+                                    24000, 22050, 16000, 12000, 11025, 8000, 7350};
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(rates); i++)
+    {
+        if (rates[i] == rate)
+            return (gint)i;
+    }
+    return -1;
+}
+
+/*
+ * Build the adts header template from an AudioSpecificConfig, ISO/IEC
+ * 14496-3 1.6.2.1. For explicit SBR/PS the core object type and rate are
+ * signalled, the decoder finds the extension in band. A config with its
+ * channels in a program config element, channel configuration 0, takes
+ * caps_channels instead, adts would need the pce in every frame.
+ */
+static gboolean adts_header_from_config(const guint8 *data, gsize size, gint caps_channels,
+                                        guint8 *header)
+{
+    gsize pos = 0;
+    guint32 object_type;
+    gint rate_index;
+    guint32 channels;
+
+    if (size < 2)
+        return FALSE;
+
+    object_type = bits_read(data, size, &pos, 5);
+    if (31 == object_type)
+        object_type = 32 + bits_read(data, size, &pos, 6);
+    rate_index = bits_read(data, size, &pos, 4);
+    if (15 == rate_index)
+        rate_index = aac_sample_rate_index(bits_read(data, size, &pos, 24));
+    channels = bits_read(data, size, &pos, 4);
+
+    if (5 == object_type || 29 == object_type)
+    {
+        /* extension rate, then the core object type */
+        if (15 == bits_read(data, size, &pos, 4))
+            bits_read(data, size, &pos, 24);
+        object_type = bits_read(data, size, &pos, 5);
+    }
+
+    if (0 == channels)
+    {
+        if (caps_channels >= 1 && caps_channels <= 6)
+            channels = caps_channels;
+        else if (8 == caps_channels)
+            channels = 7; /* 7.1 */
+    }
+
+    /* adts carries 2 bits of profile, main/lc/ssr/ltp */
+    if (object_type < 1 || object_type > 4 || rate_index < 0 || rate_index > 12 ||
+        channels < 1 || channels > 7)
+        return FALSE;
+
+    header[0] = 0xff;
+    header[1] = 0xf1; /* mpeg-4, no crc */
+    header[2] = ((object_type - 1) << 6) | (rate_index << 2) | (channels >> 2);
+    header[3] = (channels & 0x3) << 6;
+    header[4] = 0;
+    header[5] = 0x1f; /* buffer fullness 0x7ff, vbr */
+    header[6] = 0xfc;
+    return TRUE;
+}
+
+/* vorbis codec_data from matroska: xiph laced identification, comment and setup headers */
+static gboolean xiph_headers_split(GstBuffer *codec_data, GstBufferList *headers)
+{
+    GstMapInfo map;
+    gsize offset = 1;
+    gsize sizes[2] = {0, 0};
+    guint i;
+
+    gst_buffer_map(codec_data, &map, GST_MAP_READ);
+    if (map.size < 3 || map.data[0] != 2)
+        goto error;
+
+    for (i = 0; i < 2; i++)
+    {
+        do
+        {
+            if (offset >= map.size)
+                goto error;
+            sizes[i] += map.data[offset];
+        } while (map.data[offset++] == 0xff);
+    }
+    if (offset + sizes[0] + sizes[1] >= map.size)
+        goto error;
+
+    /* sub buffers share the codec_data memory */
+    gst_buffer_list_add(headers, gst_buffer_copy_region(codec_data, GST_BUFFER_COPY_MEMORY, offset, sizes[0]));
+    offset += sizes[0];
+    gst_buffer_list_add(headers, gst_buffer_copy_region(codec_data, GST_BUFFER_COPY_MEMORY, offset, sizes[1]));
+    offset += sizes[1];
+    gst_buffer_list_add(headers, gst_buffer_copy_region(codec_data, GST_BUFFER_COPY_MEMORY, offset, map.size - offset));
+
+    gst_buffer_unmap(codec_data, &map);
+    return TRUE;
+
+error:
+    gst_buffer_unmap(codec_data, &map);
+    return FALSE;
+}
+
+static void codec_headers_clear(GstAmltspasinkPrivate *priv)
+{
+    if (priv->codec_headers != NULL)
+    {
+        gst_buffer_list_unref(priv->codec_headers);
+        priv->codec_headers = NULL;
+    }
+    priv->headers_pending = FALSE;
+    priv->headers_written = 0;
+}
+
+/*
+ * Opus/FLAC/Vorbis decoders need the stream headers before the first
+ * frame: the OpusHead, the FLAC marker and STREAMINFO, the three Vorbis
+ * headers. Take them from streamheader (ogg, flacparse), else from
+ * codec_data (matroska, mp4).
+ */
+static gboolean codec_headers_setup(GstAmltspasink *amltspasink, const GstStructure *structure,
+                                    const gchar *codec)
+{
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+    const GValue *value = NULL;
+    guint i;
+
+    codec_headers_clear(priv);
+    priv->codec_headers = gst_buffer_list_new();
+
+    value = gst_structure_get_value(structure, "streamheader");
+    if (value != NULL && GST_VALUE_HOLDS_ARRAY(value))
+    {
+        for (i = 0; i < gst_value_array_get_size(value); i++)
+        {
+            const GValue *header = gst_value_array_get_value(value, i);
+
+            if (GST_VALUE_HOLDS_BUFFER(header))
+            {
+                gst_buffer_list_add(priv->codec_headers, gst_buffer_ref(gst_value_get_buffer(header)));
+            }
+        }
+    }
+    else if ((value = gst_structure_get_value(structure, "codec_data")) != NULL &&
+             GST_VALUE_HOLDS_BUFFER(value))
+    {
+        if (strcasecmp(codec, "audio/x-vorbis") == 0)
+        {
+            if (!xiph_headers_split(gst_value_get_buffer(value), priv->codec_headers))
+            {
+                GST_ERROR_OBJECT(amltspasink, "bad vorbis codec_data!");
+                codec_headers_clear(priv);
+                return FALSE;
+            }
+        }
+        else
+        {
+            gst_buffer_list_add(priv->codec_headers, gst_buffer_ref(gst_value_get_buffer(value)));
+        }
+    }
+
+    if (gst_buffer_list_length(priv->codec_headers) == 0)
+    {
+        /* headers come in band only */
+        codec_headers_clear(priv);
+        return TRUE;
+    }
+
+    GST_INFO_OBJECT(amltspasink, "%u codec headers from caps",
+                    gst_buffer_list_length(priv->codec_headers));
+    priv->headers_pending = TRUE;
+    priv->headers_written = 0;
+    return TRUE;
+}
+
+/* drop a pending track switch and what was queued for it */
+static void switch_cancel(GstAmltspasinkPrivate *priv)
+{
+    GstBuffer *buffer = NULL;
+
+    while ((buffer = (GstBuffer *)g_queue_pop_head(priv->switch_queue)) != NULL)
+    {
+        gst_buffer_unref(buffer);
+    }
+    priv->switch_pending = FALSE;
+    priv->switch_codec = NULL;
+}
+
+/*
+ * Keep the decoder buffer under latency_target in low latency mode.
+ * Audio frames are independent, so drop until the buffer is back under
+ * half the target. Returns FALSE to drop the buffer.
+ */
+static gboolean low_latency_control(GstAmltspasink *amltspasink)
+{
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+    int32_t buffered_ms = 0;
+    int32_t target = (int32_t)priv->latency_target;
+
+    /* level unknown, e.g. nothing written since a flush is shown yet */
+    if (ERROR_CODE_OK != get_audio_buffered_ms(&buffered_ms))
+    {
+        return TRUE;
+    }
+
+    if (!priv->dropping && buffered_ms > target)
+    {
+        GST_INFO_OBJECT(amltspasink, "start dropping, buffered %d ms", buffered_ms);
+        priv->dropping = TRUE;
+    }
+    else if (priv->dropping && buffered_ms < target / 2)
+    {
+        GST_INFO_OBJECT(amltspasink, "stop dropping, buffered %d ms", buffered_ms);
+        priv->dropping = FALSE;
+    }
+
+    return !priv->dropping;
+}
+
+/* feed the session drift estimator */
+static void drift_sample(GstAmltspasink *amltspasink, GstClockTime time)
+{
+    GstBaseSink *basesink = GST_BASE_SINK(amltspasink);
+    GstClock *clock = NULL;
+    GstClockTime running_time = GST_CLOCK_TIME_NONE;
+    GstClockTime now = GST_CLOCK_TIME_NONE;
+    GstClockTime base_time = GST_CLOCK_TIME_NONE;
+
+    running_time = gst_segment_to_running_time(&basesink->segment, GST_FORMAT_TIME, time);
+    if (!GST_CLOCK_TIME_IS_VALID(running_time))
+    {
+        return;
+    }
+
+    clock = gst_element_get_clock(GST_ELEMENT(amltspasink));
+    if (clock == NULL)
+    {
+        return;
+    }
+    now = gst_clock_get_time(clock);
+    base_time = gst_element_get_base_time(GST_ELEMENT(amltspasink));
+    gst_object_unref(clock);
+
+    if (now < base_time)
+    {
+        return;
+    }
+
+    session_drift_update((int64_t)GST_TIME_AS_USECONDS(now - base_time),
+                         (int64_t)GST_TIME_AS_USECONDS(running_time));
+}
+
+/*
+ * The provided clock runs on the monotonic clock and is steered towards
+ * the running time of what the decoder is playing, so other sinks sync
+ * to what is heard. Small errors are slewed, a clock far behind jumps.
+ */
+static GstClockTime audio_clock_get_time(GstClock *clock, gpointer user_data)
+{
+    GstAmltspasink *amltspasink = GST_AMLTSPASINK(user_data);
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+    gint64 now_us = g_get_monotonic_time();
+    GstClockTime now = (GstClockTime)now_us * GST_USECOND;
+    GstClockTime time = GST_CLOCK_TIME_NONE;
+    guint64 apts = 0;
+
+    UNUSED(clock);
+    g_mutex_lock(&priv->clock_lock);
+    /* no trick play: the clock has its own segment, in_fast is the streaming thread's */
+    if (TRUE == priv->clock_running && 1.0 == priv->clock_segment.rate &&
+        now_us - priv->clock_sample_us >= CLOCK_SAMPLE_INTERVAL_US &&
+        ERROR_CODE_OK == get_audio_pts(&apts) && apts != priv->clock_apts)
+    {
+        GstClockTime running_time = gst_util_uint64_scale(apts, GST_SECOND, 90000);
+        /* callers may hold our object lock, read base_time without it */
+        GstClockTime base_time = GST_ELEMENT_CAST(amltspasink)->base_time;
+
+        /* in gapless mode the decoder pts is the running time already */
+        if (!priv->gapless)
+        {
+            running_time = gst_segment_to_running_time(&priv->clock_segment, GST_FORMAT_TIME, running_time);
+        }
+
+        priv->clock_sample_us = now_us;
+        priv->clock_apts = apts;
+        if (GST_CLOCK_TIME_IS_VALID(running_time))
+        {
+            GstClockTimeDiff error = GST_CLOCK_DIFF(now + priv->clock_offset, base_time + running_time);
+
+            if (error > CLOCK_SNAP_THRESHOLD)
+            {
+                priv->clock_offset += error;
+            }
+            else
+            {
+                priv->clock_offset += CLAMP(error / CLOCK_SMOOTHING, -CLOCK_MAX_STEP, CLOCK_MAX_STEP);
+            }
+            GST_LOG_OBJECT(amltspasink, "clock error %" G_GINT64_FORMAT " ns", error);
+        }
+    }
+    time = now + priv->clock_offset;
+    g_mutex_unlock(&priv->clock_lock);
+
+    return time;
+}
+
+/* steer the clock from the decoder pts only once it moves past the current one */
+static void audio_clock_set_running(GstAmltspasink *amltspasink, gboolean running)
+{
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+    guint64 apts = 0;
+
+    if (TRUE == running && ERROR_CODE_OK != get_audio_pts(&apts))
+    {
+        apts = 0;
+    }
+    g_mutex_lock(&priv->clock_lock);
+    priv->clock_running = running;
+    priv->clock_apts = apts;
+    priv->clock_sample_us = 0;
+    g_mutex_unlock(&priv->clock_lock);
+}
+
+/* add the measured decoder delay to the latency answered by basesink */
+static void latency_query_add(GstAmltspasink *amltspasink, GstQuery *query)
+{
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+    gboolean live = FALSE;
+    GstClockTime min = 0;
+    GstClockTime max = GST_CLOCK_TIME_NONE;
+    gint min_ms, max_ms;
+
+    g_mutex_lock(&priv->level_lock);
+    min_ms = priv->latency.min_ms;
+    max_ms = priv->latency.max_ms;
+    g_mutex_unlock(&priv->level_lock);
+    if (min_ms < 0)
+    {
+        return;
+    }
+
+    gst_query_parse_latency(query, &live, &min, &max);
+    min += min_ms * GST_MSECOND;
+    if (GST_CLOCK_TIME_IS_VALID(max))
+    {
+        max += max_ms * GST_MSECOND;
+    }
+    gst_query_set_latency(query, live, min, max);
+    GST_DEBUG_OBJECT(amltspasink, "latency, live: %d, min: %" GST_TIME_FORMAT ", max: %" GST_TIME_FORMAT,
+                     live, GST_TIME_ARGS(min), GST_TIME_ARGS(max));
+}
 /*******************************utils end******************************/
 
 /* gst api */
@@ -265,8 +878,47 @@ gst_amltspasink_class_init(GstAmltspasinkClass *klass)
     g_object_class_install_property(gobject_class, PROP_MUTE,
                                     g_param_spec_boolean("mute", "Mute", "Mute state of system",
                                                          FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_LOW_LATENCY,
+                                    g_param_spec_boolean("low-latency", "Low Latency",
+                                                         "Keep the decoder buffer under latency-target, for live sources",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_LATENCY_TARGET,
+                                    g_param_spec_uint("latency-target", "Latency Target",
+                                                      "Max decoder buffer depth in low latency mode, in ms",
+                                                      MIN_LATENCY_TARGET, MAX_LATENCY_TARGET, DEFAULT_LATENCY_TARGET,
+                                                      G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_BUFFERED_TIME,
+                                    g_param_spec_int("buffered-time", "Buffered Time",
+                                                     "Decoder buffer depth in ms, -1 if unknown",
+                                                     -1, G_MAXINT, -1, G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_SYNC_MODE,
+                                    g_param_spec_enum("sync-mode", "Sync Mode",
+                                                      "AV sync master of the tsplayer session",
+                                                      GST_TYPE_AMLTSPASINK_SYNC_MODE, SESSION_SYNC_AUTO,
+                                                      G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_DRIFT_COMPENSATION,
+                                    g_param_spec_boolean("drift-compensation", "Drift Compensation",
+                                                         "Correct the play rate when the stream clock drifts from ours",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_BUFFER_LEVEL,
+                                    g_param_spec_int("buffer-level", "Buffer Level",
+                                                     "Decoder es buffer occupancy in percent, -1 if unknown",
+                                                     -1, 100, -1, G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_BUFFER_WATERMARKS,
+                                    g_param_spec_string("buffer-watermarks", "Buffer Watermarks",
+                                                        "Decoder buffer watermarks in percent, Format: low,high",
+                                                        "10,80", G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_PASSTHROUGH,
+                                    g_param_spec_boolean("passthrough", "Passthrough",
+                                                         "Output AC-3/E-AC-3/DTS as bitstream to HDMI/SPDIF",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_GAPLESS,
+                                    g_param_spec_boolean("gapless", "Gapless",
+                                                         "Write running time to the decoder so items and segments play back to back",
+                                                         FALSE, G_PARAM_READWRITE));
 
     gstelement_class->change_state = GST_DEBUG_FUNCPTR(gst_amltspasink_change_state);
+    gstelement_class->provide_clock = GST_DEBUG_FUNCPTR(gst_amltspasink_provide_clock);
 
     base_sink_class->get_caps = GST_DEBUG_FUNCPTR(gst_amltspasink_get_caps);
     base_sink_class->set_caps = GST_DEBUG_FUNCPTR(gst_amltspasink_set_caps);
@@ -309,6 +961,39 @@ gst_amltspasink_init(GstAmltspasink *amltspasink)
     amltspasink->priv.mute_pending = FALSE;
     amltspasink->priv.vol_bak = DEFAULT_VOLUME;
     amltspasink->priv.in_fast = FALSE;
+    amltspasink->priv.aac_raw = FALSE;
+    amltspasink->priv.codec_headers = NULL;
+    amltspasink->priv.headers_pending = FALSE;
+    amltspasink->priv.headers_written = 0;
+    amltspasink->priv.low_latency = FALSE;
+    amltspasink->priv.latency_target = DEFAULT_LATENCY_TARGET;
+    amltspasink->priv.dropping = FALSE;
+    amltspasink->priv.sync_mode = SESSION_SYNC_AUTO;
+    amltspasink->priv.drift_compensation = FALSE;
+    g_mutex_init(&amltspasink->priv.level_lock);
+    g_cond_init(&amltspasink->priv.level_cond);
+    amltspasink->priv.buffer_level = -1;
+    amltspasink->priv.low_watermark = BUFFER_LOW_WATERMARK;
+    amltspasink->priv.high_watermark = BUFFER_HIGH_WATERMARK;
+    amltspasink->priv.level_state = LEVEL_STATE_UNKNOWN;
+    latency_window_reset(&amltspasink->priv.latency, 0);
+    amltspasink->priv.first_frame = FALSE;
+    amltspasink->priv.passthrough = FALSE;
+    amltspasink->priv.gapless = FALSE;
+    amltspasink->priv.adec_started = FALSE;
+    amltspasink->priv.codec = NULL;
+    amltspasink->priv.switch_pending = FALSE;
+    amltspasink->priv.switch_codec = NULL;
+    amltspasink->priv.switch_queue = g_queue_new();
+    g_mutex_init(&amltspasink->priv.clock_lock);
+    gst_segment_init(&amltspasink->priv.clock_segment, GST_FORMAT_TIME);
+    amltspasink->priv.clock_running = FALSE;
+    amltspasink->priv.clock_offset = 0;
+    amltspasink->priv.clock_sample_us = 0;
+    amltspasink->priv.clock_apts = 0;
+    amltspasink->priv.provided_clock = gst_audio_clock_new("GstAmltspasinkClock",
+                                                           audio_clock_get_time, amltspasink, NULL);
+    GST_OBJECT_FLAG_SET(amltspasink, GST_ELEMENT_FLAG_PROVIDE_CLOCK);
 
     return;
 }
@@ -372,6 +1057,72 @@ void gst_amltspasink_set_property(GObject *object, guint property_id,
         }
         break;
     }
+    case PROP_LOW_LATENCY:
+    {
+        amltspasink->priv.low_latency = g_value_get_boolean(value);
+        GST_FIXME_OBJECT(amltspasink, "set_property, low latency: %d",
+                         amltspasink->priv.low_latency);
+        set_adec_low_latency(amltspasink->priv.low_latency);
+        break;
+    }
+    case PROP_LATENCY_TARGET:
+    {
+        amltspasink->priv.latency_target = g_value_get_uint(value);
+        GST_FIXME_OBJECT(amltspasink, "set_property, latency target: %u ms",
+                         amltspasink->priv.latency_target);
+        break;
+    }
+    case PROP_SYNC_MODE:
+    {
+        amltspasink->priv.sync_mode = g_value_get_enum(value);
+        GST_FIXME_OBJECT(amltspasink, "set_property, sync mode: %d",
+                         amltspasink->priv.sync_mode);
+        set_adec_sync_mode(amltspasink->priv.sync_mode);
+        break;
+    }
+    case PROP_DRIFT_COMPENSATION:
+    {
+        amltspasink->priv.drift_compensation = g_value_get_boolean(value);
+        GST_FIXME_OBJECT(amltspasink, "set_property, drift compensation: %d",
+                         amltspasink->priv.drift_compensation);
+        session_drift_reset();
+        break;
+    }
+    case PROP_BUFFER_WATERMARKS:
+    {
+        const gchar *str = g_value_get_string(value);
+        gint low = -1;
+        gint high = -1;
+
+        if (str == NULL || 2 != sscanf(str, "%d,%d", &low, &high) ||
+            low < 0 || high > 100 || low >= high)
+        {
+            GST_ERROR_OBJECT(amltspasink, "bad buffer watermarks: %s", str ? str : "null");
+            break;
+        }
+        GST_FIXME_OBJECT(amltspasink, "set_property, buffer watermarks: %d,%d", low, high);
+        g_mutex_lock(&amltspasink->priv.level_lock);
+        amltspasink->priv.low_watermark = low;
+        amltspasink->priv.high_watermark = high;
+        g_cond_broadcast(&amltspasink->priv.level_cond);
+        g_mutex_unlock(&amltspasink->priv.level_lock);
+        break;
+    }
+    case PROP_PASSTHROUGH:
+    {
+        amltspasink->priv.passthrough = g_value_get_boolean(value);
+        GST_FIXME_OBJECT(amltspasink, "set_property, passthrough: %d",
+                         amltspasink->priv.passthrough);
+        set_adec_passthrough(amltspasink->priv.passthrough);
+        break;
+    }
+    case PROP_GAPLESS:
+    {
+        amltspasink->priv.gapless = g_value_get_boolean(value);
+        GST_FIXME_OBJECT(amltspasink, "set_property, gapless: %d",
+                         amltspasink->priv.gapless);
+        break;
+    }
     default:
     {
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
@@ -412,6 +1163,62 @@ void gst_amltspasink_get_property(GObject *object, guint property_id,
         g_value_set_boolean(value, amltspasink->priv.mute);
         break;
     }
+    case PROP_LOW_LATENCY:
+    {
+        g_value_set_boolean(value, amltspasink->priv.low_latency);
+        break;
+    }
+    case PROP_LATENCY_TARGET:
+    {
+        g_value_set_uint(value, amltspasink->priv.latency_target);
+        break;
+    }
+    case PROP_BUFFERED_TIME:
+    {
+        int32_t buffered_ms = -1;
+
+        if (ERROR_CODE_OK != get_audio_buffered_ms(&buffered_ms))
+        {
+            buffered_ms = -1;
+        }
+        g_value_set_int(value, (int)buffered_ms);
+        break;
+    }
+    case PROP_SYNC_MODE:
+    {
+        g_value_set_enum(value, amltspasink->priv.sync_mode);
+        break;
+    }
+    case PROP_DRIFT_COMPENSATION:
+    {
+        g_value_set_boolean(value, amltspasink->priv.drift_compensation);
+        break;
+    }
+    case PROP_BUFFER_LEVEL:
+    {
+        g_mutex_lock(&amltspasink->priv.level_lock);
+        g_value_set_int(value, amltspasink->priv.buffer_level);
+        g_mutex_unlock(&amltspasink->priv.level_lock);
+        break;
+    }
+    case PROP_BUFFER_WATERMARKS:
+    {
+        g_mutex_lock(&amltspasink->priv.level_lock);
+        g_value_take_string(value, g_strdup_printf("%d,%d", amltspasink->priv.low_watermark,
+                                                   amltspasink->priv.high_watermark));
+        g_mutex_unlock(&amltspasink->priv.level_lock);
+        break;
+    }
+    case PROP_PASSTHROUGH:
+    {
+        g_value_set_boolean(value, amltspasink->priv.passthrough);
+        break;
+    }
+    case PROP_GAPLESS:
+    {
+        g_value_set_boolean(value, amltspasink->priv.gapless);
+        break;
+    }
     default:
     {
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
@@ -427,6 +1234,13 @@ void gst_amltspasink_dispose(GObject *object)
     GST_DEBUG_OBJECT(amltspasink, "dispose");
 
     /* clean up as possible.  may be called multiple times */
+    if (amltspasink->priv.provided_clock != NULL)
+    {
+        /* the pipeline may still hold the clock, stop it calling back */
+        gst_audio_clock_invalidate(GST_AUDIO_CLOCK(amltspasink->priv.provided_clock));
+        gst_object_unref(amltspasink->priv.provided_clock);
+        amltspasink->priv.provided_clock = NULL;
+    }
 
     G_OBJECT_CLASS(gst_amltspasink_parent_class)->dispose(object);
 }
@@ -438,6 +1252,12 @@ void gst_amltspasink_finalize(GObject *object)
     GST_DEBUG_OBJECT(amltspasink, "finalize");
 
     /* clean up object here */
+    switch_cancel(&amltspasink->priv);
+    g_queue_free(amltspasink->priv.switch_queue);
+    codec_headers_clear(&amltspasink->priv);
+    g_mutex_clear(&amltspasink->priv.level_lock);
+    g_cond_clear(&amltspasink->priv.level_cond);
+    g_mutex_clear(&amltspasink->priv.clock_lock);
 
     G_OBJECT_CLASS(gst_amltspasink_parent_class)->finalize(object);
 }
@@ -457,9 +1277,19 @@ gst_amltspasink_change_state(GstElement *element, GstStateChange transition)
             GST_ERROR_OBJECT(amltspasink, "init_adec failed!");
             return GST_STATE_CHANGE_FAILURE;
         }
+        /* the session forgets the sync mode when it is released */
+        if (SESSION_SYNC_AUTO != amltspasink->priv.sync_mode)
+        {
+            set_adec_sync_mode(amltspasink->priv.sync_mode);
+        }
+        set_adec_passthrough(amltspasink->priv.passthrough);
+        start_monitor_thread(amltspasink);
         break;
 
     case GST_STATE_CHANGE_READY_TO_PAUSED:
+        gst_element_post_message(element,
+                                 gst_message_new_clock_provide(GST_OBJECT_CAST(element),
+                                                               amltspasink->priv.provided_clock, TRUE));
         break;
 
     case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
@@ -468,6 +1298,7 @@ gst_amltspasink_change_state(GstElement *element, GstStateChange transition)
             resume_adec();
         }
         amltspasink->priv.paused = FALSE;
+        audio_clock_set_running(amltspasink, TRUE);
         break;
 
     default:
@@ -480,16 +1311,37 @@ gst_amltspasink_change_state(GstElement *element, GstStateChange transition)
     {
     case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
     {
+        audio_clock_set_running(amltspasink, FALSE);
         amltspasink->priv.paused = TRUE;
         pause_adec();
         break;
     }
 
     case GST_STATE_CHANGE_PAUSED_TO_READY:
+        switch_cancel(&amltspasink->priv);
+        /* the next stream sets the decoder up from scratch in set_caps */
+        if (TRUE == amltspasink->priv.adec_started)
+        {
+            stop_adec();
+        }
+        amltspasink->priv.adec_started = FALSE;
+        amltspasink->priv.codec = NULL;
+        amltspasink->priv.last_pts_valid = FALSE;
+        amltspasink->priv.dropping = FALSE;
+        g_mutex_lock(&amltspasink->priv.level_lock);
+        amltspasink->priv.first_frame = FALSE;
+        latency_window_reset(&amltspasink->priv.latency, g_get_monotonic_time());
+        g_mutex_unlock(&amltspasink->priv.level_lock);
+        gst_element_post_message(element,
+                                 gst_message_new_clock_lost(GST_OBJECT_CAST(element),
+                                                            amltspasink->priv.provided_clock));
         break;
 
     case GST_STATE_CHANGE_READY_TO_NULL:
+        stop_monitor_thread(amltspasink);
         amltspasink->priv.paused = FALSE;
+        amltspasink->priv.adec_started = FALSE;
+        amltspasink->priv.codec = NULL;
         /* stop_adec() causes failure when audio track switch  */
         stop_adec();
         deinit_adec();
@@ -502,6 +1354,15 @@ gst_amltspasink_change_state(GstElement *element, GstStateChange transition)
     return ret;
 }
 
+static GstClock *
+gst_amltspasink_provide_clock(GstElement *element)
+{
+    GstAmltspasink *amltspasink = GST_AMLTSPASINK(element);
+
+    GST_DEBUG_OBJECT(amltspasink, "provide_clock");
+    return GST_CLOCK_CAST(gst_object_ref(amltspasink->priv.provided_clock));
+}
+
 static GstCaps *
 gst_amltspasink_get_caps(GstBaseSink *sink, GstCaps *filter)
 {
@@ -553,6 +1414,8 @@ gst_amltspasink_set_caps(GstBaseSink *sink, GstCaps *caps)
 
     structure = gst_caps_get_structure(caps, 0);
     codec = gst_structure_get_name(structure);
+    amltspasink->priv.aac_raw = FALSE;
+    codec_headers_clear(&amltspasink->priv);
     if (strcasecmp(codec, "audio/mpeg") == 0)
     {
         gint version = 0;
@@ -580,7 +1443,36 @@ gst_amltspasink_set_caps(GstBaseSink *sink, GstCaps *caps)
         }
         else if (version == 2 || version == 4)
         {
+            const gchar *format = gst_structure_get_string(structure, "stream-format");
+
             codec = "audio/aac";
+            if (format && strcmp(format, "loas") == 0)
+            {
+                codec = "audio/x-latm";
+            }
+            else if (format && strcmp(format, "raw") == 0)
+            {
+                const GValue *value = gst_structure_get_value(structure, "codec_data");
+                GstMapInfo map;
+                gboolean ok = FALSE;
+                gint channels = 0;
+
+                if (value == NULL || !GST_VALUE_HOLDS_BUFFER(value))
+                {
+                    GST_ERROR_OBJECT(amltspasink, "raw aac without codec_data!");
+                    return FALSE;
+                }
+                gst_structure_get_int(structure, "channels", &channels);
+                gst_buffer_map(gst_value_get_buffer(value), &map, GST_MAP_READ);
+                ok = adts_header_from_config(map.data, map.size, channels, amltspasink->priv.adts_header);
+                gst_buffer_unmap(gst_value_get_buffer(value), &map);
+                if (!ok)
+                {
+                    GST_ERROR_OBJECT(amltspasink, "can not support the aac config!");
+                    return FALSE;
+                }
+                amltspasink->priv.aac_raw = TRUE;
+            }
         }
         else
         {
@@ -588,10 +1480,47 @@ gst_amltspasink_set_caps(GstBaseSink *sink, GstCaps *caps)
             return FALSE;
         }
     }
+    else if (strcasecmp(codec, "audio/x-ac4") == 0)
+    {
+        /* the adaptor maps ac4 as audio/ac4 */
+        codec = "audio/ac4";
+    }
+    else if (strcasecmp(codec, "audio/x-opus") == 0 ||
+             strcasecmp(codec, "audio/x-flac") == 0 ||
+             strcasecmp(codec, "audio/x-vorbis") == 0)
+    {
+        if (!codec_headers_setup(amltspasink, structure, codec))
+        {
+            return FALSE;
+        }
+    }
 
     GST_DEBUG_OBJECT(amltspasink, "set_caps, codec: %s", codec);
+
+    /*
+     * A new track while decoding: the old track keeps playing out of the
+     * decoder buffer, the codec only changes once playback reaches the
+     * new track, see switch_queue_buffer().
+     */
+    if (TRUE == amltspasink->priv.adec_started && FALSE == amltspasink->priv.in_fast)
+    {
+        switch_cancel(&amltspasink->priv);
+        /* new headers need a fresh decoder too */
+        if (strcasecmp(codec, amltspasink->priv.codec) != 0 ||
+            amltspasink->priv.codec_headers != NULL)
+        {
+            GST_INFO_OBJECT(amltspasink, "track switch %s -> %s, deferred",
+                            amltspasink->priv.codec, codec);
+            amltspasink->priv.switch_codec = codec;
+            amltspasink->priv.switch_pending = TRUE;
+        }
+        return TRUE;
+    }
+
     configure_adec(codec);
     start_adec();
+    amltspasink->priv.codec = codec;
+    amltspasink->priv.adec_started = TRUE;
     if (TRUE == amltspasink->priv.vol_pending)
     {
         amltspasink->priv.vol_pending = FALSE;
@@ -721,6 +1650,15 @@ gst_amltspasink_unlock(GstBaseSink *sink)
 
     GST_DEBUG_OBJECT(amltspasink, "unlock");
 
+    /* interrupt a render paced on the decoder buffer level */
+    g_mutex_lock(&amltspasink->priv.level_lock);
+    amltspasink->priv.flushing = TRUE;
+    g_cond_broadcast(&amltspasink->priv.level_cond);
+    g_mutex_unlock(&amltspasink->priv.level_lock);
+
+    /* and a write waiting for decoder buffer space */
+    set_adec_cancel(1);
+
     return TRUE;
 }
 
@@ -734,6 +1672,11 @@ gst_amltspasink_unlock_stop(GstBaseSink *sink)
 
     GST_DEBUG_OBJECT(amltspasink, "unlock_stop");
 
+    set_adec_cancel(0);
+    g_mutex_lock(&amltspasink->priv.level_lock);
+    amltspasink->priv.flushing = FALSE;
+    g_mutex_unlock(&amltspasink->priv.level_lock);
+
     return TRUE;
 }
 
@@ -752,9 +1695,35 @@ gst_amltspasink_query(GstBaseSink *sink, GstQuery *query)
     {
         GstFormat format;
         int64_t position_us;
+        gboolean gapless = FALSE;
+
+        GST_OBJECT_LOCK(sink);
+        gapless = amltspasink->priv.gapless && 1.0 == sink->segment.rate;
+        GST_OBJECT_UNLOCK(sink);
 
         gst_query_parse_position(query, &format, NULL);
-        if (format == GST_FORMAT_TIME)
+        if (format == GST_FORMAT_TIME && gapless)
+        {
+            /* the decoder pts is running time, map it back into the current item */
+            uint64_t apts = 0;
+            GstClockTime position = GST_CLOCK_TIME_NONE;
+
+            if (ERROR_CODE_OK == get_audio_pts(&apts) && 0 != apts)
+            {
+                GST_OBJECT_LOCK(sink);
+                position = gst_segment_position_from_running_time(&sink->segment, GST_FORMAT_TIME,
+                                                                  gst_util_uint64_scale(apts, GST_SECOND, 90000));
+                position = gst_segment_to_stream_time(&sink->segment, GST_FORMAT_TIME, position);
+                GST_OBJECT_UNLOCK(sink);
+            }
+            if (GST_CLOCK_TIME_IS_VALID(position))
+            {
+                gst_query_set_position(query, format, (gint64)position);
+                GST_DEBUG_OBJECT(amltspasink, "query, position: %" GST_TIME_FORMAT, GST_TIME_ARGS(position));
+                return TRUE;
+            }
+        }
+        else if (format == GST_FORMAT_TIME)
         {
             get_playing_position(&position_us);
             gst_query_set_position(query, format, (gint64)position_us);
@@ -766,6 +1735,16 @@ gst_amltspasink_query(GstBaseSink *sink, GstQuery *query)
         break;
     }
 
+    case GST_QUERY_LATENCY:
+    {
+        ret = GST_BASE_SINK_CLASS(gst_amltspasink_parent_class)->query(sink, query);
+        if (ret)
+        {
+            latency_query_add(amltspasink, query);
+        }
+        return ret;
+    }
+
     default:
         break;
     }
@@ -788,6 +1767,10 @@ gst_amltspasink_event(GstBaseSink *sink, GstEvent *event)
     switch (GST_EVENT_TYPE(event))
     {
     case GST_EVENT_EOS:
+        if (TRUE == priv->switch_pending)
+        {
+            switch_track(amltspasink);
+        }
         GST_OBJECT_LOCK(sink);
         priv->received_eos = TRUE;
         priv->eos = FALSE;
@@ -799,13 +1782,41 @@ gst_amltspasink_event(GstBaseSink *sink, GstEvent *event)
     case GST_EVENT_FLUSH_START:
     {
         set_volume(0);
+        audio_clock_set_running(amltspasink, FALSE);
         break;
     }
 
     case GST_EVENT_FLUSH_STOP:
     {
         set_volume(amltspasink->priv.vol_bak);
-        flush_adec();
+        if (TRUE == priv->switch_pending)
+        {
+            /* nothing left of the old track, switch right away */
+            if (switch_restart(amltspasink, priv->switch_codec))
+            {
+                priv->codec = priv->switch_codec;
+            }
+            switch_cancel(priv);
+        }
+        else
+        {
+            flush_adec();
+        }
+        amltspasink->priv.dropping = FALSE;
+        priv->last_pts_valid = FALSE;
+        /* the restarted decoder needs the headers again */
+        priv->headers_pending = (priv->codec_headers != NULL);
+        priv->headers_written = 0;
+        /* the latency measured before the flush is gone with the data */
+        g_mutex_lock(&priv->level_lock);
+        priv->first_frame = FALSE;
+        latency_window_reset(&priv->latency, g_get_monotonic_time());
+        g_mutex_unlock(&priv->level_lock);
+        session_drift_reset();
+        if (GST_STATE(amltspasink) == GST_STATE_PLAYING)
+        {
+            audio_clock_set_running(amltspasink, TRUE);
+        }
         break;
     }
 
@@ -825,6 +1836,10 @@ gst_amltspasink_event(GstBaseSink *sink, GstEvent *event)
             set_volume(amltspasink->priv.vol_bak);
             amltspasink->priv.in_fast = FALSE;
         }
+        g_mutex_lock(&priv->clock_lock);
+        priv->clock_segment = segment;
+        g_mutex_unlock(&priv->clock_lock);
+        session_drift_reset();
         break;
     }
 
@@ -915,6 +1930,20 @@ gst_get_pts_of_gstbuffer(GstBaseSink *sink, GstBuffer *buffer,
     }
 
     ret = gst_get_timestamp_of_gstbuffer(sink, buffer, &timestamp);
+    if (ret == TRUE && amltspasink->priv.gapless && 1.0 == sink->segment.rate)
+    {
+        /*
+         * gapless: running time, continuous across items and segments, so
+         * one decoder session plays them back to back. Trick play comes
+         * with a flushing seek and keeps the buffer pts.
+         */
+        timestamp = gst_segment_to_running_time(&sink->segment, GST_FORMAT_TIME, timestamp);
+        if (!GST_CLOCK_TIME_IS_VALID(timestamp))
+        {
+            /* before the segment */
+            timestamp = 0;
+        }
+    }
     if (ret == TRUE)
     {
         *pts = timestamp * 9LL / 100000LL;
@@ -923,26 +1952,254 @@ gst_get_pts_of_gstbuffer(GstBaseSink *sink, GstBuffer *buffer,
     return ret;
 }
 
+/*
+ * A pts jump past PTS_DISCONT_THRESHOLD re-anchors tsync on the new pts.
+ * A DISCONT buffer only lowers the threshold to
+ * PTS_DISCONT_THRESHOLD_FLAGGED: after a packet loss the timeline
+ * usually goes on, and re-anchoring then would glitch sync for nothing.
+ * Streaming thread only.
+ */
+static void pts_continuity(GstAmltspasink *amltspasink, GstBuffer *buffer, guint64 pts)
+{
+    GstAmltspasinkPrivate *priv = &amltspasink->priv;
+    gint64 threshold = GST_BUFFER_IS_DISCONT(buffer) ? PTS_DISCONT_THRESHOLD_FLAGGED : PTS_DISCONT_THRESHOLD;
+    gint64 delta = (gint64)(pts - priv->last_pts);
+
+    if (priv->last_pts_valid && ABS(delta) > threshold)
+    {
+        GST_INFO_OBJECT(amltspasink, "pts discontinuity, %" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT "%s",
+                        priv->last_pts, pts, GST_BUFFER_IS_DISCONT(buffer) ? ", discont" : "");
+        session_pts_discontinuity(0, pts);
+    }
+    priv->last_pts_valid = TRUE;
+    priv->last_pts = pts;
+}
+
+static void write_buffer(GstAmltspasink *amltspasink, GstBuffer *buffer)
+{
+    GstAmltspasinkPrivate *priv = &(amltspasink->priv);
+    GstMapInfo map;
+    GstClockTime pts = 0;
+    int ret = ERROR_CODE_OK;
+
+    gst_buffer_map(buffer, &map, GST_MAP_READ);
+    if (gst_get_pts_of_gstbuffer(GST_BASE_SINK(amltspasink), buffer, &pts) && FALSE == priv->in_fast)
+    {
+        pts_continuity(amltspasink, buffer, pts);
+    }
+    priv->final_apts = pts;
+
+    if (TRUE == priv->headers_pending)
+    {
+        guint len = gst_buffer_list_length(priv->codec_headers);
+
+        /* a header the decoder did not take is retried ahead of the next frame */
+        while (priv->headers_written < len && ERROR_CODE_OK == ret)
+        {
+            GstBuffer *header = gst_buffer_list_get(priv->codec_headers, priv->headers_written);
+            GstMapInfo header_map;
+
+            gst_buffer_map(header, &header_map, GST_MAP_READ);
+            ret = decode_audio(header_map.data, header_map.size, pts);
+            gst_buffer_unmap(header, &header_map);
+            if (ERROR_CODE_OK == ret)
+            {
+                priv->headers_written++;
+            }
+        }
+        if (ERROR_CODE_OK != ret)
+        {
+            /* undecodable without all the headers */
+            GST_DEBUG_OBJECT(amltspasink, "codec header %u not written: %d, drop buffer",
+                             priv->headers_written, ret);
+            gst_buffer_unmap(buffer, &map);
+            return;
+        }
+        priv->headers_pending = FALSE;
+    }
+
+    GST_DEBUG_OBJECT(amltspasink, "render---size: 0x%zx, apts: %lld",
+                     map.size, pts);
+    if (TRUE == priv->aac_raw)
+    {
+        /* the payload is written after the header, not copied behind it */
+        guint8 header[7];
+        gsize frame_len = map.size + sizeof(header);
+
+        if (frame_len > ADTS_MAX_FRAME_LEN)
+        {
+            GST_WARNING_OBJECT(amltspasink, "aac frame of %zu bytes does not fit adts, drop it", map.size);
+            gst_buffer_unmap(buffer, &map);
+            return;
+        }
+        memcpy(header, priv->adts_header, sizeof(header));
+        header[3] |= (frame_len >> 11) & 0x3;
+        header[4] = (frame_len >> 3) & 0xff;
+        header[5] |= (frame_len & 0x7) << 5;
+        ret = decode_audio_gather(header, sizeof(header), map.data, map.size, pts);
+    }
+    else
+    {
+        ret = decode_audio(map.data, map.size, pts);
+    }
+    if (ERROR_CODE_RETRY == ret)
+    {
+        GST_DEBUG_OBJECT(amltspasink, "decoder full, drop buffer");
+        priv->dropping = TRUE;
+    }
+    else if (ERROR_CODE_CANCELLED == ret)
+    {
+        /* unlocked for a flush or state change */
+        GST_DEBUG_OBJECT(amltspasink, "write cancelled, drop buffer");
+    }
+
+    gst_buffer_unmap(buffer, &map);
+}
+
+/*
+ * Restart the decoder on the new codec. If the in place switch fails,
+ * fall back to a full stop, configure and start. Posts an error and
+ * returns FALSE when the decoder is left without a running codec.
+ */
+static gboolean switch_restart(GstAmltspasink *amltspasink, const gchar *codec)
+{
+    if (ERROR_CODE_OK == switch_adec(codec))
+    {
+        return TRUE;
+    }
+
+    GST_WARNING_OBJECT(amltspasink, "switch_adec to %s failed, restart the decoder", codec);
+    stop_adec();
+    if (ERROR_CODE_OK == configure_adec(codec) && ERROR_CODE_OK == start_adec())
+    {
+        return TRUE;
+    }
+
+    GST_ELEMENT_ERROR(amltspasink, STREAM, DECODE, (NULL),
+                      ("failed to switch the audio decoder to %s", codec));
+    return FALSE;
+}
+
+/*
+ * Restart the decoder on the new codec and feed it the queued buffers.
+ * Buffers behind the current position were covered by the old track.
+ * Returns FALSE, with the queue dropped, when the decoder is gone.
+ */
+static gboolean switch_track(GstAmltspasink *amltspasink)
+{
+    GstAmltspasinkPrivate *priv = &(amltspasink->priv);
+    GstBuffer *buffer = NULL;
+    uint64_t apts = 0;
+    guint dropped = 0;
+
+    if (ERROR_CODE_OK != get_audio_pts(&apts))
+    {
+        apts = 0;
+    }
+    GST_INFO_OBJECT(amltspasink, "switch %s -> %s at apts %llu, queued %u",
+                    priv->codec, priv->switch_codec, apts,
+                    g_queue_get_length(priv->switch_queue));
+
+    if (!switch_restart(amltspasink, priv->switch_codec))
+    {
+        switch_cancel(priv);
+        return FALSE;
+    }
+    priv->codec = priv->switch_codec;
+    priv->switch_pending = FALSE;
+    priv->switch_codec = NULL;
+
+    while ((buffer = (GstBuffer *)g_queue_pop_head(priv->switch_queue)) != NULL)
+    {
+        GstClockTime pts = 0;
+
+        if (gst_get_pts_of_gstbuffer(GST_BASE_SINK(amltspasink), buffer, &pts) && pts < apts)
+        {
+            dropped++;
+        }
+        else
+        {
+            write_buffer(amltspasink, buffer);
+        }
+        gst_buffer_unref(buffer);
+    }
+    GST_DEBUG_OBJECT(amltspasink, "dropped %u buffers behind apts", dropped);
+    return TRUE;
+}
+
+/*
+ * Hold the new track until playback reaches its first pts, or the old
+ * track has run dry, then switch. The decoder keeps playing the old
+ * track meanwhile, so there is neither a mute gap nor a video stall.
+ */
+static gboolean switch_queue_buffer(GstAmltspasink *amltspasink, GstBuffer *buffer)
+{
+    GstAmltspasinkPrivate *priv = &(amltspasink->priv);
+    uint64_t apts = 0;
+    int32_t buffered_ms = 0;
+
+    if (g_queue_is_empty(priv->switch_queue))
+    {
+        GstClockTime pts = 0;
+
+        gst_get_pts_of_gstbuffer(GST_BASE_SINK(amltspasink), buffer, &pts);
+        priv->switch_pts = pts;
+    }
+    g_queue_push_tail(priv->switch_queue, gst_buffer_ref(buffer));
+
+    if (g_queue_get_length(priv->switch_queue) < SWITCH_QUEUE_MAX &&
+        ERROR_CODE_OK == get_audio_pts(&apts) && apts < priv->switch_pts &&
+        ERROR_CODE_OK == get_audio_buffered_ms(&buffered_ms) && buffered_ms > SWITCH_DRAIN_MS)
+    {
+        return TRUE;
+    }
+
+    return switch_track(amltspasink);
+}
+
 static GstFlowReturn
 gst_amltspasink_render(GstBaseSink *sink, GstBuffer *buffer)
 {
     GstAmltspasink *amltspasink = GST_AMLTSPASINK(sink);
     GstAmltspasinkPrivate *priv = &(amltspasink->priv);
 
-    /* Disable decode_audio when fast forward */
-    if (FALSE == priv->in_fast)
+    if (priv->drift_compensation && !priv->in_fast && GST_BUFFER_PTS_IS_VALID(buffer))
+    {
+        drift_sample(amltspasink, GST_BUFFER_PTS(buffer));
+    }
+
+    if (priv->low_latency && !low_latency_control(amltspasink))
+    {
+        GST_DEBUG_OBJECT(amltspasink, "drop buffer in low latency mode");
+        return GST_FLOW_OK;
+    }
+
+    /* the headers from caps are written by write_buffer, skip in band copies */
+    if (priv->codec_headers != NULL && GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER))
     {
-        GstMapInfo map;
-        GstClockTime pts;
-        gst_buffer_map(buffer, &map, GST_MAP_READ);
-        gst_get_pts_of_gstbuffer(sink, buffer, &pts);
-        priv->final_apts = pts;
+        return GST_FLOW_OK;
+    }
 
-        GST_DEBUG_OBJECT(amltspasink, "render---size: 0x%zx, apts: %lld",
-                         map.size, pts);
-        decode_audio(map.data, map.size, pts);
+    /* low latency mode drops instead of waiting for room */
+    if (!priv->low_latency && !priv->in_fast && !wait_for_buffer_space(amltspasink))
+    {
+        return GST_FLOW_FLUSHING;
+    }
 
-        gst_buffer_unmap(buffer, &map);
+    /* Disable decode_audio when fast forward */
+    if (FALSE == priv->in_fast)
+    {
+        if (TRUE == priv->switch_pending)
+        {
+            if (!switch_queue_buffer(amltspasink, buffer))
+            {
+                return GST_FLOW_ERROR;
+            }
+        }
+        else
+        {
+            write_buffer(amltspasink, buffer);
+        }
     }
 
     return GST_FLOW_OK;
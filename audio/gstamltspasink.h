@@ -22,6 +22,7 @@
 #define _GST_AMLTSPASINK_H_
 
 #include <gst/base/gstbasesink.h>
+#include "bufferlevel.h"
 
 G_BEGIN_DECLS
 
@@ -54,6 +55,56 @@ typedef struct _GstAmltspasinkPrivate
     gint vol_bak;          /* backup volume before mute*/
 
     gboolean in_fast;
+
+    gboolean aac_raw;       /* stream-format=raw, adts header added per frame */
+    guint8 adts_header[7];  /* header template from codec_data */
+
+    GstBufferList *codec_headers; /* opus/flac/vorbis headers from caps */
+    gboolean headers_pending;     /* write codec_headers ahead of next frame */
+    guint headers_written;        /* codec_headers the decoder took so far */
+
+    gboolean low_latency;  /* keep decoder buffer under latency_target */
+    guint latency_target;  /* max decoder buffer depth, ms */
+    gboolean dropping;     /* dropping until buffer is under half target */
+
+    gint sync_mode;              /* SESSION_SYNC_* */
+    gboolean drift_compensation; /* correct rate on stream clock drift */
+    gboolean passthrough;        /* ac3/eac3/dts bitstream output */
+    gboolean gapless;            /* decoder timeline in running time */
+
+    /* pts discontinuity, streaming thread only */
+    gboolean last_pts_valid;
+    guint64 last_pts; /* 90KHz */
+
+    /* decoder buffer level monitor, protected by level_lock */
+    GThread *monitor_thread;
+    gboolean quit_monitor;
+    gboolean flushing;
+    GMutex level_lock;
+    GCond level_cond;
+    gint buffer_level;   /* percent, -1 if unknown */
+    gint low_watermark;  /* percent */
+    gint high_watermark; /* percent */
+    gint level_state;      /* LEVEL_STATE_* */
+    LatencyWindow latency; /* es write to playout delay */
+    gboolean first_frame;  /* decoder played out since the last flush */
+
+    /* audio track switch, streaming thread only */
+    gboolean adec_started;     /* decoder configured by set_caps */
+    const gchar *codec;        /* codec of the playing track */
+    gboolean switch_pending;   /* new track waits for switch_pts */
+    const gchar *switch_codec; /* codec of the new track */
+    guint64 switch_pts;        /* first pts of the new track, 90KHz */
+    GQueue *switch_queue;      /* new track buffers held until the switch */
+
+    /* clock driven by the decoder pts, protected by clock_lock */
+    GstClock *provided_clock;
+    GMutex clock_lock;
+    GstSegment clock_segment;       /* segment of the playing data */
+    gboolean clock_running;         /* PLAYING, decoder pts moves */
+    GstClockTimeDiff clock_offset;  /* clock time minus monotonic time */
+    gint64 clock_sample_us;         /* monotonic time of the last pts read */
+    guint64 clock_apts;             /* last decoder pts read, 90KHz */
 } GstAmltspasinkPrivate;
 
 struct _GstAmltspasink
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2017 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  DESCRIPTION
+ *      Decoder buffer level and latency tracking shared by the sinks.
+ *
+ */
+
+#include "bufferlevel.h"
+
+int32_t buffer_level_state(int32_t level, int32_t low, int32_t high)
+{
+    if (level < 0)
+        return LEVEL_STATE_UNKNOWN;
+    if (level < low)
+        return LEVEL_STATE_LOW;
+    if (level >= high)
+        return LEVEL_STATE_HIGH;
+    return LEVEL_STATE_NORMAL;
+}
+
+const char *buffer_level_state_name(int32_t state)
+{
+    switch (state)
+    {
+    case LEVEL_STATE_LOW:
+        return "low";
+    case LEVEL_STATE_NORMAL:
+        return "normal";
+    case LEVEL_STATE_HIGH:
+        return "high";
+    default:
+        return "unknown";
+    }
+}
+
+int32_t buffer_level_pacing(int32_t level, int32_t low, int32_t high, int32_t pacing)
+{
+    if (level < 0)
+    {
+        /* nothing to pace on */
+        return 0;
+    }
+
+    return pacing ? (level >= low) : (level >= high);
+}
+
+void latency_window_reset(LatencyWindow *win, int64_t now_us)
+{
+    win->min_ms = -1;
+    win->max_ms = -1;
+    win->win_min = -1;
+    win->win_max = -1;
+    win->win_start_us = now_us;
+    win->pend_min = -1;
+    win->pend_max = -1;
+    win->pend_count = 0;
+}
+
+int32_t latency_window_sample(LatencyWindow *win, int64_t now_us, int32_t buffered_ms)
+{
+    int32_t changed = 0;
+
+    if (buffered_ms > 0)
+    {
+        if (win->win_min < 0 || buffered_ms < win->win_min)
+            win->win_min = buffered_ms;
+        if (buffered_ms > win->win_max)
+            win->win_max = buffered_ms;
+    }
+    if (now_us - win->win_start_us < LATENCY_WINDOW_US)
+    {
+        return 0;
+    }
+    win->win_start_us = now_us;
+    if (win->win_min < 0)
+    {
+        /* nothing decoded in this window */
+        return 0;
+    }
+
+    changed = (win->min_ms < 0 ||
+               win->win_min - win->min_ms > LATENCY_CHANGE_MS ||
+               win->min_ms - win->win_min > LATENCY_CHANGE_MS ||
+               win->win_max - win->max_ms > LATENCY_CHANGE_MS ||
+               win->max_ms - win->win_max > LATENCY_CHANGE_MS);
+    if (changed)
+    {
+        /* a single window may be a hiccup, report what holds */
+        if (win->pend_count == 0 || win->win_min < win->pend_min)
+            win->pend_min = win->win_min;
+        if (win->pend_count == 0 || win->win_max > win->pend_max)
+            win->pend_max = win->win_max;
+        win->pend_count++;
+        changed = (win->pend_count >= LATENCY_CHANGE_WINDOWS);
+    }
+    else
+    {
+        win->pend_count = 0;
+    }
+    if (changed)
+    {
+        win->min_ms = win->pend_min;
+        win->max_ms = win->pend_max;
+        win->pend_count = 0;
+    }
+    win->win_min = -1;
+    win->win_max = -1;
+
+    return changed;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2017 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  DESCRIPTION
+ *      Decoder buffer level and latency tracking shared by the sinks.
+ *
+ */
+
+#ifndef __BUFFERLEVEL_H__
+#define __BUFFERLEVEL_H__
+
+#include <stdint.h>
+
+// #ifdef __cplusplus
+// extern "C" {
+// #endif
+
+/* decoder buffer level, in percent of the es buffer */
+#define BUFFER_LOW_WATERMARK 10
+#define BUFFER_HIGH_WATERMARK 80
+#define BUFFER_MONITOR_INTERVAL_US 50000
+#define BUFFER_PACING_WAIT_US 100000
+
+/* es write to output delay, reported as latency */
+#define LATENCY_WINDOW_US 2000000 /* min/max taken over this window */
+#define LATENCY_CHANGE_MS 10      /* report a change past this */
+#define LATENCY_CHANGE_WINDOWS 2  /* ... seen in this many windows in a row */
+
+#define LEVEL_STATE_UNKNOWN 0
+#define LEVEL_STATE_LOW 1
+#define LEVEL_STATE_NORMAL 2
+#define LEVEL_STATE_HIGH 3
+
+/* LEVEL_STATE_* of a level in percent, -1 if unknown */
+int32_t buffer_level_state(int32_t level, int32_t low, int32_t high);
+const char *buffer_level_state_name(int32_t state);
+
+/*
+ * Pacing with hysteresis: start at the high watermark, go on until the
+ * level is back under the low one. Returns 1 while the writer should wait.
+ */
+int32_t buffer_level_pacing(int32_t level, int32_t low, int32_t high, int32_t pacing);
+
+typedef struct _LatencyWindow
+{
+    int32_t min_ms; /* reported latency, -1 if not measured */
+    int32_t max_ms;
+    int32_t win_min; /* current window, -1 if empty */
+    int32_t win_max;
+    int64_t win_start_us;
+    int32_t pend_min; /* changed windows in a row, not reported yet */
+    int32_t pend_max;
+    int32_t pend_count;
+} LatencyWindow;
+
+void latency_window_reset(LatencyWindow *win, int64_t now_us);
+/*
+ * Returns 1 when the reported min or max changed, that is when the last
+ * LATENCY_CHANGE_WINDOWS windows all moved past LATENCY_CHANGE_MS.
+ */
+int32_t latency_window_sample(LatencyWindow *win, int64_t now_us, int32_t buffered_ms);
+
+// #ifdef __cplusplus
+// }
+// #endif
+
+#endif // __BUFFERLEVEL_H__
@@ -42,12 +42,65 @@
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static int refcount = 0;
 static am_tsplayer_handle session = 0;
+static int32_t sync_mode = SESSION_SYNC_AUTO;
+
+/*
+ * Drift of the stream clock against the local clock, as the least squares
+ * slope of (stream time - clock time) over clock time. A window of samples
+ * spanning at least DRIFT_MIN_SPAN_US is needed before correcting.
+ */
+#define DRIFT_WINDOW 128
+#define DRIFT_SAMPLE_INTERVAL_US 100000
+#define DRIFT_MIN_SPAN_US 10000000
+#define DRIFT_MAX_PPM 5000
+#define DRIFT_DEADBAND_PPM 100
+
+#define TSYNC_EVENT_PATH "/sys/class/tsync/event"
+
+typedef struct _DriftSample
+{
+    int64_t clock_us;
+    int64_t offset_us;
+} DriftSample;
+
+static DriftSample drift_samples[DRIFT_WINDOW];
+static int32_t drift_count = 0;
+static int32_t drift_head = 0;
+static int32_t drift_ppm = 0; /* correction applied to the session */
+
+/* call with lock held */
+static am_tsplayer_avsync_mode sync_mode_to_tsplayer(int32_t audio_started)
+{
+    am_tsplayer_avsync_mode mode = TS_SYNC_VMASTER;
+
+    switch (sync_mode)
+    {
+    case SESSION_SYNC_VMASTER:
+        mode = TS_SYNC_VMASTER;
+        break;
+    case SESSION_SYNC_AMASTER:
+        mode = TS_SYNC_AMASTER;
+        break;
+    case SESSION_SYNC_PCRMASTER:
+        mode = TS_SYNC_PCRMASTER;
+        break;
+    case SESSION_SYNC_NOSYNC:
+        mode = TS_SYNC_NOSYNC;
+        break;
+    default:
+        mode = audio_started ? TS_SYNC_AMASTER : TS_SYNC_VMASTER;
+        break;
+    }
+
+    return mode;
+}
 
 int create_session(am_tsplayer_handle *session_output)
 {
     am_tsplayer_init_params param =
         {ES_MEMORY, TS_INPUT_BUFFER_TYPE_NORMAL, 0, 0};
     am_tsplayer_result ret = AM_TSPLAYER_OK;
+    am_tsplayer_avsync_mode mode = TS_SYNC_VMASTER;
 
     pthread_mutex_lock(&lock);
 
@@ -64,8 +117,9 @@ int create_session(am_tsplayer_handle *session_output)
         }
 
         // common config
+        mode = sync_mode_to_tsplayer(0);
         AmTsPlayer_setWorkMode(session, TS_PLAYER_MODE_NORMAL);
-        AmTsPlayer_setSyncMode(session, TS_SYNC_VMASTER);
+        AmTsPlayer_setSyncMode(session, mode);
     }
 
     refcount++;
@@ -90,6 +144,10 @@ int release_session()
         /* ensure stop deocding */
         AmTsPlayer_stopAudioDecoding(session);
         AmTsPlayer_stopVideoDecoding(session);
+        sync_mode = SESSION_SYNC_AUTO;
+        drift_count = 0;
+        drift_head = 0;
+        drift_ppm = 0;
         LOG("AmTsPlayer_release now, pid: %d\n", getpid());
         ret = AmTsPlayer_release(session);
         if (ret != AM_TSPLAYER_OK)
@@ -137,6 +195,232 @@ int configure_video_region(int32_t top, int32_t left,
     return ERROR_CODE_OK;
 }
 
+int set_session_sync_mode(int32_t mode)
+{
+    am_tsplayer_avsync_mode tsmode = TS_SYNC_VMASTER;
+    am_tsplayer_result ret = AM_TSPLAYER_OK;
+
+    if (mode < SESSION_SYNC_AUTO || mode > SESSION_SYNC_NOSYNC)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    LOG("enter, mode:%d!\n", mode);
+    sync_mode = mode;
+
+    /* auto is applied by create_session() and start_adec() */
+    if (refcount < 1 || mode == SESSION_SYNC_AUTO)
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_OK;
+    }
+
+    tsmode = sync_mode_to_tsplayer(0);
+    ret = AmTsPlayer_setSyncMode(session, tsmode);
+    if (ret != AM_TSPLAYER_OK)
+    {
+        pthread_mutex_unlock(&lock);
+        LOG("AmTsPlayer_setSyncMode failed: %d\n", ret);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
+int get_session_sync_mode(int32_t audio_started, am_tsplayer_avsync_mode *mode)
+{
+    if (mode == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    *mode = sync_mode_to_tsplayer(audio_started);
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
+/* call with lock held */
+static int32_t drift_estimate_ppm()
+{
+    const DriftSample *first = NULL;
+    const DriftSample *last = NULL;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    double x = 0, y = 0, n = 0, den = 0;
+    int32_t index = 0;
+
+    if (drift_count < DRIFT_WINDOW)
+    {
+        first = &drift_samples[0];
+    }
+    else
+    {
+        first = &drift_samples[drift_head];
+    }
+    last = &drift_samples[(drift_head + DRIFT_WINDOW - 1) % DRIFT_WINDOW];
+
+    if (last->clock_us - first->clock_us < DRIFT_MIN_SPAN_US)
+    {
+        return drift_ppm;
+    }
+
+    n = (drift_count < DRIFT_WINDOW) ? drift_count : DRIFT_WINDOW;
+    for (index = 0; index < n; index++)
+    {
+        /* relative to the first sample to keep the precision */
+        x = (double)(drift_samples[index].clock_us - first->clock_us);
+        y = (double)(drift_samples[index].offset_us - first->offset_us);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    den = n * sxx - sx * sx;
+    if (den <= 0)
+    {
+        return drift_ppm;
+    }
+
+    return (int32_t)((n * sxy - sx * sy) / den * 1000000.0);
+}
+
+/*
+ * Feed one (clock running time, stream running time) sample, and correct
+ * the session rate when the sender clock drifts from ours.
+ */
+int session_drift_update(int64_t clock_us, int64_t stream_us)
+{
+    am_tsplayer_result ret = AM_TSPLAYER_OK;
+    const DriftSample *prev = NULL;
+    int32_t ppm = 0;
+
+    pthread_mutex_lock(&lock);
+    if (refcount < 1)
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    if (drift_count > 0)
+    {
+        prev = &drift_samples[(drift_head + DRIFT_WINDOW - 1) % DRIFT_WINDOW];
+        if (clock_us - prev->clock_us < DRIFT_SAMPLE_INTERVAL_US)
+        {
+            pthread_mutex_unlock(&lock);
+            return ERROR_CODE_OK;
+        }
+    }
+
+    drift_samples[drift_head].clock_us = clock_us;
+    drift_samples[drift_head].offset_us = stream_us - clock_us;
+    drift_head = (drift_head + 1) % DRIFT_WINDOW;
+    if (drift_count < DRIFT_WINDOW)
+    {
+        drift_count++;
+    }
+
+    ppm = drift_estimate_ppm();
+    if (ppm > DRIFT_MAX_PPM)
+    {
+        ppm = DRIFT_MAX_PPM;
+    }
+    else if (ppm < -DRIFT_MAX_PPM)
+    {
+        ppm = -DRIFT_MAX_PPM;
+    }
+    else if (ppm > -DRIFT_DEADBAND_PPM && ppm < DRIFT_DEADBAND_PPM)
+    {
+        ppm = 0;
+    }
+
+    if (ppm - drift_ppm > -DRIFT_DEADBAND_PPM && ppm - drift_ppm < DRIFT_DEADBAND_PPM)
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_OK;
+    }
+
+    LOG("drift %d ppm, rate %f\n", ppm, 1.0 + ppm / 1000000.0);
+    if (ppm == 0)
+    {
+        ret = AmTsPlayer_stopFast(session);
+    }
+    else
+    {
+        ret = AmTsPlayer_startFast(session, (float)(1.0 + ppm / 1000000.0));
+    }
+    if (ret != AM_TSPLAYER_OK)
+    {
+        pthread_mutex_unlock(&lock);
+        LOG("AmTsPlayer_startFast or AmTsPlayer_stopFast failed: %d\n", ret);
+        return ERROR_CODE_BASE_ERROR;
+    }
+    drift_ppm = ppm;
+
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
+/*
+ * Forget the samples, e.g. on flush or rate change, and take back a
+ * correction still applied. Call it before setting a new rate, not after.
+ */
+int session_drift_reset()
+{
+    am_tsplayer_result ret = AM_TSPLAYER_OK;
+
+    pthread_mutex_lock(&lock);
+    if (refcount > 0 && drift_ppm != 0)
+    {
+        LOG("drop drift correction %d ppm\n", drift_ppm);
+        ret = AmTsPlayer_stopFast(session);
+    }
+    drift_count = 0;
+    drift_head = 0;
+    drift_ppm = 0;
+    pthread_mutex_unlock(&lock);
+
+    if (ret != AM_TSPLAYER_OK)
+    {
+        LOG("AmTsPlayer_stopFast failed: %d\n", ret);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    return ERROR_CODE_OK;
+}
+
+/*
+ * The es timeline jumped: have tsync re-anchor the av sync on the new
+ * pts at once, instead of timing out on the old one.
+ */
+int session_pts_discontinuity(int32_t video, uint64_t pts)
+{
+    FILE *fp = NULL;
+
+    fp = fopen(TSYNC_EVENT_PATH, "w");
+    if (fp == NULL)
+    {
+        LOG("open %s failed!\n", TSYNC_EVENT_PATH);
+        return ERROR_CODE_BASE_ERROR;
+    }
+    /* tsync takes the low 32 bits of the 90KHz pts */
+    fprintf(fp, "%s_TSTAMP_DISCONTINUITY:0x%x", video ? "VIDEO" : "AUDIO", (uint32_t)pts);
+    fclose(fp);
+    LOG("%s pts discontinuity, pts: 0x%llx\n", video ? "video" : "audio", (unsigned long long)pts);
+
+    /* samples across the jump are meaningless */
+    session_drift_reset();
+
+    return ERROR_CODE_OK;
+}
+
 // #ifdef __cplusplus
 // }
 // #endif
@@ -32,12 +32,27 @@
 #define ERROR_CODE_INVALID_OPERATION -2
 #define ERROR_CODE_BASE_ERROR -3
 
+/* session sync mode, auto is vmaster and amaster once audio starts */
+#define SESSION_SYNC_AUTO 0
+#define SESSION_SYNC_VMASTER 1
+#define SESSION_SYNC_AMASTER 2
+#define SESSION_SYNC_PCRMASTER 3
+#define SESSION_SYNC_NOSYNC 4
+
 int create_session(am_tsplayer_handle *session_output);
 int release_session();
 
 int configure_video_region(int32_t top, int32_t left,
         int32_t width, int32_t height);
 
+int set_session_sync_mode(int32_t mode);
+int get_session_sync_mode(int32_t audio_started, am_tsplayer_avsync_mode *mode);
+
+int session_drift_update(int64_t clock_us, int64_t stream_us);
+int session_drift_reset();
+
+int session_pts_discontinuity(int32_t video, uint64_t pts);
+
 // #ifdef __cplusplus
 // }
 // #endif
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2017 Amlogic Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  DESCRIPTION
+ *      This file implements the command script loader and the results
+ *      writer of gst_test.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "cmdscript.h"
+
+#define DEBUG
+
+#define ERROR_CODE_OK 0
+#define ERROR_CODE_BAD_PARAMETER -1
+#define ERROR_CODE_INVALID_OPERATION -2
+#define ERROR_CODE_BASE_ERROR -3
+
+#ifdef DEBUG
+#define LOG(fmt, arg...) fprintf(stdout, "[cmdscript] %s:%d, " fmt, __FUNCTION__, __LINE__, ##arg);
+#else
+#define LOG(fmt, arg...)
+#endif
+
+#define SCRIPT_LINE_MAX_LEN 256
+#define SCRIPT_MAX_CMD_NUM 1024
+#define DEADLINE_KEY "deadline_ms="
+
+/* results file is shared by all workers */
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *results_fp = NULL;
+
+static char *strip(char *str)
+{
+    char *end = NULL;
+
+    while (isspace((unsigned char)*str))
+    {
+        str++;
+    }
+
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1]))
+    {
+        *--end = '\0';
+    }
+
+    return str;
+}
+
+static int parse_line(char *line, PlayCmd *cmd)
+{
+    char *token = NULL;
+    char *save = NULL;
+    char *comment = strchr(line, '#');
+
+    if (comment != NULL)
+    {
+        *comment = '\0';
+    }
+
+    memset(cmd, 0, sizeof(PlayCmd));
+    cmd->deadline_ms = CMD_NO_DEADLINE;
+
+    token = strtok_r(strip(line), " \t", &save);
+    if (token == NULL)
+    {
+        return ERROR_CODE_INVALID_OPERATION; /* empty line */
+    }
+    snprintf(cmd->name, sizeof(cmd->name), "%s", token);
+
+    while ((token = strtok_r(NULL, " \t", &save)) != NULL)
+    {
+        if (strncasecmp(token, DEADLINE_KEY, strlen(DEADLINE_KEY)) == 0)
+        {
+            cmd->deadline_ms = strtoll(token + strlen(DEADLINE_KEY), NULL, 0);
+        }
+        else if (cmd->arg[0] == '\0')
+        {
+            snprintf(cmd->arg, sizeof(cmd->arg), "%s", token);
+        }
+        else
+        {
+            LOG("extra token ignored: %s\n", token);
+        }
+    }
+
+    return ERROR_CODE_OK;
+}
+
+int cmdscript_load(const char *path, PlayCmd **cmds, int32_t *num)
+{
+    FILE *fp = NULL;
+    PlayCmd *list = NULL;
+    char line[SCRIPT_LINE_MAX_LEN];
+    int32_t count = 0;
+    int32_t line_no = 0;
+
+    if (path == NULL || cmds == NULL || num == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        LOG("open %s failed!\n", path);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    list = (PlayCmd *)calloc(SCRIPT_MAX_CMD_NUM, sizeof(PlayCmd));
+    if (list == NULL)
+    {
+        LOG("calloc failed!\n");
+        fclose(fp);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line_no++;
+
+        if (count >= SCRIPT_MAX_CMD_NUM)
+        {
+            LOG("too many cmds, discard from line %d\n", line_no);
+            break;
+        }
+
+        if (parse_line(line, &list[count]) == ERROR_CODE_OK)
+        {
+            count++;
+        }
+    }
+    fclose(fp);
+
+    if (count == 0)
+    {
+        LOG("no cmd in %s!\n", path);
+        free(list);
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    LOG("load %d cmds from %s\n", count, path);
+    *cmds = list;
+    *num = count;
+
+    return ERROR_CODE_OK;
+}
+
+int cmdscript_from_names(const char *names[], int32_t num, PlayCmd **cmds)
+{
+    PlayCmd *list = NULL;
+    int32_t index = 0;
+
+    if (names == NULL || num < 1 || cmds == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    list = (PlayCmd *)calloc(num, sizeof(PlayCmd));
+    if (list == NULL)
+    {
+        LOG("calloc failed!\n");
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    for (index = 0; index < num; index++)
+    {
+        snprintf(list[index].name, sizeof(list[index].name), "%s", names[index]);
+        list[index].deadline_ms = CMD_NO_DEADLINE;
+    }
+
+    *cmds = list;
+
+    return ERROR_CODE_OK;
+}
+
+int cmdscript_free(PlayCmd *cmds)
+{
+    if (cmds != NULL)
+    {
+        free(cmds);
+    }
+
+    return ERROR_CODE_OK;
+}
+
+int results_open(const char *path)
+{
+    if (path == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&results_lock);
+    if (results_fp != NULL)
+    {
+        pthread_mutex_unlock(&results_lock);
+        LOG("results file is already open!\n");
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    results_fp = fopen(path, "w");
+    if (results_fp == NULL)
+    {
+        pthread_mutex_unlock(&results_lock);
+        LOG("open %s failed!\n", path);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    /* latency_us is -1 when the cmd did not complete in time */
+    fprintf(results_fp, "worker,index,cmd,arg,issue_us,latency_us,"
+                        "deadline_ms,deadline_missed,ret\n");
+    pthread_mutex_unlock(&results_lock);
+
+    return ERROR_CODE_OK;
+}
+
+int results_is_open()
+{
+    int open = 0;
+
+    pthread_mutex_lock(&results_lock);
+    open = (results_fp != NULL);
+    pthread_mutex_unlock(&results_lock);
+
+    return open;
+}
+
+int results_write(int32_t worker, int32_t index, const char *cmd,
+                  const char *arg, int64_t issue_us, int64_t latency_us,
+                  int64_t deadline_ms, int32_t ret)
+{
+    int32_t missed = 0;
+
+    if (cmd == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    if (deadline_ms != CMD_NO_DEADLINE)
+    {
+        missed = (latency_us < 0) || (latency_us > deadline_ms * 1000);
+    }
+
+    pthread_mutex_lock(&results_lock);
+    if (results_fp == NULL)
+    {
+        pthread_mutex_unlock(&results_lock);
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    fprintf(results_fp, "%d,%d,%s,%s,%lld,%lld,%lld,%d,%d\n",
+            worker, index, cmd, arg ? arg : "",
+            (long long)issue_us, (long long)latency_us,
+            (long long)deadline_ms, missed, ret);
+    fflush(results_fp);
+    pthread_mutex_unlock(&results_lock);
+
+    return ERROR_CODE_OK;
+}
+
+int results_close()
+{
+    pthread_mutex_lock(&results_lock);
+    if (results_fp != NULL)
+    {
+        fclose(results_fp);
+        results_fp = NULL;
+    }
+    pthread_mutex_unlock(&results_lock);
+
+    return ERROR_CODE_OK;
+}
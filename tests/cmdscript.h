@@ -0,0 +1,38 @@
+#ifndef __CMDSCRIPT_H__
+#define __CMDSCRIPT_H__
+
+#include <stdint.h>
+
+#define CMD_NAME_MAX_LEN 32
+#define CMD_ARG_MAX_LEN 64
+#define CMD_NO_DEADLINE -1
+
+/*
+ * One line of a command script:
+ *     <cmd> [arg] [deadline_ms=<ms>]
+ * An empty arg means the value is drawn from the seeded PRNG.
+ */
+typedef struct _PlayCmd
+{
+    char name[CMD_NAME_MAX_LEN];
+    char arg[CMD_ARG_MAX_LEN];
+    int64_t deadline_ms;
+} PlayCmd;
+
+int cmdscript_load(const char *path, PlayCmd **cmds, int32_t *num);
+
+int cmdscript_from_names(const char *names[], int32_t num, PlayCmd **cmds);
+
+int cmdscript_free(PlayCmd *cmds);
+
+int results_open(const char *path);
+
+int results_is_open();
+
+int results_write(int32_t worker, int32_t index, const char *cmd,
+                  const char *arg, int64_t issue_us, int64_t latency_us,
+                  int64_t deadline_ms, int32_t ret);
+
+int results_close();
+
+#endif
@@ -228,8 +228,8 @@ int discoverer_create(void **p_hdl)
     g_signal_connect(data->discoverer, "discovered", G_CALLBACK(on_discovered_cb), data);
     g_signal_connect(data->discoverer, "finished", G_CALLBACK(on_finished_cb), data);
 
-    /* Create a GLib Main Loop */
-    data->loop = g_main_loop_new(NULL, FALSE);
+    /* Create a GLib Main Loop on the context the discoverer attaches to */
+    data->loop = g_main_loop_new(g_main_context_get_thread_default(), FALSE);
     *p_hdl = data;
 
     return 0;
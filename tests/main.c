@@ -22,10 +22,13 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <gst/gst.h>
 #include <stdbool.h>
 #include "discoverer.h"
+#include "cmdscript.h"
 // #include <gst/audio/streamvolume.h>
 
 #define DEBUG
@@ -51,10 +54,144 @@
 #define PLAY_STATUS_WARNING 3
 #define PLAY_STATUS_ERROR 4
 
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-int play_status = PLAY_STATUS_NORMAL;
-int previous_play_status = PLAY_STATUS_NORMAL;
+#define MAX_WORKER_NUM 16
+
+/* how long a cmd may take to complete when it has no deadline */
+#define CMD_DEFAULT_TIMEOUT_MS 10000
+
+/* latency statistics of one kind of command, in us */
+typedef struct _LatencyStat
+{
+    int64_t count;
+    int64_t total_us;
+    int64_t min_us;
+    int64_t max_us;
+} LatencyStat;
+
+/*
+ * Per-pipeline play context. Each worker owns one, so several pipelines
+ * can run in parallel, each with its own status machine.
+ */
+typedef struct _PlayContext
+{
+    int32_t id;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int play_status;
+    int previous_play_status;
+
+    /* issue time of pending start/seek, 0 if none, guarded by lock */
+    int64_t start_issued_us;
+    int64_t seek_issued_us;
+
+    /* first frame latency is measured from the last start, guarded by lock */
+    int64_t first_frame_issued_us;
+    int32_t first_frame_cmd_index;
+
+    /* PRNG state, seeded per context so a run can be replayed */
+    unsigned int rand_seed;
+
+    /* bus watches of this context are dispatched here, NULL is default */
+    GMainContext *main_context;
+    /* pipeline of the bus watch, state changes are only taken from it */
+    GstElement *pipeline;
+
+    /* statistics, guarded by lock */
+    LatencyStat start_latency;
+    LatencyStat seek_latency;
+    int32_t cmd_count;
+    int32_t cmd_failed_count;
+    int32_t bus_error_count;
+    int32_t bus_warning_count;
+} PlayContext;
+
+static PlayContext default_context = {
+    .id = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .play_status = PLAY_STATUS_NORMAL,
+    .previous_play_status = PLAY_STATUS_NORMAL,
+    .main_context = NULL};
+
+int64_t get_monotonic_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void latency_stat_add(LatencyStat *stat, int64_t latency_us)
+{
+    if (stat->count == 0 || latency_us < stat->min_us)
+    {
+        stat->min_us = latency_us;
+    }
+    if (stat->count == 0 || latency_us > stat->max_us)
+    {
+        stat->max_us = latency_us;
+    }
+    stat->total_us += latency_us;
+    stat->count++;
+}
+
+void latency_stat_merge(LatencyStat *dst, const LatencyStat *src)
+{
+    if (src->count == 0)
+    {
+        return;
+    }
+    if (dst->count == 0 || src->min_us < dst->min_us)
+    {
+        dst->min_us = src->min_us;
+    }
+    if (dst->count == 0 || src->max_us > dst->max_us)
+    {
+        dst->max_us = src->max_us;
+    }
+    dst->total_us += src->total_us;
+    dst->count += src->count;
+}
+
+int init_play_context(PlayContext *ctx, int32_t id, unsigned int seed)
+{
+    if (ctx == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    memset(ctx, 0, sizeof(PlayContext));
+    ctx->id = id;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    ctx->play_status = PLAY_STATUS_NORMAL;
+    ctx->previous_play_status = PLAY_STATUS_NORMAL;
+    ctx->main_context = g_main_context_new();
+    ctx->rand_seed = seed;
+
+    return ERROR_CODE_OK;
+}
+
+int deinit_play_context(PlayContext *ctx)
+{
+    if (ctx == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    if (ctx->main_context != NULL)
+    {
+        g_main_context_unref(ctx->main_context);
+        ctx->main_context = NULL;
+    }
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
+    return ERROR_CODE_OK;
+}
 
 void *thread_run(void *arg)
 {
@@ -69,17 +206,17 @@ void *thread_run(void *arg)
     pthread_exit((void *)"return ok");
 }
 
-int create_main_loop(GMainLoop **loop, pthread_t *thread_id)
+int create_main_loop(PlayContext *ctx, GMainLoop **loop, pthread_t *thread_id)
 {
     GMainLoop *local_loop = NULL;
 
-    if (loop == NULL || thread_id == NULL)
+    if (ctx == NULL || loop == NULL || thread_id == NULL)
     {
         LOG("bad parameter!\n");
         return ERROR_CODE_BAD_PARAMETER;
     }
 
-    local_loop = g_main_loop_new(NULL, FALSE);
+    local_loop = g_main_loop_new(ctx->main_context, FALSE);
     if (local_loop == NULL)
     {
         LOG("create loop failed!\n");
@@ -189,49 +326,131 @@ int release_pipeline(GstElement *pipeline)
     return ERROR_CODE_OK;
 }
 
-int signal_play_status(int new_status)
+int signal_play_status(PlayContext *ctx, int new_status)
 {
-    pthread_mutex_lock(&lock);
-    previous_play_status = play_status;
-    play_status = new_status;
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&lock);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->previous_play_status = ctx->play_status;
+    ctx->play_status = new_status;
+    if (new_status == PLAY_STATUS_STARTED && ctx->start_issued_us != 0)
+    {
+        latency_stat_add(&ctx->start_latency,
+                         get_monotonic_us() - ctx->start_issued_us);
+        ctx->start_issued_us = 0;
+    }
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
 
     return ERROR_CODE_OK;
 }
 
-int revert_error_status()
+int revert_error_status(PlayContext *ctx)
 {
-    pthread_mutex_lock(&lock);
-    if (play_status == PLAY_STATUS_ERROR)
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->play_status == PLAY_STATUS_ERROR)
     {
-        play_status = previous_play_status;
+        ctx->play_status = ctx->previous_play_status;
     }
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&lock);
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
 
     return ERROR_CODE_OK;
 }
 
-int wait_for_status(int status)
+int wait_for_status(PlayContext *ctx, int status)
 {
-    pthread_mutex_lock(&lock);
-    while (!(play_status & status))
+    pthread_mutex_lock(&ctx->lock);
+    while (!(ctx->play_status & status))
     {
-        pthread_cond_wait(&cond, &lock);
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
     }
-    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&ctx->lock);
 
     return ERROR_CODE_OK;
 }
 
-int check_is_status(int status)
+static void get_deadline(struct timespec *ts, int64_t timeout_ms)
 {
-    return play_status & status;
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+int wait_for_status_timeout(PlayContext *ctx, int status, int64_t timeout_ms)
+{
+    int ret = 0;
+    struct timespec ts;
+
+    get_deadline(&ts, timeout_ms);
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!(ctx->play_status & status) && ret != ETIMEDOUT)
+    {
+        ret = pthread_cond_timedwait(&ctx->cond, &ctx->lock, &ts);
+    }
+    ret = (ctx->play_status & status) ? ERROR_CODE_OK : ERROR_CODE_BASE_ERROR;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ret;
+}
+
+int wait_for_seek_done(PlayContext *ctx, int64_t timeout_ms)
+{
+    int ret = 0;
+    struct timespec ts;
+
+    get_deadline(&ts, timeout_ms);
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->seek_issued_us != 0 && ret != ETIMEDOUT)
+    {
+        ret = pthread_cond_timedwait(&ctx->cond, &ctx->lock, &ts);
+    }
+    ret = (ctx->seek_issued_us == 0) ? ERROR_CODE_OK : ERROR_CODE_BASE_ERROR;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ret;
+}
+
+int check_is_status(PlayContext *ctx, int status)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    ret = ctx->play_status & status;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ret;
+}
+
+/* remember when a start/seek was issued, completion is seen on the bus */
+int mark_start_issued(PlayContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->start_issued_us = get_monotonic_us();
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ERROR_CODE_OK;
+}
+
+/* issue time of a seek, 0 withdraws one that was not accepted */
+int mark_seek_issued(PlayContext *ctx, int64_t issue_us)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->seek_issued_us = issue_us;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ERROR_CODE_OK;
 }
 
 gboolean handle_message(GstBus *bus, GstMessage *message, gpointer data)
 {
+    PlayContext *ctx = (PlayContext *)data;
+
     if (message == NULL)
     {
         LOG("receive null message!\n");
@@ -245,7 +464,10 @@ gboolean handle_message(GstBus *bus, GstMessage *message, gpointer data)
         GError *warning = NULL;
         gchar *debug_info = NULL;
 
-        signal_play_status(PLAY_STATUS_WARNING);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->bus_warning_count++;
+        pthread_mutex_unlock(&ctx->lock);
+        signal_play_status(ctx, PLAY_STATUS_WARNING);
 
         gst_message_parse_warning(message, &warning, &debug_info);
 
@@ -262,11 +484,14 @@ gboolean handle_message(GstBus *bus, GstMessage *message, gpointer data)
         GError *err = NULL;
         gchar *debug_info = NULL;
 
-        signal_play_status(PLAY_STATUS_ERROR);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->bus_error_count++;
+        pthread_mutex_unlock(&ctx->lock);
+        signal_play_status(ctx, PLAY_STATUS_ERROR);
 
         gst_message_parse_error(message, &err, &debug_info);
 
-        LOG("receive error, %s: %s\n",
+        LOG("[worker %d] receive error, %s: %s\n", ctx->id,
             GST_OBJECT_NAME(message->src), err->message);
         LOG("debugging info: %s\n", debug_info ? debug_info : "none");
 
@@ -276,9 +501,23 @@ gboolean handle_message(GstBus *bus, GstMessage *message, gpointer data)
     }
     case GST_MESSAGE_EOS:
     {
-        signal_play_status(PLAY_STATUS_FINISHED);
+        signal_play_status(ctx, PLAY_STATUS_FINISHED);
 
-        LOG("receive End-Of-Stream\n");
+        LOG("[worker %d] receive End-Of-Stream\n", ctx->id);
+        break;
+    }
+    case GST_MESSAGE_ASYNC_DONE:
+    {
+        /* a flushing seek completes with async-done on the pipeline */
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->seek_issued_us != 0)
+        {
+            latency_stat_add(&ctx->seek_latency,
+                             get_monotonic_us() - ctx->seek_issued_us);
+            ctx->seek_issued_us = 0;
+            pthread_cond_broadcast(&ctx->cond);
+        }
+        pthread_mutex_unlock(&ctx->lock);
         break;
     }
     case GST_MESSAGE_STATE_CHANGED:
@@ -287,9 +526,11 @@ gboolean handle_message(GstBus *bus, GstMessage *message, gpointer data)
         gst_message_parse_state_changed(message, &old_state,
                                         &new_state, &pending_state);
 
-        if (old_state == GST_STATE_PAUSED && new_state == GST_STATE_PLAYING)
+        /* elements reach PLAYING before the pipeline does */
+        if (GST_MESSAGE_SRC(message) == GST_OBJECT(ctx->pipeline) &&
+            old_state == GST_STATE_PAUSED && new_state == GST_STATE_PLAYING)
         {
-            signal_play_status(PLAY_STATUS_STARTED);
+            signal_play_status(ctx, PLAY_STATUS_STARTED);
         }
 
         /*
@@ -421,35 +662,86 @@ gboolean handle_message(GstBus *bus, GstMessage *message, gpointer data)
     return TRUE;
 }
 
-int add_message_watch(GstElement *pipeline, guint *watch_id)
+int add_message_watch(PlayContext *ctx, GstElement *pipeline, guint *watch_id)
 {
     GstBus *bus = NULL;
+    GSource *source = NULL;
 
-    if (pipeline == NULL || watch_id == NULL)
+    if (ctx == NULL || pipeline == NULL || watch_id == NULL)
     {
         LOG("bad parameter!\n");
         return ERROR_CODE_BAD_PARAMETER;
     }
 
+    ctx->pipeline = pipeline;
     bus = gst_element_get_bus(pipeline);
-    *watch_id = gst_bus_add_watch(bus, handle_message, NULL);
+    source = gst_bus_create_watch(bus);
+    g_source_set_callback(source, (GSourceFunc)handle_message, ctx, NULL);
+    *watch_id = g_source_attach(source, ctx->main_context);
+    g_source_unref(source);
     gst_object_unref(bus);
 
     return ERROR_CODE_OK;
 }
 
-int remove_message_watch(guint watch_id)
+int remove_message_watch(PlayContext *ctx, guint watch_id)
 {
-    g_source_remove(watch_id);
+    GSource *source = g_main_context_find_source_by_id(ctx->main_context, watch_id);
+
+    if (source != NULL)
+    {
+        g_source_destroy(source);
+    }
     return ERROR_CODE_OK;
 }
 
-int create(const char *file, GMainLoop **loop,
+/* called from the event thread of the video sink, not a tsplayer thread */
+void handle_first_frame(GstElement *sink, guint arg0, gpointer arg1, gpointer data)
+{
+    PlayContext *ctx = (PlayContext *)data;
+    int64_t issue_us = 0;
+    int32_t index = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    issue_us = ctx->first_frame_issued_us;
+    index = ctx->first_frame_cmd_index;
+    ctx->first_frame_issued_us = 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (issue_us != 0)
+    {
+        results_write(ctx->id, index, "first_frame", "", issue_us,
+                      get_monotonic_us() - issue_us, CMD_NO_DEADLINE,
+                      ERROR_CODE_OK);
+    }
+}
+
+int connect_first_frame(PlayContext *ctx, GstElement *pipeline)
+{
+    GstElement *element = NULL;
+
+    g_object_get(pipeline, "video-sink", &element, NULL);
+    if (element == NULL)
+    {
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    if (g_signal_lookup("first-video-frame-callback", G_OBJECT_TYPE(element)))
+    {
+        g_signal_connect(element, "first-video-frame-callback",
+                         G_CALLBACK(handle_first_frame), ctx);
+    }
+    gst_object_unref(element);
+
+    return ERROR_CODE_OK;
+}
+
+int create(PlayContext *ctx, const char *file, GMainLoop **loop,
            pthread_t *thread_id, GstElement **pipeline, guint *watch_id)
 {
     int ret = ERROR_CODE_OK;
 
-    ret = create_main_loop(loop, thread_id);
+    ret = create_main_loop(ctx, loop, thread_id);
     if (ret != ERROR_CODE_OK)
     {
         return ret;
@@ -461,14 +753,19 @@ int create(const char *file, GMainLoop **loop,
         goto release_main_loop_point;
     }
 
-    signal_play_status(PLAY_STATUS_NORMAL);
+    signal_play_status(ctx, PLAY_STATUS_NORMAL);
 
-    ret = add_message_watch(*pipeline, watch_id);
+    ret = add_message_watch(ctx, *pipeline, watch_id);
     if (ret != ERROR_CODE_OK)
     {
         goto release_pipeline_point;
     }
 
+    if (results_is_open())
+    {
+        connect_first_frame(ctx, *pipeline);
+    }
+
     return ERROR_CODE_OK;
 
 release_pipeline_point:
@@ -483,10 +780,10 @@ release_main_loop_point:
     return ret;
 }
 
-int release(GMainLoop *loop, pthread_t thread_id,
+int release(PlayContext *ctx, GMainLoop *loop, pthread_t thread_id,
             GstElement *pipeline, guint watch_id)
 {
-    remove_message_watch(watch_id);
+    remove_message_watch(ctx, watch_id);
     release_pipeline(pipeline);
     release_main_loop(loop, thread_id);
 
@@ -535,7 +832,7 @@ int pause_(GstElement *pipeline)
     return ERROR_CODE_OK;
 }
 
-int stop(GstElement *pipeline)
+int stop(PlayContext *ctx, GstElement *pipeline)
 {
     GstStateChangeReturn ret;
 
@@ -553,7 +850,7 @@ int stop(GstElement *pipeline)
         return ERROR_CODE_BASE_ERROR;
     }
 
-    signal_play_status(PLAY_STATUS_FINISHED);
+    signal_play_status(ctx, PLAY_STATUS_FINISHED);
 
     return ERROR_CODE_OK;
 }
@@ -633,7 +930,6 @@ int set_rate(GstElement *pipeline, gdouble new_rate)
                           GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE,
                           GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE))
     {
-        pthread_mutex_unlock(&lock);
         LOG("set rate failed!\n");
         return ERROR_CODE_BASE_ERROR;
     };
@@ -749,24 +1045,24 @@ int set_volume(GstElement *pipeline, gdouble volume)
     return ERROR_CODE_OK;
 }
 
-int wait_for_start()
+int wait_for_start(PlayContext *ctx)
 {
-    return wait_for_status(PLAY_STATUS_STARTED | PLAY_STATUS_ERROR | PLAY_STATUS_FINISHED);
+    return wait_for_status(ctx, PLAY_STATUS_STARTED | PLAY_STATUS_ERROR | PLAY_STATUS_FINISHED);
 }
 
-int wait_for_finish()
+int wait_for_finish(PlayContext *ctx)
 {
-    return wait_for_status(PLAY_STATUS_ERROR | PLAY_STATUS_FINISHED);
+    return wait_for_status(ctx, PLAY_STATUS_ERROR | PLAY_STATUS_FINISHED);
 }
 
-int play_is_started()
+int play_is_started(PlayContext *ctx)
 {
-    return check_is_status(PLAY_STATUS_STARTED);
+    return check_is_status(ctx, PLAY_STATUS_STARTED);
 }
 
-int play_is_error()
+int play_is_error(PlayContext *ctx)
 {
-    return check_is_status(PLAY_STATUS_ERROR);
+    return check_is_status(ctx, PLAY_STATUS_ERROR);
 }
 
 //------------------------------------------------------
@@ -786,14 +1082,22 @@ int play_is_error()
 #define PLAY_CMD_WAIT_FOR_START "wait_for_start"
 #define PLAY_CMD_WAIT_FOR_FINISH "wait_for_finish"
 
-int check_error(int ret, int32_t enabled)
+int check_error(PlayContext *ctx, int ret, int32_t enabled)
 {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->cmd_count++;
+    if (ret != ERROR_CODE_OK)
+    {
+        ctx->cmd_failed_count++;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
     if (!enabled)
     {
         return ERROR_CODE_OK;
     }
 
-    if (ret != ERROR_CODE_OK || play_is_error())
+    if (ret != ERROR_CODE_OK || play_is_error(ctx))
     {
         char input = 0;
 
@@ -819,7 +1123,7 @@ int check_error(int ret, int32_t enabled)
                 e_char_hit_num = 0;
                 if (c_char_hit_num >= c_char_hit_max_num)
                 {
-                    revert_error_status();
+                    revert_error_status(ctx);
                     return ERROR_CODE_OK;
                 }
                 break;
@@ -846,13 +1150,32 @@ int check_error(int ret, int32_t enabled)
     return ERROR_CODE_OK;
 }
 
-int rand_int()
+int rand_int(PlayContext *ctx)
 {
-    srand((unsigned)time(NULL));
-    return rand();
+    return rand_r(&ctx->rand_seed);
+}
+
+/* wait until an async state change completes, ERROR_CODE_BASE_ERROR on timeout */
+int wait_for_state_change(GstElement *pipeline, int64_t timeout_ms)
+{
+    GstStateChangeReturn ret;
+
+    if (pipeline == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    ret = gst_element_get_state(pipeline, NULL, NULL, timeout_ms * GST_MSECOND);
+    if (ret == GST_STATE_CHANGE_FAILURE || ret == GST_STATE_CHANGE_ASYNC)
+    {
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    return ERROR_CODE_OK;
 }
 
-int process_cmd(const char *cmds[], int32_t cmd_num, char **files,
+int process_cmd(PlayContext *ctx, const PlayCmd cmds[], int32_t cmd_num, char **files,
                 int32_t file_num, int32_t random_the_cmd, int32_t random_the_file,
                 int32_t sleep_is_enabled, int32_t check_error_is_enabled)
 {
@@ -884,16 +1207,34 @@ int process_cmd(const char *cmds[], int32_t cmd_num, char **files,
 
     LOG("------test begin...\n");
 
+    /* kept outside the loop, the cmd that breaks it still gets its row */
+    const PlayCmd *cmd = NULL;
+    const char *name = NULL;
+    char arg[CMD_ARG_MAX_LEN] = {0};
+    int32_t measure = 0;
+    int64_t issue_us = 0;
+    int64_t latency_us = -1;
+
     while (true)
     {
-        if (strcasecmp(cmds[cmd_index], PLAY_CMD_PLAY) == 0)
+        cmd = &cmds[cmd_index];
+        name = cmd->name;
+        arg[0] = '\0';
+        measure = results_is_open();
+        int64_t timeout_ms = (cmd->deadline_ms != CMD_NO_DEADLINE) ? cmd->deadline_ms : CMD_DEFAULT_TIMEOUT_MS;
+        issue_us = get_monotonic_us();
+        latency_us = -1;
+
+        ret = ERROR_CODE_OK;
+
+        if (strcasecmp(name, PLAY_CMD_PLAY) == 0)
         {
             if (pipeline != NULL)
             {
                 LOG("---release %s\n", file_path);
 
-                ret = release(loop, thread_id, pipeline, watch_id);
-                if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+                ret = release(ctx, loop, thread_id, pipeline, watch_id);
+                if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
                 {
                     break;
                 }
@@ -910,9 +1251,18 @@ int process_cmd(const char *cmds[], int32_t cmd_num, char **files,
                 return ERROR_CODE_OK;
             }
 
-            if (random_the_file)
+            if (cmd->arg[0] != '\0')
             {
-                file_index = rand_int() % file_num;
+                file_index = atoi(cmd->arg);
+                if (file_index < 0 || file_index >= file_num)
+                {
+                    LOG("------no file %d, test end!\n", file_index);
+                    return ERROR_CODE_BAD_PARAMETER;
+                }
+            }
+            else if (random_the_file)
+            {
+                file_index = rand_int(ctx) % file_num;
             }
             else
             {
@@ -925,21 +1275,30 @@ int process_cmd(const char *cmds[], int32_t cmd_num, char **files,
             }
 
             file_path = files[file_index];
+            snprintf(arg, sizeof(arg), "%d", file_index);
             LOG("---play %s\n", file_path);
 
-            ret = create(file_path, &loop, &thread_id,
+            ret = create(ctx, file_path, &loop, &thread_id,
                          &pipeline, &watch_id);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
+
+            latency_us = get_monotonic_us() - issue_us;
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_START) == 0)
+        else if (strcasecmp(name, PLAY_CMD_START) == 0)
         {
             LOG("---start\n");
 
+            pthread_mutex_lock(&ctx->lock);
+            ctx->first_frame_issued_us = issue_us;
+            ctx->first_frame_cmd_index = cmd_index;
+            pthread_mutex_unlock(&ctx->lock);
+
+            mark_start_issued(ctx);
             ret = start(pipeline);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
@@ -947,142 +1306,230 @@ int process_cmd(const char *cmds[], int32_t cmd_num, char **files,
             if (random_the_cmd && check_error_is_enabled)
             {
                 // to avoid calling other func before started which leads to error.
-                ret = wait_for_start();
-                if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+                ret = wait_for_start(ctx);
+                if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
                 {
                     break;
                 }
             }
 
+            if (measure && wait_for_state_change(pipeline, timeout_ms) == ERROR_CODE_OK)
+            {
+                latency_us = get_monotonic_us() - issue_us;
+            }
+
             paused = 0;
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_PAUSE) == 0)
+        else if (strcasecmp(name, PLAY_CMD_PAUSE) == 0)
         {
             LOG("---pause\n");
 
             ret = pause_(pipeline);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
 
+            if (measure && wait_for_state_change(pipeline, timeout_ms) == ERROR_CODE_OK)
+            {
+                latency_us = get_monotonic_us() - issue_us;
+            }
+
             paused = 1;
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_STOP) == 0)
+        else if (strcasecmp(name, PLAY_CMD_STOP) == 0)
         {
             LOG("---stop\n");
 
-            ret = stop(pipeline);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            ret = stop(ctx, pipeline);
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
 
+            latency_us = get_monotonic_us() - issue_us;
             paused = 1;
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_SET_RATE) == 0)
+        else if (strcasecmp(name, PLAY_CMD_SET_RATE) == 0)
         {
-            rate = (gdouble)(rand_int() % 101) / 50.0;
+            if (cmd->arg[0] != '\0')
+            {
+                rate = atof(cmd->arg);
+            }
+            else
+            {
+                rate = (gdouble)(rand_int(ctx) % 101) / 50.0;
+            }
+            snprintf(arg, sizeof(arg), "%f", rate);
             LOG("---set rate %f\n", rate);
 
             ret = set_rate(pipeline, rate);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
+
+            latency_us = get_monotonic_us() - issue_us;
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_SET_VOLUME) == 0)
+        else if (strcasecmp(name, PLAY_CMD_SET_VOLUME) == 0)
         {
-            gdouble volume = (gdouble)(rand_int() % 33);
+            gdouble volume = 0;
+
+            if (cmd->arg[0] != '\0')
+            {
+                volume = atof(cmd->arg);
+            }
+            else
+            {
+                volume = (gdouble)(rand_int(ctx) % 33);
+            }
+            snprintf(arg, sizeof(arg), "%f", volume);
             LOG("---set volume %f\n", volume);
 
             ret = set_volume(pipeline, volume);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
+
+            latency_us = get_monotonic_us() - issue_us;
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_SEEK_NS) == 0)
+        else if (strcasecmp(name, PLAY_CMD_SEEK_NS) == 0)
         {
-            int64_t seek_time_ns = rand_int() % max_seek_time_ns;
+            int64_t seek_time_ns = 0;
+
+            if (cmd->arg[0] != '\0')
+            {
+                seek_time_ns = strtoll(cmd->arg, NULL, 0);
+            }
+            else
+            {
+                seek_time_ns = rand_int(ctx) % max_seek_time_ns;
+            }
+            snprintf(arg, sizeof(arg), "%lld", (long long)seek_time_ns);
             LOG("---seek %lld us\n", seek_time_ns);
             GST_INFO("---seek %lld us\n", seek_time_ns);
 
+            /* the decoder reports a new first frame after the flush */
+            pthread_mutex_lock(&ctx->lock);
+            ctx->first_frame_issued_us = issue_us;
+            ctx->first_frame_cmd_index = cmd_index;
+            pthread_mutex_unlock(&ctx->lock);
+
+            /* armed before the call, async-done may beat its return */
+            mark_seek_issued(ctx, issue_us);
             ret = seek(pipeline, rate, seek_time_ns);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (ret != ERROR_CODE_OK)
+            {
+                mark_seek_issued(ctx, 0);
+            }
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
+
+            if (measure && ret == ERROR_CODE_OK && wait_for_seek_done(ctx, timeout_ms) == ERROR_CODE_OK)
+            {
+                latency_us = get_monotonic_us() - issue_us;
+            }
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_SWITCH_AUDIO_TRACK) == 0)
+        else if (strcasecmp(name, PLAY_CMD_SWITCH_AUDIO_TRACK) == 0)
         {
-            gint audio_track_index = rand_int() % audio_track_num;
+            gint audio_track_index = 0;
+
+            if (cmd->arg[0] != '\0')
+            {
+                audio_track_index = atoi(cmd->arg);
+            }
+            else if (audio_track_num > 0)
+            {
+                audio_track_index = rand_int(ctx) % audio_track_num;
+            }
+            snprintf(arg, sizeof(arg), "%d", audio_track_index);
             LOG("---switch audio track %d\n", audio_track_index);
 
             ret = set_audio_track_index(pipeline, audio_track_index);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
+
+            latency_us = get_monotonic_us() - issue_us;
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_GET_DURATION_NS) == 0)
+        else if (strcasecmp(name, PLAY_CMD_GET_DURATION_NS) == 0)
         {
             int64_t duration_ns = -1;
 
             ret = get_duration(pipeline, &duration_ns);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
 
+            latency_us = get_monotonic_us() - issue_us;
             LOG("---get position: %lld ns\n", duration_ns);
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_GET_POSITION_NS) == 0)
+        else if (strcasecmp(name, PLAY_CMD_GET_POSITION_NS) == 0)
         {
             int64_t position_ns = -1;
 
             ret = get_position(pipeline, &position_ns);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
 
+            latency_us = get_monotonic_us() - issue_us;
             LOG("---get position: %lld ns\n", position_ns);
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_SLEEP_US) == 0)
+        else if (strcasecmp(name, PLAY_CMD_SLEEP_US) == 0)
         {
             if (sleep_is_enabled)
             {
-                int64_t sleep_time_us = rand_int() % max_sleep_time_us;
+                int64_t sleep_time_us = 0;
+
+                if (cmd->arg[0] != '\0')
+                {
+                    sleep_time_us = strtoll(cmd->arg, NULL, 0);
+                }
+                else
+                {
+                    sleep_time_us = rand_int(ctx) % max_sleep_time_us;
+                }
+                snprintf(arg, sizeof(arg), "%lld", (long long)sleep_time_us);
                 LOG("---sleep %lld us\n", sleep_time_us);
 
                 usleep(sleep_time_us);
-                if (check_error(ERROR_CODE_OK, check_error_is_enabled) != ERROR_CODE_OK)
+                if (check_error(ctx, ERROR_CODE_OK, check_error_is_enabled) != ERROR_CODE_OK)
                 {
                     break;
                 }
+
+                latency_us = get_monotonic_us() - issue_us;
             }
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_WAIT_FOR_START) == 0)
+        else if (strcasecmp(name, PLAY_CMD_WAIT_FOR_START) == 0)
         {
             int64_t duration_ns = 0;
 
             LOG("---wait for start, now is %s\n", paused ? "paused" : "playing");
-            ret = wait_for_start();
+            ret = wait_for_start(ctx);
             LOG("---wait for start done.\n");
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
 
+            latency_us = get_monotonic_us() - issue_us;
+
             ret = get_audio_tracks_num(pipeline, &audio_track_num);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
 
             ret = get_duration(pipeline, &duration_ns);
-            if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+            if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
             {
                 break;
             }
@@ -1094,7 +1541,7 @@ int process_cmd(const char *cmds[], int32_t cmd_num, char **files,
             LOG("---max seek time: %lld ns, max sleep time: %lld us\n",
                 max_seek_time_ns, max_sleep_time_us);
         }
-        else if (strcasecmp(cmds[cmd_index], PLAY_CMD_WAIT_FOR_FINISH) == 0)
+        else if (strcasecmp(name, PLAY_CMD_WAIT_FOR_FINISH) == 0)
         {
             if (random_the_cmd & paused)
             {
@@ -1104,23 +1551,30 @@ int process_cmd(const char *cmds[], int32_t cmd_num, char **files,
             {
                 LOG("---wait for finish, now is %s\n", paused ? "paused" : "playing");
 
-                ret = wait_for_finish();
-                if (check_error(ret, check_error_is_enabled) != ERROR_CODE_OK)
+                ret = wait_for_finish(ctx);
+                if (check_error(ctx, ret, check_error_is_enabled) != ERROR_CODE_OK)
                 {
                     break;
                 }
 
+                latency_us = get_monotonic_us() - issue_us;
                 LOG("---wait for finish done.\n");
             }
         }
         else
         {
-            LOG("---unkown cmd: %s\n", cmds[cmd_index]);
+            LOG("---unkown cmd: %s\n", name);
+        }
+
+        if (measure)
+        {
+            results_write(ctx->id, cmd_index, name, arg, issue_us,
+                          latency_us, cmd->deadline_ms, ret);
         }
 
         if (random_the_cmd)
         {
-            cmd_index = rand_int() % cmd_num;
+            cmd_index = rand_int(ctx) % cmd_num;
         }
         else
         {
@@ -1132,10 +1586,17 @@ int process_cmd(const char *cmds[], int32_t cmd_num, char **files,
         }
     }
 
+    /* only a failed check_error() leaves the loop, the bus may have failed an ok cmd */
+    if (measure)
+    {
+        results_write(ctx->id, cmd_index, name, arg, issue_us, -1,
+                      cmd->deadline_ms, (ret != ERROR_CODE_OK) ? ret : ERROR_CODE_BASE_ERROR);
+    }
+
     if (pipeline != NULL)
     {
         LOG("---release %s\n", file_path);
-        release(loop, thread_id, pipeline, watch_id);
+        release(ctx, loop, thread_id, pipeline, watch_id);
         loop = NULL;
         thread_id = 0;
         pipeline = NULL;
@@ -1145,6 +1606,160 @@ int process_cmd(const char *cmds[], int32_t cmd_num, char **files,
     return ERROR_CODE_OK;
 }
 
+void report_latency(const char *name, const LatencyStat *stat)
+{
+    if (stat->count == 0)
+    {
+        LOG("    %s latency: no sample\n", name);
+        return;
+    }
+
+    LOG("    %s latency: count %lld, avg %lld us, min %lld us, max %lld us\n",
+        name, (long long)stat->count,
+        (long long)(stat->total_us / stat->count),
+        (long long)stat->min_us, (long long)stat->max_us);
+}
+
+int report_stats(PlayContext *contexts[], int32_t num)
+{
+    int32_t index = 0;
+    PlayContext total;
+
+    memset(&total, 0, sizeof(total));
+
+    for (index = 0; index < num; index++)
+    {
+        PlayContext *ctx = contexts[index];
+
+        pthread_mutex_lock(&ctx->lock);
+        LOG("---worker %d: cmds %d, failed cmds %d, bus errors %d, "
+            "bus warnings %d, error rate %.2f%%\n",
+            ctx->id, ctx->cmd_count, ctx->cmd_failed_count,
+            ctx->bus_error_count, ctx->bus_warning_count,
+            ctx->cmd_count ? 100.0 * ctx->cmd_failed_count / ctx->cmd_count : 0.0);
+        report_latency("start", &ctx->start_latency);
+        report_latency("seek", &ctx->seek_latency);
+
+        total.cmd_count += ctx->cmd_count;
+        total.cmd_failed_count += ctx->cmd_failed_count;
+        total.bus_error_count += ctx->bus_error_count;
+        total.bus_warning_count += ctx->bus_warning_count;
+        latency_stat_merge(&total.start_latency, &ctx->start_latency);
+        latency_stat_merge(&total.seek_latency, &ctx->seek_latency);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    LOG("---all %d workers: cmds %d, failed cmds %d, bus errors %d, "
+        "bus warnings %d, error rate %.2f%%\n",
+        num, total.cmd_count, total.cmd_failed_count,
+        total.bus_error_count, total.bus_warning_count,
+        total.cmd_count ? 100.0 * total.cmd_failed_count / total.cmd_count : 0.0);
+    report_latency("start", &total.start_latency);
+    report_latency("seek", &total.seek_latency);
+
+    return ERROR_CODE_OK;
+}
+
+/* one soak worker: a pipeline with its own play context */
+typedef struct _Worker
+{
+    PlayContext ctx;
+    pthread_t thread_id;
+
+    const PlayCmd *cmds;
+    int32_t cmd_num;
+    char **files;
+    int32_t file_num;
+    int32_t random_the_cmd;
+    int32_t random_the_file;
+    int32_t sleep_is_enabled;
+} Worker;
+
+void *worker_run(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    GMainContext *context = g_main_context_new();
+
+    /* keep the discoverer of this worker off the shared default context */
+    g_main_context_push_thread_default(context);
+
+    /* nobody can answer check_error() prompts from several workers */
+    process_cmd(&worker->ctx, worker->cmds, worker->cmd_num,
+                worker->files, worker->file_num,
+                worker->random_the_cmd, worker->random_the_file,
+                worker->sleep_is_enabled, 0);
+
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+
+    pthread_exit((void *)"worker done");
+}
+
+int process_cmd_concurrently(int32_t worker_num, const PlayCmd cmds[],
+                             int32_t cmd_num, char **files, int32_t file_num,
+                             int32_t random_the_cmd, int32_t random_the_file,
+                             int32_t sleep_is_enabled, unsigned int seed)
+{
+    Worker *workers = NULL;
+    PlayContext *contexts[MAX_WORKER_NUM] = {NULL};
+    int32_t started = 0;
+    int32_t index = 0;
+
+    if (worker_num < 1 || worker_num > MAX_WORKER_NUM)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    workers = (Worker *)calloc(worker_num, sizeof(Worker));
+    if (workers == NULL)
+    {
+        LOG("calloc failed!\n");
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    LOG("------%d workers begin...\n", worker_num);
+
+    for (index = 0; index < worker_num; index++)
+    {
+        Worker *worker = &workers[index];
+
+        /* each worker gets its own, but reproducible, sequence */
+        init_play_context(&worker->ctx, index, seed + index);
+        worker->cmds = cmds;
+        worker->cmd_num = cmd_num;
+        worker->files = files;
+        worker->file_num = file_num;
+        worker->random_the_cmd = random_the_cmd;
+        worker->random_the_file = random_the_file;
+        worker->sleep_is_enabled = sleep_is_enabled;
+
+        if (pthread_create(&worker->thread_id, NULL, worker_run, worker))
+        {
+            LOG("create worker %d failed!\n", index);
+            deinit_play_context(&worker->ctx);
+            break;
+        }
+        contexts[started++] = &worker->ctx;
+    }
+
+    for (index = 0; index < started; index++)
+    {
+        pthread_join(workers[index].thread_id, NULL);
+    }
+
+    LOG("------%d workers end!\n", started);
+    report_stats(contexts, started);
+
+    for (index = 0; index < started; index++)
+    {
+        deinit_play_context(&workers[index].ctx);
+    }
+    free(workers);
+
+    return ERROR_CODE_OK;
+}
+
 //------------------------------------------------------
 #define PATH_MAX_LEN 128
 
@@ -1153,17 +1768,25 @@ int parse_argv(int argc, char *argv[],
                int32_t *random_the_cmd,
                int32_t *random_the_file,
                int32_t *sleep_is_enabled,
-               int32_t *check_error_is_enabled)
+               int32_t *check_error_is_enabled,
+               int32_t *worker_num,
+               char *script_path,
+               char *results_path,
+               unsigned int *seed)
 {
     int index = 0;
     size_t size = sizeof("media_path=");
+    size_t workers_size = strlen("workers=");
+    size_t script_size = strlen("script=");
+    size_t results_size = strlen("results=");
+    size_t seed_size = strlen("seed=");
 
     if (argv == NULL)
     {
         return ERROR_CODE_OK;
     }
 
-    if (media_path == NULL || random_the_cmd == NULL || random_the_file == NULL || sleep_is_enabled == NULL || check_error_is_enabled == NULL)
+    if (media_path == NULL || random_the_cmd == NULL || random_the_file == NULL || sleep_is_enabled == NULL || check_error_is_enabled == NULL || worker_num == NULL || script_path == NULL || results_path == NULL || seed == NULL)
     {
         LOG("bad parameter!\n");
         return ERROR_CODE_BAD_PARAMETER;
@@ -1175,8 +1798,10 @@ int parse_argv(int argc, char *argv[],
         {
             LOG("%s [media_path=/media/] [random_the_cmd=1] "
                 "[random_the_file=0] [disable_sleep=1] "
-                "[disable_check_error=1]\n",
-                argv[0]);
+                "[disable_check_error=1] [workers=1..%d] "
+                "[script=/path/cmds.txt] [results=/path/results.csv] "
+                "[seed=N]\n",
+                argv[0], MAX_WORKER_NUM);
             continue;
         }
 
@@ -1217,6 +1842,50 @@ int parse_argv(int argc, char *argv[],
             *check_error_is_enabled = 0;
             continue;
         }
+
+        if (strncasecmp(argv[index], "workers=", workers_size) == 0)
+        {
+            int num = atoi(argv[index] + workers_size);
+
+            if (num < 1 || num > MAX_WORKER_NUM)
+            {
+                LOG("bad parameter!\n");
+                return ERROR_CODE_BAD_PARAMETER;
+            }
+
+            *worker_num = num;
+            continue;
+        }
+
+        if (strncasecmp(argv[index], "script=", script_size) == 0)
+        {
+            if (strlen(argv[index] + script_size) >= PATH_MAX_LEN)
+            {
+                LOG("bad parameter!\n");
+                return ERROR_CODE_BAD_PARAMETER;
+            }
+
+            strcpy(script_path, argv[index] + script_size);
+            continue;
+        }
+
+        if (strncasecmp(argv[index], "results=", results_size) == 0)
+        {
+            if (strlen(argv[index] + results_size) >= PATH_MAX_LEN)
+            {
+                LOG("bad parameter!\n");
+                return ERROR_CODE_BAD_PARAMETER;
+            }
+
+            strcpy(results_path, argv[index] + results_size);
+            continue;
+        }
+
+        if (strncasecmp(argv[index], "seed=", seed_size) == 0)
+        {
+            *seed = (unsigned int)strtoul(argv[index] + seed_size, NULL, 0);
+            continue;
+        }
     }
 
     return ERROR_CODE_OK;
@@ -1461,7 +2130,7 @@ int get_char_array_len(const char *array[], int32_t *num)
     return ERROR_CODE_OK;
 }
 
-const char *cmds[] = {
+const char *default_cmds[] = {
     PLAY_CMD_PLAY,
     PLAY_CMD_START,
     PLAY_CMD_WAIT_FOR_START,
@@ -1481,7 +2150,11 @@ int main(int argc, char *argv[])
 {
     char media_path[PATH_MAX_LEN] = "/media";
 
+    char script_path[PATH_MAX_LEN] = {0};
+    char results_path[PATH_MAX_LEN] = {0};
+
     char **files = NULL;
+    PlayCmd *cmds = NULL;
 
     int32_t cmd_num = 0;
     int32_t filter_len = 0;
@@ -1491,19 +2164,58 @@ int main(int argc, char *argv[])
     int32_t random_the_file = 0;
     int32_t sleep_is_enabled = 1;
     int32_t check_error_is_enabled = 1;
+    int32_t worker_num = 1;
+    unsigned int seed = (unsigned int)time(NULL);
 
     parse_argv(argc, argv, media_path,
                &random_the_cmd, &random_the_file,
-               &sleep_is_enabled, &check_error_is_enabled);
+               &sleep_is_enabled, &check_error_is_enabled,
+               &worker_num, script_path, results_path, &seed);
+
+    /* print the seed so that a random run can be replayed with seed=N */
+    LOG("------seed: %u\n", seed);
 
     get_char_array_len(filter, &filter_len);
     scan_media_files(media_path, filter, filter_len, &files, &file_num);
 
-    get_char_array_len(cmds, &cmd_num);
-    process_cmd(cmds, cmd_num, files, file_num,
-                random_the_cmd, random_the_file, sleep_is_enabled,
-                check_error_is_enabled);
+    if (script_path[0] != '\0')
+    {
+        if (cmdscript_load(script_path, &cmds, &cmd_num) != ERROR_CODE_OK)
+        {
+            free_media_files(files, file_num);
+            return -1;
+        }
+    }
+    else
+    {
+        get_char_array_len(default_cmds, &cmd_num);
+        cmdscript_from_names(default_cmds, cmd_num, &cmds);
+    }
+
+    if (results_path[0] != '\0')
+    {
+        results_open(results_path);
+    }
+
+    if (worker_num > 1)
+    {
+        process_cmd_concurrently(worker_num, cmds, cmd_num, files, file_num,
+                                 random_the_cmd, random_the_file,
+                                 sleep_is_enabled, seed);
+    }
+    else
+    {
+        PlayContext *contexts[1] = {&default_context};
+
+        default_context.rand_seed = seed;
+        process_cmd(&default_context, cmds, cmd_num, files, file_num,
+                    random_the_cmd, random_the_file, sleep_is_enabled,
+                    check_error_is_enabled);
+        report_stats(contexts, 1);
+    }
 
+    results_close();
+    cmdscript_free(cmds);
     free_media_files(files, file_num);
 
     return 0;
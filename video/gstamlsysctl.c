@@ -246,3 +246,59 @@ int set_ppmgr_angle(int angle)
     return set_sysfs_int("/sys/class/ppmgr/angle", angle);
 }
 
+
+int get_vcodec_profile(char *buf, int size)
+{
+    int fd;
+    int len = 0;
+    int ret;
+
+    if (buf == NULL || size < 1)
+        return -1;
+
+    fd = open("/sys/class/amstream/vcodec_profile", O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    while (len < size - 1) {
+        ret = read(fd, buf + len, size - 1 - len);
+        if (ret <= 0)
+            break;
+        len += ret;
+    }
+    buf[len] = '\0';
+    close(fd);
+    return len;
+}
+
+/* pixels cut from each edge of the source, all 0 to disable */
+int set_video_crop(int top, int left, int bottom, int right)
+{
+    char str[64];
+
+    snprintf(str, sizeof(str), "%d %d %d %d", top, left, bottom, right);
+    return set_sysfs_str("/sys/class/video/crop", str);
+}
+
+/* refresh rate of the display mode, e.g. 1080p60hz, 0 if unknown */
+int get_display_refresh(void)
+{
+    char mode[32] = {0};
+    char *hz;
+    char *p;
+
+    if (get_sysfs_str("/sys/class/display/mode", mode, sizeof(mode)) < 0)
+        return 0;
+
+    hz = strstr(mode, "hz");
+    if (hz == NULL)
+        return 0;
+
+    p = hz;
+    while (p > mode && (isdigit((unsigned char)p[-1]) || p[-1] == '.'))
+        p--;
+    if (p == hz)
+        return 0;
+
+    return (int)(atof(p) + 0.5);
+}
@@ -24,5 +24,8 @@ int set_display_axis(int recovery);
 int set_vdec_path(char *path);
 int set_ppmgr_bypass(char *enable);
 int set_ppmgr_angle(int angle);
+int get_vcodec_profile(char *buf, int size);
+int set_video_crop(int top, int left, int bottom, int right);
+int get_display_refresh(void);
 
 #endif //_GST_AML_SYSCTL_H_
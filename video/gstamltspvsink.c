@@ -41,11 +41,14 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
 #include "video_adaptor.h"
 #include "gstamlsysctl.h"
+#include "bufferlevel.h"
 
 #define GST_USE_UNSTABLE_API 1
 #include <gst/codecparsers/gsth264parser.h>
@@ -69,12 +72,49 @@ GST_DEBUG_CATEGORY_STATIC(gst_amltspvsink_debug_category);
 
 #define gst_amltspvsink_parent_class parent_class
 
-#define COMMON_VIDEO_CAPS          \
-    "width = (int) [ 16, 1920 ], " \
-    "height = (int) [ 16, 1920 ] "
+/* decoder capability */
+#define VCODEC_PROFILE_SIZE 4096
+#define FHD_MAX_SIZE 1920
+#define UHD_MAX_SIZE 4096
 
 #define PTS_90K 90000
 
+/* low latency, buffer depth bounds in ms */
+#define DEFAULT_LATENCY_TARGET 150
+#define MIN_LATENCY_TARGET 20
+#define MAX_LATENCY_TARGET 2000
+#define LOW_LATENCY_CATCHUP_RATE 1.1
+
+/* qos */
+#define QOS_INTERVAL_US 100000                  /* decoder lateness checked at most this often */
+#define QOS_DROP_THRESHOLD (40 * GST_MSECOND)   /* drop non reference frames when later than this */
+#define QOS_DEFAULT_DURATION (40 * GST_MSECOND) /* frame duration if the framerate is unknown */
+
+/* preroll-first-frame */
+#define PREROLL_FIRST_FRAME_TIMEOUT_US 1000000
+
+/* vfm path switch, wait this long for the decoder buffer to drain */
+#define PATH_SWITCH_DRAIN_TIMEOUT_US 1000000
+
+/* pts discontinuity, 90KHz */
+#define PTS_DISCONT_THRESHOLD 90000        /* jumps past 1s re-anchor sync */
+#define PTS_DISCONT_THRESHOLD_FLAGGED 27000 /* past 300ms on a DISCONT buffer */
+
+/* decoder events */
+#define EVENT_RING_SIZE 64     /* power of two */
+#define EVENT_USERDATA_MAX 256 /* cc/afd payload bytes kept per event */
+
+/* user data from the decoder */
+#define CC_CAPS "closedcaption/x-cea-708, format=(string)cc_data"
+#define CC_DATA_TYPE 0x03 /* user_data_type_code of cc_data() in A/53 */
+#define CC_QUEUE_MAX 32   /* cc buffers waiting for the cc task */
+
+/* geometry updates */
+#define GEOMETRY_DEFAULT_REFRESH 60 /* Hz, if the display mode has none */
+#define GEOMETRY_WINDOW 0x1
+#define GEOMETRY_ANGLE 0x2
+#define GEOMETRY_CROP 0x4
+
 typedef enum
 {
     ED_TYPE_INVALID = -1,
@@ -93,7 +133,48 @@ typedef struct _ExtraData
     int pps_size;
 } ExtraData;
 
-/* private */
+/* a decoder event copied out of the tsplayer callback */
+typedef struct _DecoderEvent
+{
+    am_tsplayer_event_type type;
+    union
+    {
+        am_tsplayer_video_format_t video_format;
+        struct
+        {
+            guint32 len;
+            guint8 data[EVENT_USERDATA_MAX];
+        } user_data;
+    } u;
+} DecoderEvent;
+
+/* requested video geometry, applied by the geometry thread */
+typedef struct _Geometry
+{
+    gint32 x; /* window */
+    gint32 y;
+    gint32 w;
+    gint32 h;
+    gint32 angle;
+    gint32 crop_top; /* source pixels cut from each edge */
+    gint32 crop_left;
+    gint32 crop_bottom;
+    gint32 crop_right;
+} Geometry;
+
+/*
+ * Locking, outer to inner:
+ * - sink pad stream lock: the data path. basesink holds it across
+ *   render, preroll, set_caps and serialized events, FLUSH_STOP
+ *   included, and it guards the es, au, extradata, qos, pts and
+ *   preroll state. The decoder writes run under it and nothing else.
+ * - control_lock: window, angle and pause/resume of the decoder, so UI
+ *   driven calls are serialized without waiting behind frame writes.
+ * - GST_OBJECT_LOCK: segment and flags only, never held across adaptor
+ *   calls.
+ * - level_lock: monitor thread state.
+ * - cc_lock: the cc queue between the event thread and the cc pad task.
+ */
 struct _GstAmltspvsinkPrivate
 {
     GstAmltspvsink *sink;
@@ -116,6 +197,9 @@ struct _GstAmltspvsinkPrivate
     /* es framerate */
     gdouble fr; /* frame rate */
 
+    /* decoder controls, protected by control_lock */
+    GMutex control_lock;
+
     /* display position and dimension */
     gboolean setwindow;
     gint32 disp_x;
@@ -127,6 +211,40 @@ struct _GstAmltspvsinkPrivate
     gboolean setangle;
     gint32 angle;
 
+    gboolean cropped; /* crop applied, reset on READY_TO_NULL */
+
+    /*
+     * decoder events, a single producer single consumer ring: the tsplayer
+     * callback thread only advances event_head, the event thread only
+     * event_tail, and event_fd wakes the event thread.
+     */
+    DecoderEvent events[EVENT_RING_SIZE];
+    gint event_head;
+    gint event_tail;
+    guint events_dropped; /* ring full, atomic */
+    gint event_fd;
+    GThread *event_thread;
+    gboolean quit_event; /* atomic */
+
+    /* closed captions and afd from decoder user data, see cc_loop() */
+    GstPad *cc_pad;
+    gboolean cc_need_events; /* stream-start, caps and segment, atomic */
+    gint afd;                /* last posted active_format, -1 if none */
+    GMutex cc_lock;          /* cc_queue and cc_flushing */
+    GCond cc_cond;
+    GQueue cc_queue;      /* buffers and EOS for the cc pad task */
+    gboolean cc_flushing; /* cc task paused or stopped */
+
+    /* geometry updates, protected by geometry_lock */
+    GThread *geometry_thread;
+    gboolean quit_geometry;
+    GMutex geometry_lock;
+    GCond geometry_cond;
+    guint geometry_pending;      /* GEOMETRY_* parts of geometry to apply */
+    Geometry geometry;           /* latest request */
+    gint64 geometry_interval_us; /* one display refresh */
+    gint64 geometry_next_us;     /* no apply before this monotonic time */
+
     /* time */
     gint64 pts;
     gint64 duration;
@@ -138,6 +256,70 @@ struct _GstAmltspvsinkPrivate
     gboolean extradata_got;
     ExtraData extradata;
     gboolean extradata_injected;
+
+    /* avc/avc3/hvc1/hev1 to annex-b */
+    gint nal_length_size; /* 0 for byte-stream */
+    guint8 *convert_buf;  /* for aus that can not be rewritten in place */
+    gsize convert_size;
+
+    /* alignment=nal, nals written as they come, only au boundaries tracked */
+    gboolean nal_aligned;
+    GstBufferList *au;   /* non-vcl nals held until the first slice of the au */
+    guint64 au_pts;
+    GstClockTime au_time; /* buffer timestamp of the au, for qos messages */
+    gboolean au_has_vcl;  /* first slice seen, drop or keep is decided */
+    gboolean au_dropped;  /* the rest of the au is dropped */
+    gboolean au_written;  /* part of the au is in the decoder, no more drops */
+
+    /* low latency */
+    gboolean low_latency;
+    guint latency_target; /* max decoder buffer depth, ms */
+    gboolean catching_up; /* playing at LOW_LATENCY_CATCHUP_RATE */
+    gboolean drop_to_key; /* dropping until the next key frame */
+    gdouble segment_rate;
+
+    /* av sync */
+    gint sync_mode;
+    gboolean drift_compensation;
+
+    /* decoder buffer level monitor, protected by level_lock */
+    GThread *monitor_thread;
+    gboolean quit_monitor;
+    gboolean flushing;
+    GMutex level_lock;
+    GCond level_cond;
+    gint buffer_level; /* percent, -1 if unknown */
+    gint low_watermark;
+    gint high_watermark;
+    gint level_state; /* LEVEL_STATE_* */
+    LatencyWindow latency; /* es write to display delay */
+    guint64 display_pts; /* sampled decoder pts, 90KHz, 0 if unknown */
+    gboolean first_frame; /* decoder showed a frame since the last flush */
+
+    /* preroll-first-frame */
+    gboolean preroll_first_frame;
+    gboolean preroll_armed;    /* wait at the next preroll, set at READY_TO_PAUSED and FLUSH_STOP */
+    GstBuffer *preroll_buffer; /* consumed by preroll, skipped by render */
+
+    /* gapless, decoder timeline in running time */
+    gboolean gapless;
+    gboolean vdec_started; /* decoder started by set_caps */
+    const gchar *vdec_mime;
+    gint vdec_version;
+
+    /* pts discontinuity, streaming thread only */
+    gboolean last_pts_valid;
+    guint64 last_pts; /* 90KHz */
+
+    /* qos, streaming thread only */
+    gint64 qos_last_us;          /* monotonic time of the last lateness check */
+    GstClockTimeDiff qos_base;   /* smallest display offset since the last flush */
+    GstClockTimeDiff qos_jitter; /* decoder late by, ns, negative if early */
+    gdouble qos_proportion;
+    gboolean qos_dropping;       /* dropping non reference frames */
+    guint64 qos_processed;
+    guint64 qos_dropped;
+    guint64 frames_written; /* pictures taken by the decoder */
 };
 
 enum
@@ -145,12 +327,42 @@ enum
     PROP_0,
     PROP_WINDOW_SET,
     PROP_KEEPOSD,
-    PROP_RENDER_ANGLE
+    PROP_RENDER_ANGLE,
+    PROP_LOW_LATENCY,
+    PROP_LATENCY_TARGET,
+    PROP_BUFFERED_TIME,
+    PROP_SYNC_MODE,
+    PROP_DRIFT_COMPENSATION,
+    PROP_BUFFER_LEVEL,
+    PROP_BUFFER_WATERMARKS,
+    PROP_PREROLL_FIRST_FRAME,
+    PROP_GAPLESS
 };
 
+#define GST_TYPE_AMLTSPVSINK_SYNC_MODE (gst_amltspvsink_sync_mode_get_type())
+static GType
+gst_amltspvsink_sync_mode_get_type(void)
+{
+    static GType sync_mode_type = 0;
+    static const GEnumValue sync_modes[] = {
+        {SESSION_SYNC_AUTO, "Video master, audio master once audio starts", "auto"},
+        {SESSION_SYNC_VMASTER, "Video master", "vmaster"},
+        {SESSION_SYNC_AMASTER, "Audio master", "amaster"},
+        {SESSION_SYNC_PCRMASTER, "PCR master, for live sources", "pcrmaster"},
+        {SESSION_SYNC_NOSYNC, "No sync", "nosync"},
+        {0, NULL, NULL}};
+
+    if (!sync_mode_type)
+    {
+        sync_mode_type = g_enum_register_static("GstAmltspvsinkSyncMode", sync_modes);
+    }
+    return sync_mode_type;
+}
+
 enum
 {
     SIGNAL_FIRSTFRAME,
+    SIGNAL_UPDATE_GEOMETRY,
     MAX_SIGNAL
 };
 static guint g_signals[MAX_SIGNAL] = {0};
@@ -170,36 +382,62 @@ static GstCaps *gst_amltspvsink_get_caps(GstBaseSink *sink, GstCaps *filter);
 static gboolean gst_amltspvsink_set_caps(GstBaseSink *sink, GstCaps *caps);
 static gboolean gst_amltspvsink_start(GstBaseSink *sink);
 static gboolean gst_amltspvsink_stop(GstBaseSink *sink);
+static gboolean gst_amltspvsink_unlock(GstBaseSink *sink);
+static gboolean gst_amltspvsink_unlock_stop(GstBaseSink *sink);
 #if 0
 static void gst_amltspvsink_get_times (GstBaseSink * sink, GstBuffer * buffer,
     GstClockTime * start, GstClockTime * end);
 #endif
 static gboolean gst_amltspvsink_query(GstBaseSink *sink, GstQuery *query);
 static gboolean gst_amltspvsink_event(GstBaseSink *sink, GstEvent *event);
+static GstFlowReturn gst_amltspvsink_preroll(GstBaseSink *sink,
+                                             GstBuffer *buffer);
 static GstFlowReturn gst_amltspvsink_render(GstBaseSink *sink,
                                             GstBuffer *buffer);
+static void gst_amltspvsink_update_geometry(GstAmltspvsink *amltspvsink,
+                                            gint x, gint y, gint w, gint h, gint angle,
+                                            gint crop_top, gint crop_left,
+                                            gint crop_bottom, gint crop_right);
+
+static gboolean low_latency_control(GstAmltspvsink *amltspvsink, gboolean delta);
+static gboolean qos_droppable(GstAmltspvsinkPrivate *priv, const guint8 *data, gsize size);
+static void qos_post_drop(GstAmltspvsink *amltspvsink, GstClockTime timestamp);
 
 static void keeposd(gboolean blank);
 static void dump(const char *path, const uint8_t *data, int size,
                  gboolean vp9, int frame_cnt);
 
 /* pad templates */
-/* support h264/h265/mjpeg/mpeg1/mpeg2 */
-static GstStaticPadTemplate gst_amltspvsink_sink_template =
-    GST_STATIC_PAD_TEMPLATE("sink",
-                            GST_PAD_SINK,
-                            GST_PAD_ALWAYS,
-                            GST_STATIC_CAPS(
-                                "video/x-h264, "
-                                "stream-format={ byte-stream }, "
-                                "alignment={ au }, " COMMON_VIDEO_CAPS "; "
-                                "video/x-h265, "
-                                "stream-format={ byte-stream }, "
-                                "alignment={ au }, " COMMON_VIDEO_CAPS "; "
-                                "video/mpeg, "
-                                "mpegversion = (int) { 1, 2 }, "
-                                "systemstream = (boolean) false, " COMMON_VIDEO_CAPS "; "
-                                "image/jpeg, " COMMON_VIDEO_CAPS));
+/*
+ * The sink template is built at class init from the decoders listed in
+ * /sys/class/amstream/vcodec_profile, one line per decoder, e.g.
+ * "hevc:10bit;4k;" or "h264_4k2k:;". Without that file the template
+ * falls back to h264/h265/mjpeg/mpeg1/mpeg2 at 1080p.
+ */
+typedef struct _VcodecCap
+{
+    const char *name;           /* decoder name in vcodec_profile */
+    const char *caps;           /* es caps, without dimension */
+    gboolean uhd;               /* 4k capable when listed */
+    gboolean fallback;          /* advertised when probing fails */
+    const char *profiles;       /* 8 bit profiles, NULL for any */
+    const char *profiles_10bit; /* added when listed with 10bit */
+    const char *nal_caps;       /* nal aligned es caps, NULL if none */
+} VcodecCap;
+
+static const VcodecCap vcodec_caps[] = {
+    {"h264", "video/x-h264, stream-format = (string) { byte-stream, avc, avc3 }, alignment = (string) au",
+     FALSE, TRUE, NULL, NULL, "video/x-h264, stream-format = (string) byte-stream, alignment = (string) nal"},
+    {"hevc", "video/x-h265, stream-format = (string) { byte-stream, hvc1, hev1 }, alignment = (string) au",
+     TRUE, TRUE, "main, main-still-picture", "main-10", "video/x-h265, stream-format = (string) byte-stream, alignment = (string) nal"},
+    {"mpeg12", "video/mpeg, mpegversion = (int) { 1, 2 }, systemstream = (boolean) false",
+     FALSE, TRUE, NULL, NULL, NULL},
+    {"mpeg4", "video/mpeg, mpegversion = (int) 4, systemstream = (boolean) false",
+     FALSE, FALSE, NULL, NULL, NULL},
+    {"avs", "video/x-gst-av-avs", FALSE, FALSE, NULL, NULL, NULL},
+    {"avs2", "video/x-cavs", TRUE, FALSE, NULL, NULL, NULL},
+    {"mjpeg", "image/jpeg", FALSE, TRUE, NULL, NULL, NULL},
+};
 
 /* class initialization */
 G_DEFINE_TYPE_WITH_CODE(GstAmltspvsink, gst_amltspvsink, GST_TYPE_BASE_SINK,
@@ -208,6 +446,119 @@ G_DEFINE_TYPE_WITH_CODE(GstAmltspvsink, gst_amltspvsink, GST_TYPE_BASE_SINK,
                         G_ADD_PRIVATE(GstAmltspvsink));
 
 /******************************utils start*****************************/
+/* match a decoder in vcodec_profile lines, "h264" also matches "h264_4k2k" */
+static gboolean vcodec_profile_find(gchar **lines, const char *name,
+                                    gboolean *uhd, gboolean *tenbit)
+{
+    gboolean found = FALSE;
+    size_t len = strlen(name);
+    gint i;
+
+    for (i = 0; lines[i]; i++)
+    {
+        const gchar *line = lines[i];
+
+        if (strncmp(line, name, len) || (line[len] != ':' && line[len] != '_'))
+        {
+            continue;
+        }
+        found = TRUE;
+        if (strstr(line, "4k"))
+        {
+            *uhd = TRUE;
+        }
+        if (strstr(line, "10bit"))
+        {
+            *tenbit = TRUE;
+        }
+    }
+    return found;
+}
+
+static void append_vcodec_structure(GString *str, const char *caps, gint max_size,
+                                    gboolean tenbit, const VcodecCap *cap)
+{
+    if (str->len)
+    {
+        g_string_append(str, "; ");
+    }
+    g_string_append_printf(str, "%s, width = (int) [ 16, %d ], height = (int) [ 16, %d ]",
+                           caps, max_size, max_size);
+    if (cap->profiles && tenbit)
+    {
+        g_string_append_printf(str, ", profile = (string) { %s, %s }",
+                               cap->profiles, cap->profiles_10bit);
+    }
+    else if (cap->profiles)
+    {
+        g_string_append_printf(str, ", profile = (string) { %s }", cap->profiles);
+    }
+}
+
+/* sink caps from the probed decoders, lines is NULL for the fallback set */
+static void append_vcodec_caps(GString *str, gchar **lines)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(vcodec_caps); i++)
+    {
+        const VcodecCap *cap = &vcodec_caps[i];
+        gboolean uhd = FALSE;
+        gboolean tenbit = FALSE;
+        gint max_size;
+
+        if (lines)
+        {
+            if (!vcodec_profile_find(lines, cap->name, &uhd, &tenbit))
+            {
+                continue;
+            }
+            uhd |= cap->uhd;
+        }
+        else if (!cap->fallback)
+        {
+            continue;
+        }
+
+        max_size = uhd ? UHD_MAX_SIZE : FHD_MAX_SIZE;
+        append_vcodec_structure(str, cap->caps, max_size, tenbit, cap);
+        if (cap->nal_caps)
+        {
+            append_vcodec_structure(str, cap->nal_caps, max_size, tenbit, cap);
+        }
+        GST_INFO("vcodec %s, max size %d, 10bit %d", cap->name, max_size, tenbit);
+    }
+}
+
+static GstCaps *probe_sink_caps(void)
+{
+    char profile[VCODEC_PROFILE_SIZE];
+    GString *str = g_string_new(NULL);
+    GstCaps *caps = NULL;
+
+    if (get_vcodec_profile(profile, sizeof(profile)) > 0)
+    {
+        gchar **lines = g_strsplit(profile, "\n", -1);
+        gint i;
+
+        for (i = 0; lines[i]; i++)
+        {
+            g_strstrip(lines[i]);
+        }
+        append_vcodec_caps(str, lines);
+        g_strfreev(lines);
+    }
+    if (!str->len)
+    {
+        GST_WARNING("no decoder probed, use the default caps");
+        append_vcodec_caps(str, NULL);
+    }
+
+    caps = gst_caps_from_string(str->str);
+    g_string_free(str, TRUE);
+    return caps;
+}
+
 static void keeposd(gboolean blank)
 {
     static int fb0_enable = -1;
@@ -246,382 +597,2009 @@ static void keeposd(gboolean blank)
     return;
 }
 
-/* video_adaptor callback base on AmTsPlayer */
+/*
+ * video_adaptor callback base on AmTsPlayer. It runs on the tsplayer
+ * event thread, so it only copies the event into the ring and wakes the
+ * event thread; application handlers and sysfs i/o run there.
+ */
 void video_callback(void *user_data, am_tsplayer_event *event)
 {
     GstAmltspvsink *amltspvsink = (GstAmltspvsink *)user_data;
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    DecoderEvent *slot = NULL;
+    guint64 one = 1;
+    gint head = 0;
+
+    if (NULL == event)
+    {
+        return;
+    }
+
+    head = g_atomic_int_get(&priv->event_head);
+    if (head - g_atomic_int_get(&priv->event_tail) >= EVENT_RING_SIZE)
+    {
+        g_atomic_int_inc(&priv->events_dropped);
+        return;
+    }
 
-    GST_INFO_OBJECT(amltspvsink, "video_callback type %d\n", event ? event->type : 0);
+    slot = &priv->events[head & (EVENT_RING_SIZE - 1)];
+    slot->type = event->type;
     switch (event->type)
     {
     case AM_TSPLAYER_EVENT_TYPE_VIDEO_CHANGED:
     {
-        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_VIDEO_CHANGED: %d x %d @%d [%d]\n",
-                        event->event.video_format.frame_width,
-                        event->event.video_format.frame_height,
-                        event->event.video_format.frame_rate,
-                        event->event.video_format.frame_aspectratio);
+        slot->u.video_format = event->event.video_format;
         break;
     }
     case AM_TSPLAYER_EVENT_TYPE_USERDATA_AFD:
     case AM_TSPLAYER_EVENT_TYPE_USERDATA_CC:
     {
-        uint8_t *pbuf = event->event.mpeg_user_data.data;
-        uint32_t size = event->event.mpeg_user_data.len;
-        GST_INFO_OBJECT(amltspvsink, "[evt] USERDATA [%d] : %x-%x-%x-%x %x-%x-%x-%x ,size %d\n",
-                        event->type, pbuf[0], pbuf[1], pbuf[2], pbuf[3],
-                        pbuf[4], pbuf[5], pbuf[6], pbuf[7], size);
+        /* the payload belongs to tsplayer once we return */
+        slot->u.user_data.len = MIN(event->event.mpeg_user_data.len, EVENT_USERDATA_MAX);
+        if (event->event.mpeg_user_data.data)
+        {
+            memcpy(slot->u.user_data.data, event->event.mpeg_user_data.data, slot->u.user_data.len);
+        }
+        else
+        {
+            slot->u.user_data.len = 0;
+        }
         break;
     }
-    case AM_TSPLAYER_EVENT_TYPE_FIRST_FRAME:
-    {
-        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_FIRST_FRAME\n");
-        g_signal_emit(G_OBJECT(amltspvsink), g_signals[SIGNAL_FIRSTFRAME], 0, 2, NULL);
-        keeposd(amltspvsink->priv->keeposd);
+    default:
         break;
     }
-    case AM_TSPLAYER_EVENT_TYPE_DECODE_FIRST_FRAME_VIDEO:
+    g_atomic_int_set(&priv->event_head, head + 1);
+
+    if (write(priv->event_fd, &one, sizeof(one)) != sizeof(one))
     {
-        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_DECODE_FIRST_FRAME_VIDEO\n");
-        break;
+        GST_WARNING_OBJECT(amltspvsink, "wake event thread failed");
     }
-    case AM_TSPLAYER_EVENT_TYPE_DECODE_FIRST_FRAME_AUDIO:
+}
+
+static GstClockTime es_pts_to_running_time(GstAmltspvsinkPrivate *priv, const GstSegment *segment,
+                                           guint64 pts);
+
+/* offset just past a registered user data identifier, -1 if absent */
+static gint userdata_find(const guint8 *data, guint32 len, const gchar *id)
+{
+    guint32 i = 0;
+
+    for (i = 0; i + 4 <= len; i++)
     {
-        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_DECODE_FIRST_FRAME_AUDIO\n");
-        break;
+        if (0 == memcmp(data + i, id, 4))
+        {
+            return (gint)(i + 4);
+        }
     }
-    case AM_TSPLAYER_EVENT_TYPE_AV_SYNC_DONE:
+    return -1;
+}
+
+/*
+ * cc_data() of ATSC A/53 user data: "GA94", type 0x03, a flags byte
+ * with process_cc_data_flag and cc_count, em_data, then cc_count 3 byte
+ * constructs. The constructs are handed on as they are.
+ */
+static guint32 userdata_cc(const guint8 *data, guint32 len, const guint8 **cc_data)
+{
+    gint pos = userdata_find(data, len, "GA94");
+    guint32 count = 0;
+
+    if (pos < 0 || (guint32)pos + 3 > len || CC_DATA_TYPE != data[pos] || !(data[pos + 1] & 0x40))
     {
-        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_AV_SYNC_DONE\n");
-        break;
+        return 0;
     }
-    default:
-        break;
+    count = data[pos + 1] & 0x1f;
+    pos += 3;
+    count = MIN(count, (len - pos) / 3);
+    *cc_data = data + pos;
+    return count * 3;
+}
+
+/* active_format of ETSI TS 101 154 AFD user data: "DTG1", -1 if none */
+static gint userdata_afd(const guint8 *data, guint32 len)
+{
+    gint pos = userdata_find(data, len, "DTG1");
+
+    if (pos < 0 || (guint32)pos + 2 > len || !(data[pos] & 0x40))
+    {
+        return -1;
     }
+    return data[pos + 1] & 0x0f;
 }
 
-#ifdef DUMP_TO_FILE
-static uint8_t ivf_header[32] = {
-    'D', 'K', 'I', 'F',
-    0x00, 0x00, 0x20, 0x00,
-    'V', 'P', '9', '0',
-    0x80, 0x07, 0x38, 0x04, /* 1920 x 1080 */
-    0x30, 0x76, 0x00, 0x00, /* frame rate */
-    0xe8, 0x03, 0x00, 0x00, /* time scale */
-    0x00, 0x00, 0xff, 0xff, /* # of frames */
-    0x00, 0x00, 0x00, 0x00  /* unused */
-};
+/* running time of the decoder position, user data has no pts of its own */
+static GstClockTime userdata_running_time(GstAmltspvsink *amltspvsink)
+{
+    GstBaseSink *basesink = GST_BASE_SINK(amltspvsink);
+    GstClockTime running_time = GST_CLOCK_TIME_NONE;
+    uint64_t vpts = 0;
 
-static void dump(const char *path, const uint8_t *data, int size, gboolean vp9, int frame_cnt)
+    if (ERROR_CODE_OK != video_get_pts(&vpts) || 0 == vpts)
+    {
+        return GST_CLOCK_TIME_NONE;
+    }
+    GST_OBJECT_LOCK(amltspvsink);
+    running_time = es_pts_to_running_time(amltspvsink->priv, &basesink->segment, vpts);
+    GST_OBJECT_UNLOCK(amltspvsink);
+
+    return running_time;
+}
+
+static void cc_queue_clear(GstAmltspvsinkPrivate *priv)
 {
-    char name[50];
-    uint8_t frame_header[12] = {0};
-    FILE *fd;
+    GstMiniObject *obj = NULL;
 
-    if (!data)
-        return;
+    while ((obj = (GstMiniObject *)g_queue_pop_head(&priv->cc_queue)))
+    {
+        gst_mini_object_unref(obj);
+    }
+}
 
-    sprintf(name, "%s%d.dat", path, 0);
-    fd = fopen(name, "ab");
+/* hand a cc buffer or EOS to the cc task, never blocks the caller */
+static void cc_queue_push(GstAmltspvsink *amltspvsink, GstMiniObject *obj)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
 
-    if (!fd)
+    g_mutex_lock(&priv->cc_lock);
+    if (priv->cc_flushing ||
+        (GST_IS_BUFFER(obj) && g_queue_get_length(&priv->cc_queue) >= CC_QUEUE_MAX))
+    {
+        /* flushing, or downstream is stuck and late captions are of no use */
+        g_mutex_unlock(&priv->cc_lock);
+        GST_DEBUG_OBJECT(amltspvsink, "drop cc %" GST_PTR_FORMAT, obj);
+        gst_mini_object_unref(obj);
         return;
-    if (vp9)
+    }
+    g_queue_push_tail(&priv->cc_queue, obj);
+    g_cond_signal(&priv->cc_cond);
+    g_mutex_unlock(&priv->cc_lock);
+}
+
+/*
+ * The user data event has no pts of its own: the buffer is stamped with
+ * the decoder position at dispatch, before it waits in the queue.
+ */
+static void cc_push(GstAmltspvsink *amltspvsink, const guint8 *cc_data, guint32 size)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    GstBuffer *buffer = NULL;
+
+    if (!gst_pad_is_linked(priv->cc_pad))
     {
-        if (!frame_cnt)
-            fwrite(ivf_header, 1, 32, fd);
-        frame_header[0] = size & 0xff;
-        frame_header[1] = (size >> 8) & 0xff;
-        frame_header[2] = (size >> 16) & 0xff;
-        frame_header[3] = (size >> 24) & 0xff;
-        fwrite(frame_header, 1, 12, fd);
+        return;
     }
-    fwrite(data, 1, size, fd);
-    fclose(fd);
+
+    buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    gst_buffer_fill(buffer, 0, cc_data, size);
+    GST_BUFFER_PTS(buffer) = userdata_running_time(amltspvsink);
+    cc_queue_push(amltspvsink, GST_MINI_OBJECT_CAST(buffer));
 }
-#endif
 
-/* wait video eos thread */
-static gpointer video_eos_thread(gpointer data)
+/*
+ * cc pad task, runs with the cc pad stream lock held, so its pushes are
+ * serialized with the flush and state changes of the cc pad.
+ */
+static void cc_loop(gpointer data)
 {
     GstAmltspvsink *amltspvsink = (GstAmltspvsink *)data;
     GstAmltspvsinkPrivate *priv = amltspvsink->priv;
-    uint32_t count = 30;    /* 3s timeout */
-    uint64_t last_vpts = 0; /* used to save the last vpts obtained */
-
-    prctl(PR_SET_NAME, "amltspvsink_eos_t");
-    GST_INFO("enter");
+    GstMiniObject *obj = NULL;
+    GstFlowReturn ret = GST_FLOW_OK;
 
-    while (!priv->quit_eos_wait)
+    g_mutex_lock(&priv->cc_lock);
+    while (!priv->cc_flushing && g_queue_is_empty(&priv->cc_queue))
     {
-        uint64_t curr_vpts = 0;
+        g_cond_wait(&priv->cc_cond, &priv->cc_lock);
+    }
+    if (priv->cc_flushing)
+    {
+        g_mutex_unlock(&priv->cc_lock);
+        gst_pad_pause_task(priv->cc_pad);
+        return;
+    }
+    obj = (GstMiniObject *)g_queue_pop_head(&priv->cc_queue);
+    g_mutex_unlock(&priv->cc_lock);
 
-        /*
-         * EOS judgment basis:
-         * 1.When priv->final_vpts is less than or equal to curr_vpts;
-         * 2.When curr_vpts equals last_vpts, curr_vpts will not change;
-         */
-        video_get_pts(&curr_vpts);
-        GST_INFO("final_vpts:%llu, curr_vpts:%llu", priv->final_vpts, curr_vpts);
-        if (priv->final_vpts <= curr_vpts || curr_vpts == last_vpts)
+    if (GST_IS_EVENT(obj))
+    {
+        /* EOS, only after the stream started */
+        if (g_atomic_int_get(&priv->cc_need_events))
         {
-            priv->eos = TRUE;
+            gst_mini_object_unref(obj);
         }
-        last_vpts = curr_vpts;
-
-        /* priv->eos=TRUE or timeout */
-        if (priv->eos || !count)
+        else
         {
-            GstMessage *message;
-
-            if (!count)
-            {
-                GST_WARNING_OBJECT(amltspvsink, "EOS timeout");
-            }
-            /* Posting EOS */
-            GST_WARNING_OBJECT(amltspvsink, "Posting EOS");
-            message = gst_message_new_eos(GST_OBJECT_CAST(amltspvsink));
-            gst_message_set_seqnum(message, priv->seqnum);
-            gst_element_post_message(GST_ELEMENT_CAST(amltspvsink), message);
-            break;
+            gst_pad_push_event(priv->cc_pad, GST_EVENT_CAST(obj));
         }
+        return;
+    }
 
-        g_usleep(100000);
-        count--;
+    if (g_atomic_int_compare_and_exchange(&priv->cc_need_events, TRUE, FALSE))
+    {
+        gchar *stream_id = gst_pad_create_stream_id(priv->cc_pad, GST_ELEMENT(amltspvsink), "cc");
+        GstCaps *caps = gst_caps_from_string(CC_CAPS);
+        GstSegment segment;
+
+        /* buffers carry running time */
+        gst_segment_init(&segment, GST_FORMAT_TIME);
+        gst_pad_push_event(priv->cc_pad, gst_event_new_stream_start(stream_id));
+        gst_pad_push_event(priv->cc_pad, gst_event_new_caps(caps));
+        gst_pad_push_event(priv->cc_pad, gst_event_new_segment(&segment));
+        gst_caps_unref(caps);
+        g_free(stream_id);
     }
 
-    GST_INFO("quit");
-    return NULL;
+    ret = gst_pad_push(priv->cc_pad, GST_BUFFER_CAST(obj));
+    if (GST_FLOW_OK != ret)
+    {
+        GST_DEBUG_OBJECT(amltspvsink, "push cc: %s", gst_flow_get_name(ret));
+    }
 }
 
-/* start wait video eos thread */
-static int start_eos_thread(GstAmltspvsink *amltspvsink)
+/* wake the cc task and wait until it is paused, or stopped */
+static void cc_task_halt(GstAmltspvsink *amltspvsink, gboolean stop)
 {
     GstAmltspvsinkPrivate *priv = amltspvsink->priv;
 
-    priv->eos_wait_thread = g_thread_new("video eos thread", video_eos_thread, amltspvsink);
-    if (!priv->eos_wait_thread)
+    g_mutex_lock(&priv->cc_lock);
+    priv->cc_flushing = TRUE;
+    cc_queue_clear(priv);
+    g_cond_signal(&priv->cc_cond);
+    g_mutex_unlock(&priv->cc_lock);
+    if (stop)
     {
-        GST_ERROR_OBJECT(amltspvsink, "fail to create thread");
-        return -1;
+        gst_pad_stop_task(priv->cc_pad);
+    }
+    else
+    {
+        gst_pad_pause_task(priv->cc_pad);
     }
-    return 0;
 }
 
-/* start wait video eos thread */
-static int stop_eos_thread(GstAmltspvsink *amltspvsink)
+static void cc_task_start(GstAmltspvsink *amltspvsink)
 {
     GstAmltspvsinkPrivate *priv = amltspvsink->priv;
 
-    GST_OBJECT_LOCK(amltspvsink);
-    priv->quit_eos_wait = TRUE;
-    if (priv->eos_wait_thread)
-    {
-        GST_OBJECT_UNLOCK(amltspvsink);
-        g_thread_join(priv->eos_wait_thread);
-        priv->eos_wait_thread = NULL;
+    g_mutex_lock(&priv->cc_lock);
+    priv->cc_flushing = FALSE;
+    g_mutex_unlock(&priv->cc_lock);
+    gst_pad_start_task(priv->cc_pad, cc_loop, amltspvsink, NULL);
+}
+
+static void afd_post(GstAmltspvsink *amltspvsink, gint afd)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    GstStructure *structure = NULL;
+
+    if (afd == priv->afd)
+    {
+        return;
+    }
+    priv->afd = afd;
+
+    GST_INFO_OBJECT(amltspvsink, "afd %d", afd);
+    structure = gst_structure_new("amltspvsink-afd",
+                                  "afd", G_TYPE_UINT, (guint)afd,
+                                  "running-time", G_TYPE_UINT64, (guint64)userdata_running_time(amltspvsink),
+                                  NULL);
+    gst_element_post_message(GST_ELEMENT(amltspvsink), gst_message_new_element(GST_OBJECT(amltspvsink), structure));
+}
+
+static void event_dispatch(GstAmltspvsink *amltspvsink, DecoderEvent *event)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    GST_INFO_OBJECT(amltspvsink, "video_callback type %d\n", event->type);
+    switch (event->type)
+    {
+    case AM_TSPLAYER_EVENT_TYPE_VIDEO_CHANGED:
+    {
+        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_VIDEO_CHANGED: %d x %d @%d [%d]\n",
+                        event->u.video_format.frame_width,
+                        event->u.video_format.frame_height,
+                        event->u.video_format.frame_rate,
+                        event->u.video_format.frame_aspectratio);
+        break;
+    }
+    case AM_TSPLAYER_EVENT_TYPE_USERDATA_AFD:
+    case AM_TSPLAYER_EVENT_TYPE_USERDATA_CC:
+    {
+        guint8 *pbuf = event->u.user_data.data;
+        guint32 size = event->u.user_data.len;
+        const guint8 *cc_data = NULL;
+        guint32 cc_size = 0;
+        gint afd = -1;
+
+        GST_DEBUG_OBJECT(amltspvsink, "[evt] USERDATA [%d], size %d\n", event->type, size);
+        cc_size = userdata_cc(pbuf, size, &cc_data);
+        if (cc_size)
+        {
+            cc_push(amltspvsink, cc_data, cc_size);
+        }
+        afd = userdata_afd(pbuf, size);
+        if (afd >= 0)
+        {
+            afd_post(amltspvsink, afd);
+        }
+        break;
+    }
+    case AM_TSPLAYER_EVENT_TYPE_FIRST_FRAME:
+    {
+        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_FIRST_FRAME\n");
+        g_mutex_lock(&priv->level_lock);
+        priv->first_frame = TRUE;
+        g_cond_broadcast(&priv->level_cond);
+        g_mutex_unlock(&priv->level_lock);
+        g_signal_emit(G_OBJECT(amltspvsink), g_signals[SIGNAL_FIRSTFRAME], 0, 2, NULL);
+        keeposd(priv->keeposd);
+        break;
+    }
+    case AM_TSPLAYER_EVENT_TYPE_DECODE_FIRST_FRAME_VIDEO:
+    {
+        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_DECODE_FIRST_FRAME_VIDEO\n");
+        break;
+    }
+    case AM_TSPLAYER_EVENT_TYPE_DECODE_FIRST_FRAME_AUDIO:
+    {
+        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_DECODE_FIRST_FRAME_AUDIO\n");
+        break;
+    }
+    case AM_TSPLAYER_EVENT_TYPE_AV_SYNC_DONE:
+    {
+        GST_INFO_OBJECT(amltspvsink, "[evt] AM_TSPLAYER_EVENT_TYPE_AV_SYNC_DONE\n");
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static gpointer video_event_thread(gpointer data)
+{
+    GstAmltspvsink *amltspvsink = (GstAmltspvsink *)data;
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    prctl(PR_SET_NAME, "amltspvsink_evt_t");
+    GST_INFO("enter");
+
+    while (!g_atomic_int_get(&priv->quit_event))
+    {
+        guint64 count = 0;
+        gint tail = g_atomic_int_get(&priv->event_tail);
+        guint dropped = 0;
+
+        if (tail == g_atomic_int_get(&priv->event_head))
+        {
+            /* the counter is reset by the read, wakes are never lost */
+            if (read(priv->event_fd, &count, sizeof(count)) < 0 && EINTR != errno)
+            {
+                GST_ERROR_OBJECT(amltspvsink, "wait event failed: %d", errno);
+                break;
+            }
+            continue;
+        }
+
+        event_dispatch(amltspvsink, &priv->events[tail & (EVENT_RING_SIZE - 1)]);
+        g_atomic_int_set(&priv->event_tail, tail + 1);
+
+        dropped = g_atomic_int_and(&priv->events_dropped, 0);
+        if (dropped)
+        {
+            GST_WARNING_OBJECT(amltspvsink, "event ring full, %u events dropped", dropped);
+        }
+    }
+
+    GST_INFO("quit");
+    return NULL;
+}
+
+static int start_event_thread(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    g_atomic_int_set(&priv->event_head, 0);
+    g_atomic_int_set(&priv->event_tail, 0);
+    g_atomic_int_set(&priv->events_dropped, 0);
+    g_atomic_int_set(&priv->quit_event, FALSE);
+    priv->afd = -1;
+
+    priv->event_fd = eventfd(0, EFD_CLOEXEC);
+    if (priv->event_fd < 0)
+    {
+        GST_ERROR_OBJECT(amltspvsink, "fail to create eventfd: %d", errno);
+        return -1;
+    }
+
+    priv->event_thread = g_thread_new("video event thread", video_event_thread, amltspvsink);
+    if (!priv->event_thread)
+    {
+        GST_ERROR_OBJECT(amltspvsink, "fail to create thread");
+        close(priv->event_fd);
+        priv->event_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Call after video_deinit(), which unregisters video_callback from the
+ * session, so no event is queued any more. The session itself may live
+ * on, shared with the audio sink.
+ */
+static int stop_event_thread(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    guint64 one = 1;
+
+    if (!priv->event_thread)
+    {
+        return 0;
+    }
+
+    g_atomic_int_set(&priv->quit_event, TRUE);
+    if (write(priv->event_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        GST_WARNING_OBJECT(amltspvsink, "wake event thread failed");
+    }
+    g_thread_join(priv->event_thread);
+    priv->event_thread = NULL;
+    close(priv->event_fd);
+    priv->event_fd = -1;
+    return 0;
+}
+
+#ifdef DUMP_TO_FILE
+static uint8_t ivf_header[32] = {
+    'D', 'K', 'I', 'F',
+    0x00, 0x00, 0x20, 0x00,
+    'V', 'P', '9', '0',
+    0x80, 0x07, 0x38, 0x04, /* 1920 x 1080 */
+    0x30, 0x76, 0x00, 0x00, /* frame rate */
+    0xe8, 0x03, 0x00, 0x00, /* time scale */
+    0x00, 0x00, 0xff, 0xff, /* # of frames */
+    0x00, 0x00, 0x00, 0x00  /* unused */
+};
+
+static void dump(const char *path, const uint8_t *data, int size, gboolean vp9, int frame_cnt)
+{
+    char name[50];
+    uint8_t frame_header[12] = {0};
+    FILE *fd;
+
+    if (!data)
+        return;
+
+    sprintf(name, "%s%d.dat", path, 0);
+    fd = fopen(name, "ab");
+
+    if (!fd)
+        return;
+    if (vp9)
+    {
+        if (!frame_cnt)
+            fwrite(ivf_header, 1, 32, fd);
+        frame_header[0] = size & 0xff;
+        frame_header[1] = (size >> 8) & 0xff;
+        frame_header[2] = (size >> 16) & 0xff;
+        frame_header[3] = (size >> 24) & 0xff;
+        fwrite(frame_header, 1, 12, fd);
+    }
+    fwrite(data, 1, size, fd);
+    fclose(fd);
+}
+#endif
+
+/* wait video eos thread */
+static gpointer video_eos_thread(gpointer data)
+{
+    GstAmltspvsink *amltspvsink = (GstAmltspvsink *)data;
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    uint32_t count = 30;    /* 3s timeout */
+    uint64_t last_vpts = 0; /* used to save the last vpts obtained */
+
+    prctl(PR_SET_NAME, "amltspvsink_eos_t");
+    GST_INFO("enter");
+
+    while (!priv->quit_eos_wait)
+    {
+        uint64_t curr_vpts = 0;
+
+        /*
+         * EOS judgment basis:
+         * 1.When priv->final_vpts is less than or equal to curr_vpts;
+         * 2.When curr_vpts equals last_vpts, curr_vpts will not change;
+         */
+        video_get_pts(&curr_vpts);
+        GST_INFO("final_vpts:%llu, curr_vpts:%llu", priv->final_vpts, curr_vpts);
+        if (priv->final_vpts <= curr_vpts || curr_vpts == last_vpts)
+        {
+            priv->eos = TRUE;
+        }
+        last_vpts = curr_vpts;
+
+        /* priv->eos=TRUE or timeout */
+        if (priv->eos || !count)
+        {
+            GstMessage *message;
+
+            if (!count)
+            {
+                GST_WARNING_OBJECT(amltspvsink, "EOS timeout");
+            }
+            /* Posting EOS */
+            GST_WARNING_OBJECT(amltspvsink, "Posting EOS");
+            message = gst_message_new_eos(GST_OBJECT_CAST(amltspvsink));
+            gst_message_set_seqnum(message, priv->seqnum);
+            gst_element_post_message(GST_ELEMENT_CAST(amltspvsink), message);
+            break;
+        }
+
+        g_usleep(100000);
+        count--;
+    }
+
+    GST_INFO("quit");
+    return NULL;
+}
+
+/* start wait video eos thread */
+static int start_eos_thread(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    priv->eos_wait_thread = g_thread_new("video eos thread", video_eos_thread, amltspvsink);
+    if (!priv->eos_wait_thread)
+    {
+        GST_ERROR_OBJECT(amltspvsink, "fail to create thread");
+        return -1;
+    }
+    return 0;
+}
+
+/* start wait video eos thread */
+static int stop_eos_thread(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    GST_OBJECT_LOCK(amltspvsink);
+    priv->quit_eos_wait = TRUE;
+    if (priv->eos_wait_thread)
+    {
+        GST_OBJECT_UNLOCK(amltspvsink);
+        g_thread_join(priv->eos_wait_thread);
+        priv->eos_wait_thread = NULL;
+        return 0;
+    }
+    GST_OBJECT_UNLOCK(amltspvsink);
+    return 0;
+}
+
+static void post_buffer_level(GstAmltspvsink *amltspvsink, gint level,
+                              gint low, gint high, gint state)
+{
+    GstStructure *structure;
+
+    structure = gst_structure_new("buffer-level",
+                                  "level", G_TYPE_INT, level,
+                                  "low-watermark", G_TYPE_INT, low,
+                                  "high-watermark", G_TYPE_INT, high,
+                                  "state", G_TYPE_STRING, buffer_level_state_name(state),
+                                  NULL);
+    gst_element_post_message(GST_ELEMENT_CAST(amltspvsink),
+                             gst_message_new_element(GST_OBJECT_CAST(amltspvsink), structure));
+}
+
+/* sample decoder buffer level and latency, wake up the paced render */
+static gpointer video_monitor_thread(gpointer data)
+{
+    GstAmltspvsink *amltspvsink = (GstAmltspvsink *)data;
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    prctl(PR_SET_NAME, "amltspvsink_mon_t");
+    GST_INFO("enter");
+
+    g_mutex_lock(&priv->level_lock);
+    while (!priv->quit_monitor)
+    {
+        gint32 level = -1;
+        gint32 buffered_ms = -1;
+        uint64_t vpts = 0;
+        gint low, high, state;
+        gboolean changed;
+
+        g_mutex_unlock(&priv->level_lock);
+        if (ERROR_CODE_OK != video_get_buffer_level(&level))
+        {
+            level = -1;
+        }
+        if (ERROR_CODE_OK != video_get_buffered_ms(&buffered_ms))
+        {
+            buffered_ms = -1;
+        }
+        if (ERROR_CODE_OK != video_get_pts(&vpts))
+        {
+            vpts = 0;
+        }
+        g_mutex_lock(&priv->level_lock);
+        priv->display_pts = vpts;
+
+        low = priv->low_watermark;
+        high = priv->high_watermark;
+        state = buffer_level_state(level, low, high);
+        changed = (state != priv->level_state);
+        priv->buffer_level = level;
+        priv->level_state = state;
+        g_cond_broadcast(&priv->level_cond);
+
+        if (changed && LEVEL_STATE_UNKNOWN != state)
+        {
+            GST_DEBUG_OBJECT(amltspvsink, "buffer level %d%%, %s", level, buffer_level_state_name(state));
+            g_mutex_unlock(&priv->level_lock);
+            post_buffer_level(amltspvsink, level, low, high, state);
+            g_mutex_lock(&priv->level_lock);
+        }
+
+        if (!priv->first_frame)
+        {
+            /* the delay up to the first frame is startup, not latency */
+            latency_window_reset(&priv->latency, g_get_monotonic_time());
+        }
+        else if (latency_window_sample(&priv->latency, g_get_monotonic_time(), buffered_ms))
+        {
+            GST_INFO_OBJECT(amltspvsink, "latency %d-%d ms", priv->latency.min_ms, priv->latency.max_ms);
+            g_mutex_unlock(&priv->level_lock);
+            gst_element_post_message(GST_ELEMENT(amltspvsink), gst_message_new_latency(GST_OBJECT(amltspvsink)));
+            g_mutex_lock(&priv->level_lock);
+        }
+
+        g_cond_wait_until(&priv->level_cond, &priv->level_lock,
+                          g_get_monotonic_time() + BUFFER_MONITOR_INTERVAL_US);
+    }
+    priv->buffer_level = -1;
+    priv->level_state = LEVEL_STATE_UNKNOWN;
+    priv->display_pts = 0;
+    g_cond_broadcast(&priv->level_cond);
+    g_mutex_unlock(&priv->level_lock);
+
+    GST_INFO("quit");
+    return NULL;
+}
+
+static int start_monitor_thread(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    g_mutex_lock(&priv->level_lock);
+    priv->quit_monitor = FALSE;
+    latency_window_reset(&priv->latency, g_get_monotonic_time());
+    g_mutex_unlock(&priv->level_lock);
+
+    priv->monitor_thread = g_thread_new("video monitor thread", video_monitor_thread, amltspvsink);
+    if (!priv->monitor_thread)
+    {
+        GST_ERROR_OBJECT(amltspvsink, "fail to create thread");
+        return -1;
+    }
+    return 0;
+}
+
+static int stop_monitor_thread(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    g_mutex_lock(&priv->level_lock);
+    priv->quit_monitor = TRUE;
+    g_cond_broadcast(&priv->level_cond);
+    g_mutex_unlock(&priv->level_lock);
+
+    if (priv->monitor_thread)
+    {
+        g_thread_join(priv->monitor_thread);
+        priv->monitor_thread = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Queue a geometry change. Requests are coalesced to the latest values
+ * and applied by the geometry thread at most once per display refresh,
+ * so an animated window costs one driver call per frame at most.
+ */
+static void geometry_request(GstAmltspvsink *amltspvsink, guint parts, const Geometry *geometry)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    g_mutex_lock(&priv->geometry_lock);
+    if (parts & GEOMETRY_WINDOW)
+    {
+        priv->geometry.x = geometry->x;
+        priv->geometry.y = geometry->y;
+        priv->geometry.w = geometry->w;
+        priv->geometry.h = geometry->h;
+    }
+    if (parts & GEOMETRY_ANGLE)
+    {
+        priv->geometry.angle = geometry->angle;
+    }
+    if (parts & GEOMETRY_CROP)
+    {
+        priv->geometry.crop_top = geometry->crop_top;
+        priv->geometry.crop_left = geometry->crop_left;
+        priv->geometry.crop_bottom = geometry->crop_bottom;
+        priv->geometry.crop_right = geometry->crop_right;
+    }
+    priv->geometry_pending |= parts;
+    g_cond_broadcast(&priv->geometry_cond);
+    g_mutex_unlock(&priv->geometry_lock);
+}
+
+static void geometry_apply(GstAmltspvsink *amltspvsink, guint parts, const Geometry *geometry)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    g_mutex_lock(&priv->control_lock);
+    if (parts & GEOMETRY_WINDOW)
+    {
+        priv->disp_x = geometry->x;
+        priv->disp_y = geometry->y;
+        priv->disp_w = geometry->w;
+        priv->disp_h = geometry->h;
+        priv->setwindow = TRUE;
+        video_set_region(priv->disp_x, priv->disp_y, priv->disp_w, priv->disp_h);
+    }
+    if (parts & GEOMETRY_ANGLE)
+    {
+        priv->angle = geometry->angle;
+        if (ERROR_CODE_OK != video_set_angle(priv->angle))
+        {
+            priv->setangle = TRUE;
+        }
+    }
+    if (parts & GEOMETRY_CROP)
+    {
+        if (ERROR_CODE_OK == video_set_crop(geometry->crop_top, geometry->crop_left,
+                                            geometry->crop_bottom, geometry->crop_right))
+        {
+            priv->cropped = (geometry->crop_top || geometry->crop_left ||
+                             geometry->crop_bottom || geometry->crop_right);
+        }
+    }
+    g_mutex_unlock(&priv->control_lock);
+}
+
+static gpointer video_geometry_thread(gpointer data)
+{
+    GstAmltspvsink *amltspvsink = (GstAmltspvsink *)data;
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    prctl(PR_SET_NAME, "amltspvsink_geo_t");
+    GST_INFO("enter");
+
+    g_mutex_lock(&priv->geometry_lock);
+    while (!priv->quit_geometry)
+    {
+        Geometry geometry;
+        guint parts = 0;
+        gint64 now = 0;
+
+        if (0 == priv->geometry_pending)
+        {
+            g_cond_wait(&priv->geometry_cond, &priv->geometry_lock);
+            continue;
+        }
+        now = g_get_monotonic_time();
+        if (now < priv->geometry_next_us)
+        {
+            /* later requests in this refresh replace the pending ones */
+            g_cond_wait_until(&priv->geometry_cond, &priv->geometry_lock, priv->geometry_next_us);
+            continue;
+        }
+        parts = priv->geometry_pending;
+        geometry = priv->geometry;
+        priv->geometry_pending = 0;
+        priv->geometry_next_us = now + priv->geometry_interval_us;
+        g_mutex_unlock(&priv->geometry_lock);
+
+        GST_DEBUG_OBJECT(amltspvsink, "apply geometry 0x%x, window (%d,%d,%d,%d), angle %d",
+                         parts, geometry.x, geometry.y, geometry.w, geometry.h, geometry.angle);
+        geometry_apply(amltspvsink, parts, &geometry);
+
+        g_mutex_lock(&priv->geometry_lock);
+    }
+    g_mutex_unlock(&priv->geometry_lock);
+
+    GST_INFO("quit");
+    return NULL;
+}
+
+static int start_geometry_thread(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    int refresh = get_display_refresh();
+
+    if (refresh <= 0)
+    {
+        refresh = GEOMETRY_DEFAULT_REFRESH;
+    }
+
+    g_mutex_lock(&priv->geometry_lock);
+    priv->quit_geometry = FALSE;
+    priv->geometry_interval_us = G_USEC_PER_SEC / refresh;
+    priv->geometry_next_us = 0;
+    g_mutex_unlock(&priv->geometry_lock);
+    GST_INFO_OBJECT(amltspvsink, "display refresh %d Hz", refresh);
+
+    priv->geometry_thread = g_thread_new("video geometry thread", video_geometry_thread, amltspvsink);
+    if (!priv->geometry_thread)
+    {
+        GST_ERROR_OBJECT(amltspvsink, "fail to create thread");
+        return -1;
+    }
+    return 0;
+}
+
+static int stop_geometry_thread(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    g_mutex_lock(&priv->geometry_lock);
+    priv->quit_geometry = TRUE;
+    g_cond_broadcast(&priv->geometry_cond);
+    g_mutex_unlock(&priv->geometry_lock);
+
+    if (priv->geometry_thread)
+    {
+        g_thread_join(priv->geometry_thread);
+        priv->geometry_thread = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Hold the stream thread once the decoder buffer reaches the high
+ * watermark, until it is back under the low one, so writes no longer
+ * spin in the adaptor. Returns FALSE when interrupted by a flush.
+ */
+static gboolean wait_for_buffer_space(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    gboolean pacing = FALSE;
+    gboolean ret;
+
+    g_mutex_lock(&priv->level_lock);
+    while (!priv->flushing && !priv->quit_monitor &&
+           buffer_level_pacing(priv->buffer_level, priv->low_watermark,
+                               priv->high_watermark, pacing))
+    {
+        if (!pacing)
+        {
+            GST_LOG_OBJECT(amltspvsink, "buffer level %d%%, pacing", priv->buffer_level);
+            pacing = TRUE;
+        }
+        g_cond_wait_until(&priv->level_cond, &priv->level_lock,
+                          g_get_monotonic_time() + BUFFER_PACING_WAIT_US);
+    }
+    ret = !priv->flushing;
+    g_mutex_unlock(&priv->level_lock);
+
+    return ret;
+}
+
+/*
+ * A render-angle change moves ppmgr in or out of the vfm path, which
+ * needs a decoder restart, done ahead of a key frame. The restart drops
+ * all the decoder still queues, so first let the buffer drain to the low
+ * watermark, for at most PATH_SWITCH_DRAIN_TIMEOUT_US: while paused it
+ * does not drain and the queued frames are lost. Returns FALSE when
+ * interrupted by a flush.
+ */
+static gboolean vfm_path_switch(GstAmltspvsink *amltspvsink, guint64 pts)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    gint64 end_time = g_get_monotonic_time() + PATH_SWITCH_DRAIN_TIMEOUT_US;
+    gint level;
+    gboolean flushing;
+
+    g_mutex_lock(&priv->level_lock);
+    while (!priv->flushing && !priv->quit_monitor && priv->buffer_level > priv->low_watermark)
+    {
+        if (!g_cond_wait_until(&priv->level_cond, &priv->level_lock, end_time))
+        {
+            break;
+        }
+    }
+    level = priv->buffer_level;
+    flushing = priv->flushing;
+    g_mutex_unlock(&priv->level_lock);
+    if (flushing)
+    {
+        return FALSE;
+    }
+
+    GST_INFO_OBJECT(amltspvsink, "switch vfm path on key frame, buffer level %d%%, vpts:%llu", level, pts);
+    if (ERROR_CODE_OK == video_switch_path())
+    {
+        priv->extradata_injected = FALSE;
+        priv->drop_to_key = FALSE;
+    }
+    return TRUE;
+}
+
+/* h264/265 extradata parser, like vps/sps/pps */
+static int h264_extradata_parser(const unsigned char *in_buf, int in_size, ExtraData *extra_data)
+{
+    GstH264ParserResult res = GST_H264_PARSER_OK;
+    GstH264NalParser *h264parser = gst_h264_nal_parser_new();
+    unsigned int offset = 0;
+
+    do
+    {
+        GstH264NalUnit nal = {0};
+        res = gst_h264_parser_identify_nalu(h264parser,
+                                            in_buf,
+                                            offset,
+                                            in_size,
+                                            &nal);
+        offset = nal.offset + nal.size;
+        GST_DEBUG("nal info, type:%d, size:%d, offset:%d, sc_offset:%d; res:%d!",
+                  nal.type, nal.size, nal.offset, nal.sc_offset, res);
+
+        if ((GST_H264_PARSER_OK != res) && (GST_H264_PARSER_NO_NAL_END != res))
+        {
+            GST_ERROR("h264 nal parse error!");
+            goto error;
+        }
+
+        switch (nal.type)
+        {
+        case (GST_H264_NAL_SPS):
+        {
+            if (NULL == extra_data->sps)
+            {
+                extra_data->sps_size = nal.size + nal.offset - nal.sc_offset;
+                extra_data->sps = malloc(extra_data->sps_size);
+                if (NULL == extra_data->sps)
+                    goto error;
+                memcpy(extra_data->sps, nal.data + nal.sc_offset, extra_data->sps_size);
+            }
+            break;
+        }
+        case (GST_H264_NAL_PPS):
+        {
+            if (NULL == extra_data->pps)
+            {
+                extra_data->pps_size = nal.size + nal.offset - nal.sc_offset;
+                extra_data->pps = malloc(extra_data->pps_size);
+                if (NULL == extra_data->pps)
+                    goto error;
+                memcpy(extra_data->pps, nal.data + nal.sc_offset, extra_data->pps_size);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    } while (GST_H264_PARSER_NO_NAL_END != res);
+
+    if ((NULL == extra_data->sps) || (NULL == extra_data->pps))
+        goto error;
+
+    GST_DEBUG("h264 extradata parse finish!");
+    gst_h264_nal_parser_free(h264parser);
+    return 0;
+
+error:
+    GST_ERROR("h264 extradata parse error!");
+    gst_h264_nal_parser_free(h264parser);
+    SAVE_FREE(extra_data->sps);
+    SAVE_FREE(extra_data->pps);
+    return -1;
+}
+
+static int h265_extradata_parser(const unsigned char *in_buf, int in_size, ExtraData *extra_data)
+{
+    GstH265ParserResult res = GST_H265_PARSER_OK;
+    GstH265Parser *h265parser = gst_h265_parser_new();
+    unsigned int offset = 0;
+
+    do
+    {
+        GstH265NalUnit nal = {0};
+        res = gst_h265_parser_identify_nalu(h265parser,
+                                            in_buf,
+                                            offset,
+                                            in_size,
+                                            &nal);
+        offset = nal.offset + nal.size;
+        GST_DEBUG("nal info, type:%d, size:%d, offset:%d, sc_offset:%d; res:%d!",
+                  nal.type, nal.size, nal.offset, nal.sc_offset, res);
+
+        if ((GST_H265_PARSER_OK != res) && (GST_H265_PARSER_NO_NAL_END != res))
+        {
+            GST_ERROR("h265 nal parse error!");
+            goto error;
+        }
+
+        switch (nal.type)
+        {
+        case (GST_H265_NAL_VPS):
+        {
+            if (NULL == extra_data->vps)
+            {
+                extra_data->vps_size = nal.size + nal.offset - nal.sc_offset;
+                extra_data->vps = malloc(extra_data->vps_size);
+                if (NULL == extra_data->vps)
+                    goto error;
+                memcpy(extra_data->vps, nal.data + nal.sc_offset, extra_data->vps_size);
+            }
+            break;
+        }
+        case (GST_H265_NAL_SPS):
+        {
+            if (NULL == extra_data->sps)
+            {
+                extra_data->sps_size = nal.size + nal.offset - nal.sc_offset;
+                extra_data->sps = malloc(extra_data->sps_size);
+                if (NULL == extra_data->sps)
+                    goto error;
+                memcpy(extra_data->sps, nal.data + nal.sc_offset, extra_data->sps_size);
+            }
+            break;
+        }
+        case (GST_H265_NAL_PPS):
+        {
+            if (NULL == extra_data->pps)
+            {
+                extra_data->pps_size = nal.size + nal.offset - nal.sc_offset;
+                extra_data->pps = malloc(extra_data->pps_size);
+                if (NULL == extra_data->pps)
+                    goto error;
+                memcpy(extra_data->pps, nal.data + nal.sc_offset, extra_data->pps_size);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    } while (GST_H265_PARSER_NO_NAL_END != res);
+
+    if ((NULL == extra_data->vps) || (NULL == extra_data->sps) || (NULL == extra_data->pps))
+        goto error;
+
+    GST_DEBUG("h265 extradata parse finish!");
+    gst_h265_parser_free(h265parser);
+    return 0;
+
+error:
+    GST_ERROR("h265 extradata parse error!");
+    gst_h265_parser_free(h265parser);
+    SAVE_FREE(extra_data->vps);
+    SAVE_FREE(extra_data->sps);
+    SAVE_FREE(extra_data->pps);
+    return -1;
+}
+
+static int extradata_get(eExtraDataType type, const unsigned char *in_buf, int in_size, ExtraData *extra_data)
+{
+    int ret = 0;
+    ExtraData tmp_extra_data = {0};
+
+    if ((ED_TYPE_INVALID == type) || (NULL == in_buf) || (0 >= in_size) || (NULL == extra_data))
+    {
+        return -1;
+    }
+
+    if (ED_TYPE_H264 == type)
+    {
+        ret = h264_extradata_parser(in_buf, in_size, &tmp_extra_data);
+    }
+    else
+    {
+        ret = h265_extradata_parser(in_buf, in_size, &tmp_extra_data);
+    }
+
+    if (0 == ret)
+    {
+        SAVE_FREE(extra_data->vps);
+        SAVE_FREE(extra_data->sps);
+        SAVE_FREE(extra_data->pps);
+        memcpy(extra_data, &tmp_extra_data, sizeof(ExtraData));
+    }
+
+    return ret;
+}
+
+static void extradata_release(ExtraData *extra_data)
+{
+    if (NULL == extra_data)
+    {
+        return;
+    }
+
+    SAVE_FREE(extra_data->vps);
+    SAVE_FREE(extra_data->sps);
+    SAVE_FREE(extra_data->pps);
+
+    return;
+}
+
+/* append one parameter set of codec_data with a start code, NULL dst skips it */
+static int param_set_append(char **dst, int *dst_size, const guint8 *data, gsize size, gsize *offset)
+{
+    guint16 len = 0;
+    char *buf = NULL;
+
+    if (*offset + 2 > size)
+        return -1;
+    len = GST_READ_UINT16_BE(data + *offset);
+    *offset += 2;
+    if (*offset + len > size)
+        return -1;
+
+    if (dst)
+    {
+        buf = realloc(*dst, *dst_size + 4 + len);
+        if (NULL == buf)
+            return -1;
+        GST_WRITE_UINT32_BE(buf + *dst_size, 1);
+        memcpy(buf + *dst_size + 4, data + *offset, len);
+        *dst = buf;
+        *dst_size += 4 + len;
+    }
+    *offset += len;
+    return 0;
+}
+
+/* AVCDecoderConfigurationRecord, ISO/IEC 14496-15 5.3.3.1 */
+static int avcc_parser(const guint8 *data, gsize size, ExtraData *extra_data, gint *nal_length_size)
+{
+    gsize offset = 6;
+    guint num = 0;
+    guint i = 0;
+
+    if (size < 7 || 1 != data[0])
+        return -1;
+
+    *nal_length_size = (data[4] & 0x03) + 1;
+    num = data[5] & 0x1f;
+    for (i = 0; i < num; i++)
+    {
+        if (param_set_append(&extra_data->sps, &extra_data->sps_size, data, size, &offset))
+            return -1;
+    }
+
+    if (offset >= size)
+        return -1;
+    num = data[offset++];
+    for (i = 0; i < num; i++)
+    {
+        if (param_set_append(&extra_data->pps, &extra_data->pps_size, data, size, &offset))
+            return -1;
+    }
+    return 0;
+}
+
+/* HEVCDecoderConfigurationRecord, ISO/IEC 14496-15 8.3.3.1 */
+static int hvcc_parser(const guint8 *data, gsize size, ExtraData *extra_data, gint *nal_length_size)
+{
+    gsize offset = 23;
+    guint arrays = 0;
+    guint i = 0;
+    guint j = 0;
+
+    if (size < 23)
+        return -1;
+
+    *nal_length_size = (data[21] & 0x03) + 1;
+    arrays = data[22];
+    for (i = 0; i < arrays; i++)
+    {
+        guint type = 0;
+        guint num = 0;
+        char **dst = NULL;
+        int *dst_size = NULL;
+
+        if (offset + 3 > size)
+            return -1;
+        type = data[offset] & 0x3f;
+        num = GST_READ_UINT16_BE(data + offset + 1);
+        offset += 3;
+
+        switch (type)
+        {
+        case GST_H265_NAL_VPS:
+            dst = &extra_data->vps;
+            dst_size = &extra_data->vps_size;
+            break;
+        case GST_H265_NAL_SPS:
+            dst = &extra_data->sps;
+            dst_size = &extra_data->sps_size;
+            break;
+        case GST_H265_NAL_PPS:
+            dst = &extra_data->pps;
+            dst_size = &extra_data->pps_size;
+            break;
+        default:
+            break;
+        }
+
+        for (j = 0; j < num; j++)
+        {
+            if (param_set_append(dst, dst_size, data, size, &offset))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * avc/avc3/hvc1/hev1 caps: take the nal length size and the parameter
+ * sets from codec_data, so no parser is needed upstream. avc3/hev1 may
+ * carry them in band only, they are then found by extradata_get() on
+ * the converted aus as for byte-stream.
+ */
+static int stream_format_setup(GstAmltspvsink *amltspvsink, GstStructure *structure, eExtraDataType type)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    const gchar *format = gst_structure_get_string(structure, "stream-format");
+    const GValue *value = NULL;
+    ExtraData extra_data = {0};
+    gint nal_length_size = 0;
+    GstMapInfo map;
+    int ret = 0;
+
+    if (NULL == format || !strcmp(format, "byte-stream"))
+    {
         return 0;
     }
-    GST_OBJECT_UNLOCK(amltspvsink);
-    return 0;
+
+    value = gst_structure_get_value(structure, "codec_data");
+    if (NULL == value || !GST_VALUE_HOLDS_BUFFER(value))
+    {
+        GST_ERROR_OBJECT(amltspvsink, "%s without codec_data!", format);
+        return -1;
+    }
+
+    gst_buffer_map(gst_value_get_buffer(value), &map, GST_MAP_READ);
+    if (ED_TYPE_H264 == type)
+        ret = avcc_parser(map.data, map.size, &extra_data, &nal_length_size);
+    else
+        ret = hvcc_parser(map.data, map.size, &extra_data, &nal_length_size);
+    gst_buffer_unmap(gst_value_get_buffer(value), &map);
+
+    if (0 != ret)
+    {
+        GST_ERROR_OBJECT(amltspvsink, "bad %s codec_data!", format);
+        extradata_release(&extra_data);
+        return -1;
+    }
+    GST_INFO_OBJECT(amltspvsink, "%s, nal length size %d", format, nal_length_size);
+
+    GST_OBJECT_LOCK(amltspvsink);
+    priv->extradata_type = type;
+    priv->nal_length_size = nal_length_size;
+    if (extra_data.sps && extra_data.pps && (ED_TYPE_H264 == type || extra_data.vps))
+    {
+        extradata_release(&priv->extradata);
+        memcpy(&priv->extradata, &extra_data, sizeof(ExtraData));
+        priv->extradata_got = TRUE;
+        priv->extradata_injected = FALSE;
+    }
+    else
+    {
+        extradata_release(&extra_data);
+    }
+    GST_OBJECT_UNLOCK(amltspvsink);
+
+    return 0;
+}
+
+/* buffer and all its memories writable, so a write map modifies no one else's data */
+static gboolean buffer_is_rewritable(GstBuffer *buffer)
+{
+    guint i;
+
+    if (!gst_buffer_is_writable(buffer))
+    {
+        return FALSE;
+    }
+    for (i = 0; i < gst_buffer_n_memory(buffer); i++)
+    {
+        if (!gst_memory_is_writable(gst_buffer_peek_memory(buffer, i)))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Replace the nal length prefixes of an au with start codes. 4 byte
+ * prefixes are rewritten in place when the buffer is writable, other aus
+ * are rebuilt in convert_buf. Returns NULL for a malformed au.
+ */
+static guint8 *nal_to_annexb(GstAmltspvsinkPrivate *priv, guint8 *data, gsize size,
+                             gboolean in_place, gsize *out_size)
+{
+    gint len_size = priv->nal_length_size;
+    gsize offset = 0;
+    gsize out = 0;
+    gsize need = 0;
+    gint i = 0;
+
+    /* validate first, so a bad au is never half rewritten */
+    while (offset + len_size <= size)
+    {
+        guint32 nal_size = 0;
+
+        for (i = 0; i < len_size; i++)
+            nal_size = (nal_size << 8) | data[offset + i];
+        offset += len_size;
+        if (nal_size > size - offset)
+            return NULL;
+        offset += nal_size;
+    }
+    if (offset != size)
+        return NULL;
+
+    if (in_place && 4 == len_size)
+    {
+        for (offset = 0; offset < size;)
+        {
+            guint32 nal_size = GST_READ_UINT32_BE(data + offset);
+
+            GST_WRITE_UINT32_BE(data + offset, 1);
+            offset += 4 + nal_size;
+        }
+        *out_size = size;
+        return data;
+    }
+
+    need = size + (size / len_size) * (4 - len_size);
+    if (priv->convert_size < need)
+    {
+        g_free(priv->convert_buf);
+        priv->convert_buf = g_malloc(need);
+        priv->convert_size = need;
+    }
+
+    for (offset = 0; offset < size;)
+    {
+        guint32 nal_size = 0;
+
+        for (i = 0; i < len_size; i++)
+            nal_size = (nal_size << 8) | data[offset + i];
+        offset += len_size;
+        GST_WRITE_UINT32_BE(priv->convert_buf + out, 1);
+        memcpy(priv->convert_buf + out + 4, data + offset, nal_size);
+        out += 4 + nal_size;
+        offset += nal_size;
+    }
+    *out_size = out;
+    return priv->convert_buf;
+}
+
+/* header of a byte-stream nal: type, slice or not, first slice of a picture */
+static gboolean nal_header_parse(eExtraDataType type, const guint8 *data, gsize size,
+                                 gint *nal_type, gboolean *vcl, gboolean *first_slice)
+{
+    gsize offset = 0;
+
+    /* skip the start code */
+    while (offset + 1 < size && 0 == data[offset])
+        offset++;
+    if (offset < 2 || 1 != data[offset])
+        return FALSE;
+    offset++;
+
+    if (ED_TYPE_H265 == type)
+    {
+        if (offset + 2 >= size)
+            return FALSE;
+        *nal_type = (data[offset] >> 1) & 0x3f;
+        *vcl = (*nal_type < 32);
+        /* first_slice_segment_in_pic_flag */
+        *first_slice = *vcl && (data[offset + 2] & 0x80);
+    }
+    else
+    {
+        if (offset + 1 >= size)
+            return FALSE;
+        *nal_type = data[offset] & 0x1f;
+        *vcl = (*nal_type >= 1 && *nal_type <= 5);
+        /* first_mb_in_slice is ue(v), 0 is coded as a single 1 bit */
+        *first_slice = *vcl && (data[offset + 1] & 0x80);
+    }
+    return TRUE;
+}
+
+/* whether a nal following a slice starts the next au */
+static gboolean nal_starts_au(eExtraDataType type, gint nal_type, gboolean vcl, gboolean first_slice)
+{
+    if (vcl)
+        return first_slice;
+
+    if (ED_TYPE_H265 == type)
+        return (GST_H265_NAL_VPS == nal_type || GST_H265_NAL_SPS == nal_type ||
+                GST_H265_NAL_PPS == nal_type || GST_H265_NAL_AUD == nal_type ||
+                GST_H265_NAL_PREFIX_SEI == nal_type);
+
+    return (GST_H264_NAL_SEI == nal_type || GST_H264_NAL_SPS == nal_type ||
+            GST_H264_NAL_PPS == nal_type || GST_H264_NAL_AU_DELIMITER == nal_type);
+}
+
+/* whether a slice starts a picture decodable on its own, idr or irap */
+static gboolean nal_is_key(eExtraDataType type, gint nal_type)
+{
+    if (ED_TYPE_H265 == type)
+        return (nal_type >= GST_H265_NAL_SLICE_BLA_W_LP && nal_type <= 23); /* up to RSV_IRAP_VCL23 */
+
+    return (GST_H264_NAL_SLICE_IDR == nal_type);
+}
+
+/*
+ * Write the parameter sets from codec_data ahead of a key frame. For
+ * avc/hvc1 streams they are the only ones, so they are never dropped
+ * and only count as injected once all of them are in the decoder.
+ */
+static int extradata_inject(GstAmltspvsinkPrivate *priv, guint64 pts)
+{
+    int ret = ERROR_CODE_OK;
+
+    if (priv->extradata.vps) /* only for h265 */
+        ret = video_write_frame_continued(priv->extradata.vps, priv->extradata.vps_size, pts);
+    if (ERROR_CODE_OK == ret && priv->extradata.sps)
+        ret = video_write_frame_continued(priv->extradata.sps, priv->extradata.sps_size, pts);
+    if (ERROR_CODE_OK == ret && priv->extradata.pps)
+        ret = video_write_frame_continued(priv->extradata.pps, priv->extradata.pps_size, pts);
+    if (ERROR_CODE_OK == ret)
+    {
+        GST_INFO("injected extradata!");
+        priv->extradata_injected = TRUE;
+    }
+    return ret;
+}
+
+static void au_clear(GstAmltspvsinkPrivate *priv)
+{
+    gst_buffer_list_remove(priv->au, 0, gst_buffer_list_length(priv->au));
+    priv->au_has_vcl = FALSE;
+    priv->au_dropped = FALSE;
+    priv->au_written = FALSE;
+}
+
+/*
+ * Write one nal of the au with the au pts. Only the first nal of an au
+ * may be refused by a full decoder in low latency mode, the rest of an
+ * au that is partly in always follows it. Called on the data path, see
+ * the locking notes at GstAmltspvsinkPrivate.
+ */
+static GstFlowReturn au_write_nal(GstAmltspvsink *amltspvsink, GstBuffer *nal)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    GstMapInfo map;
+    int ret;
+
+    gst_buffer_map(nal, &map, (GstMapFlags)GST_MAP_READ);
+    if (priv->au_written)
+        ret = video_write_frame_continued(map.data, (int32_t)map.size, priv->au_pts);
+    else
+        ret = video_write_frame(map.data, (int32_t)map.size, priv->au_pts);
+    gst_buffer_unmap(nal, &map);
+
+    if (ERROR_CODE_RETRY == ret)
+    {
+        /* decoder is full in low latency mode, resync on a key frame */
+        GST_DEBUG_OBJECT(amltspvsink, "decoder full, drop au");
+        priv->drop_to_key = TRUE;
+        priv->au_dropped = TRUE;
+        return GST_FLOW_OK;
+    }
+    if (ERROR_CODE_CANCELLED == ret)
+    {
+        /* unlocked for a flush or state change */
+        GST_DEBUG_OBJECT(amltspvsink, "write cancelled, drop au");
+        priv->au_dropped = TRUE;
+        return GST_FLOW_FLUSHING;
+    }
+    priv->au_written = TRUE;
+    return GST_FLOW_OK;
+}
+
+/* write, or with a dropped au discard, the nals held ahead of the first slice */
+static GstFlowReturn au_write_held(GstAmltspvsink *amltspvsink)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    GstFlowReturn flow = GST_FLOW_OK;
+    guint len = gst_buffer_list_length(priv->au);
+    guint i;
+
+    for (i = 0; i < len && !priv->au_dropped; i++)
+    {
+        flow = au_write_nal(amltspvsink, gst_buffer_list_get(priv->au, i));
+    }
+    gst_buffer_list_remove(priv->au, 0, len);
+    return flow;
+}
+
+/*
+ * The first slice of an au is in: decide once for the whole au whether
+ * it goes to the decoder, low latency and qos look at this slice only,
+ * all slices of a picture are alike. Then write the nals held so far.
+ */
+static GstFlowReturn au_begin(GstAmltspvsink *amltspvsink, GstBuffer *slice, gint nal_type)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    GstMapInfo map;
+    gboolean droppable;
+
+    priv->au_has_vcl = TRUE;
+    if (priv->low_latency &&
+        !low_latency_control(amltspvsink, !nal_is_key(priv->extradata_type, nal_type)))
+    {
+        priv->au_dropped = TRUE;
+        return au_write_held(amltspvsink);
+    }
+
+    gst_buffer_map(slice, &map, (GstMapFlags)GST_MAP_READ);
+    droppable = qos_droppable(priv, map.data, map.size);
+    gst_buffer_unmap(slice, &map);
+    if (droppable)
+    {
+        GST_DEBUG_OBJECT(amltspvsink, "qos, drop non reference au, vpts:%llu", priv->au_pts);
+        priv->qos_dropped++;
+        priv->au_dropped = TRUE;
+        qos_post_drop(amltspvsink, priv->au_time);
+        return au_write_held(amltspvsink);
+    }
+    priv->qos_processed++;
+
+    /* nothing of a key au is written yet, switch the vfm path ahead of it */
+    if (nal_is_key(priv->extradata_type, nal_type) && video_path_switch_pending() &&
+        !vfm_path_switch(amltspvsink, priv->au_pts))
+    {
+        priv->au_dropped = TRUE;
+        return GST_FLOW_FLUSHING;
+    }
+
+    if (priv->extradata_got && !priv->extradata_injected)
+    {
+        int ret = extradata_inject(priv, priv->au_pts);
+
+        if (ERROR_CODE_OK != ret)
+        {
+            /* the au does not decode without them, try again with the next one */
+            GST_DEBUG_OBJECT(amltspvsink, "extradata write failed: %d, drop au", ret);
+            priv->drop_to_key = TRUE;
+            priv->au_dropped = TRUE;
+            au_write_held(amltspvsink);
+            return (ERROR_CODE_CANCELLED == ret) ? GST_FLOW_FLUSHING : GST_FLOW_OK;
+        }
+    }
+
+    GST_DEBUG_OBJECT(amltspvsink, "au with %u held nals, vpts:%llu",
+                     gst_buffer_list_length(priv->au), priv->au_pts);
+    return au_write_held(amltspvsink);
 }
 
-/* h264/265 extradata parser, like vps/sps/pps */
-static int h264_extradata_parser(const unsigned char *in_buf, int in_size, ExtraData *extra_data)
+/*
+ * End the current au. Nals held with no slice after them, e.g.
+ * parameter sets ahead of EOS or new caps, are written as they are.
+ */
+static GstFlowReturn au_write(GstAmltspvsink *amltspvsink)
 {
-    GstH264ParserResult res = GST_H264_PARSER_OK;
-    GstH264NalParser *h264parser = gst_h264_nal_parser_new();
-    unsigned int offset = 0;
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    GstFlowReturn flow = GST_FLOW_OK;
 
-    do
+    if (!priv->au_has_vcl)
     {
-        GstH264NalUnit nal = {0};
-        res = gst_h264_parser_identify_nalu(h264parser,
-                                            in_buf,
-                                            offset,
-                                            in_size,
-                                            &nal);
-        offset = nal.offset + nal.size;
-        GST_DEBUG("nal info, type:%d, size:%d, offset:%d, sc_offset:%d; res:%d!",
-                  nal.type, nal.size, nal.offset, nal.sc_offset, res);
+        flow = au_write_held(amltspvsink);
+    }
+    au_clear(priv);
+    return flow;
+}
 
-        if ((GST_H264_PARSER_OK != res) && (GST_H264_PARSER_NO_NAL_END != res))
-        {
-            GST_ERROR("h264 nal parse error!");
-            goto error;
-        }
+/*
+ * alignment=nal: write each nal as it comes, holding only the non-vcl
+ * nals ahead of the first slice, which decides on the whole au. The next
+ * au starts on an AUD, parameter set or SEI after a slice, a slice with
+ * first_mb_in_slice (first_slice_segment_in_pic_flag) set, or a new pts.
+ * A marker flag, set by rtp depayloaders, ends the au right away.
+ */
+static GstFlowReturn au_gather(GstAmltspvsink *amltspvsink, GstBuffer *buffer, guint64 pts)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    GstFlowReturn flow = GST_FLOW_OK;
+    GstMapInfo map;
+    gint nal_type = -1;
+    gboolean vcl = FALSE;
+    gboolean first_slice = FALSE;
+    gboolean started;
+    gboolean parsed;
+    gboolean begin = FALSE;
+
+    gst_buffer_map(buffer, &map, (GstMapFlags)GST_MAP_READ);
+    parsed = nal_header_parse(priv->extradata_type, map.data, map.size, &nal_type, &vcl, &first_slice);
+    gst_buffer_unmap(buffer, &map);
+
+    started = priv->au_has_vcl || gst_buffer_list_length(priv->au);
+    if (started &&
+        ((priv->au_has_vcl && parsed && nal_starts_au(priv->extradata_type, nal_type, vcl, first_slice)) ||
+         (GST_BUFFER_PTS_IS_VALID(buffer) && pts != priv->au_pts)))
+    {
+        flow = au_write(amltspvsink);
+        started = FALSE;
+    }
 
-        switch (nal.type)
-        {
-        case (GST_H264_NAL_SPS):
+    if (!started || GST_BUFFER_PTS_IS_VALID(buffer))
+    {
+        priv->au_pts = pts;
+        priv->au_time = GST_BUFFER_TIMESTAMP(buffer);
+    }
+    if (!vcl && !priv->au_has_vcl)
+    {
+        gst_buffer_list_add(priv->au, gst_buffer_ref(buffer));
+    }
+    else
+    {
+        if (!priv->au_has_vcl && GST_FLOW_OK == flow)
         {
-            if (NULL == extra_data->sps)
-            {
-                extra_data->sps_size = nal.size + nal.offset - nal.sc_offset;
-                extra_data->sps = malloc(extra_data->sps_size);
-                if (NULL == extra_data->sps)
-                    goto error;
-                memcpy(extra_data->sps, nal.data + nal.sc_offset, extra_data->sps_size);
-            }
-            break;
+            flow = au_begin(amltspvsink, buffer, nal_type);
+            begin = TRUE;
         }
-        case (GST_H264_NAL_PPS):
+        if (!priv->au_dropped && GST_FLOW_OK == flow)
         {
-            if (NULL == extra_data->pps)
-            {
-                extra_data->pps_size = nal.size + nal.offset - nal.sc_offset;
-                extra_data->pps = malloc(extra_data->pps_size);
-                if (NULL == extra_data->pps)
-                    goto error;
-                memcpy(extra_data->pps, nal.data + nal.sc_offset, extra_data->pps_size);
-            }
-            break;
+            flow = au_write_nal(amltspvsink, buffer);
         }
-        default:
-            break;
+        if (begin && !priv->au_dropped && GST_FLOW_OK == flow)
+        {
+            priv->frames_written++;
         }
-    } while (GST_H264_PARSER_NO_NAL_END != res);
+    }
 
-    if ((NULL == extra_data->sps) || (NULL == extra_data->pps))
-        goto error;
+    if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_MARKER) && GST_FLOW_OK == flow)
+    {
+        flow = au_write(amltspvsink);
+    }
+    return flow;
+}
 
-    GST_DEBUG("h264 extradata parse finish!");
-    gst_h264_nal_parser_free(h264parser);
-    return 0;
+/*
+ * pts written to the decoder, 90KHz. In gapless mode this is the running
+ * time, continuous across items and segments, so one decoder session
+ * plays them back to back. Trick play comes with a flushing seek and
+ * keeps the buffer pts. Streaming thread only.
+ */
+static guint64 es_pts(GstAmltspvsink *amltspvsink, GstClockTime time)
+{
+    GstBaseSink *basesink = GST_BASE_SINK(amltspvsink);
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
 
-error:
-    GST_ERROR("h264 extradata parse error!");
-    gst_h264_nal_parser_free(h264parser);
-    SAVE_FREE(extra_data->sps);
-    SAVE_FREE(extra_data->pps);
-    return -1;
+    if (priv->gapless && 1.0 == basesink->segment.rate)
+    {
+        GstClockTime running_time = gst_segment_to_running_time(&basesink->segment, GST_FORMAT_TIME, time);
+
+        /* before the segment, clipped by the decoder */
+        return GST_CLOCK_TIME_IS_VALID(running_time) ? running_time * 9 / 100000 : 0;
+    }
+    return time * 9 / 100000;
 }
 
-static int h265_extradata_parser(const unsigned char *in_buf, int in_size, ExtraData *extra_data)
+/*
+ * A pts jump past PTS_DISCONT_THRESHOLD re-anchors tsync on the new pts.
+ * A DISCONT buffer only lowers the threshold to
+ * PTS_DISCONT_THRESHOLD_FLAGGED: after a packet loss the timeline
+ * usually goes on, and re-anchoring then would glitch sync for nothing.
+ * Streaming thread only.
+ */
+static void pts_continuity(GstAmltspvsink *amltspvsink, GstBuffer *buffer, guint64 pts)
 {
-    GstH265ParserResult res = GST_H265_PARSER_OK;
-    GstH265Parser *h265parser = gst_h265_parser_new();
-    unsigned int offset = 0;
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    gint64 threshold = GST_BUFFER_IS_DISCONT(buffer) ? PTS_DISCONT_THRESHOLD_FLAGGED : PTS_DISCONT_THRESHOLD;
+    gint64 delta = (gint64)(pts - priv->last_pts);
 
-    do
+    if (priv->last_pts_valid && ABS(delta) > threshold)
     {
-        GstH265NalUnit nal = {0};
-        res = gst_h265_parser_identify_nalu(h265parser,
-                                            in_buf,
-                                            offset,
-                                            in_size,
-                                            &nal);
-        offset = nal.offset + nal.size;
-        GST_DEBUG("nal info, type:%d, size:%d, offset:%d, sc_offset:%d; res:%d!",
-                  nal.type, nal.size, nal.offset, nal.sc_offset, res);
+        GST_INFO_OBJECT(amltspvsink, "pts discontinuity, %" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT "%s",
+                        priv->last_pts, pts, GST_BUFFER_IS_DISCONT(buffer) ? ", discont" : "");
+        session_pts_discontinuity(1, pts);
+    }
+    priv->last_pts_valid = TRUE;
+    priv->last_pts = pts;
+}
 
-        if ((GST_H265_PARSER_OK != res) && (GST_H265_PARSER_NO_NAL_END != res))
-        {
-            GST_ERROR("h265 nal parse error!");
-            goto error;
-        }
+/* running time of a decoder pts, see es_pts(). Under the object lock */
+static GstClockTime es_pts_to_running_time(GstAmltspvsinkPrivate *priv, const GstSegment *segment,
+                                           guint64 pts)
+{
+    GstClockTime time = gst_util_uint64_scale(pts, GST_SECOND, PTS_90K);
 
-        switch (nal.type)
-        {
-        case (GST_H265_NAL_VPS):
+    if (priv->gapless && 1.0 == segment->rate)
+    {
+        return time;
+    }
+    return gst_segment_to_running_time(segment, GST_FORMAT_TIME, time);
+}
+
+/*
+ * Scan an annex-b chunk: -1 if it holds a reference slice, else the
+ * number of slices. h264 slices with nal_ref_idc 0 and hevc sub-layer
+ * non-reference slices (even types up to RSV_VCL_N14) are not referenced.
+ */
+static gint nal_ref_scan(eExtraDataType type, const guint8 *data, gsize size)
+{
+    gsize offset = 0;
+    gint slices = 0;
+
+    while (offset + 3 < size)
+    {
+        if (0 != data[offset] || 0 != data[offset + 1] || 1 != data[offset + 2])
         {
-            if (NULL == extra_data->vps)
-            {
-                extra_data->vps_size = nal.size + nal.offset - nal.sc_offset;
-                extra_data->vps = malloc(extra_data->vps_size);
-                if (NULL == extra_data->vps)
-                    goto error;
-                memcpy(extra_data->vps, nal.data + nal.sc_offset, extra_data->vps_size);
-            }
-            break;
+            offset++;
+            continue;
         }
-        case (GST_H265_NAL_SPS):
+        offset += 3;
+
+        if (ED_TYPE_H265 == type)
         {
-            if (NULL == extra_data->sps)
+            gint nal_type = (data[offset] >> 1) & 0x3f;
+
+            if (nal_type < 32)
             {
-                extra_data->sps_size = nal.size + nal.offset - nal.sc_offset;
-                extra_data->sps = malloc(extra_data->sps_size);
-                if (NULL == extra_data->sps)
-                    goto error;
-                memcpy(extra_data->sps, nal.data + nal.sc_offset, extra_data->sps_size);
+                if (nal_type > 14 || (nal_type & 1))
+                    return -1;
+                slices++;
             }
-            break;
         }
-        case (GST_H265_NAL_PPS):
+        else
         {
-            if (NULL == extra_data->pps)
+            gint nal_type = data[offset] & 0x1f;
+
+            if (nal_type >= 1 && nal_type <= 5)
             {
-                extra_data->pps_size = nal.size + nal.offset - nal.sc_offset;
-                extra_data->pps = malloc(extra_data->pps_size);
-                if (NULL == extra_data->pps)
-                    goto error;
-                memcpy(extra_data->pps, nal.data + nal.sc_offset, extra_data->pps_size);
+                if (data[offset] & 0x60)
+                    return -1;
+                slices++;
             }
-            break;
         }
-        default:
-            break;
-        }
-    } while (GST_H265_PARSER_NO_NAL_END != res);
+    }
+    return slices;
+}
 
-    if ((NULL == extra_data->vps) || (NULL == extra_data->sps) || (NULL == extra_data->pps))
-        goto error;
+/* whether an au may be dropped under decoder overload */
+static gboolean qos_droppable(GstAmltspvsinkPrivate *priv, const guint8 *data, gsize size)
+{
+    if (!priv->qos_dropping || ED_TYPE_INVALID == priv->extradata_type)
+        return FALSE;
 
-    GST_DEBUG("h265 extradata parse finish!");
-    gst_h265_parser_free(h265parser);
-    return 0;
+    return nal_ref_scan(priv->extradata_type, data, size) > 0;
+}
 
-error:
-    GST_ERROR("h265 extradata parse error!");
-    gst_h265_parser_free(h265parser);
-    SAVE_FREE(extra_data->vps);
-    SAVE_FREE(extra_data->sps);
-    SAVE_FREE(extra_data->pps);
-    return -1;
+/*
+ * Lateness of the decoder: the running time of the frame on display
+ * against the clock, relative to the smallest offset seen since the
+ * last flush, which is the display pipeline delay. Sent upstream as
+ * qos. Past QOS_DROP_THRESHOLD the sink drops non reference frames
+ * itself until the decoder is back under half of it. Not under the
+ * object lock.
+ */
+static void qos_update(GstAmltspvsink *amltspvsink)
+{
+    GstBaseSink *basesink = GST_BASE_SINK(amltspvsink);
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    gint64 now_us = g_get_monotonic_time();
+    guint64 vpts = 0;
+    GstClock *clock = NULL;
+    GstClockTime now = GST_CLOCK_TIME_NONE;
+    GstClockTime base_time = GST_CLOCK_TIME_NONE;
+    GstClockTime running_time = GST_CLOCK_TIME_NONE;
+    GstClockTime duration = QOS_DEFAULT_DURATION;
+    GstClockTimeDiff offset = 0;
+    GstClockTimeDiff jitter = 0;
+
+    if (!gst_base_sink_is_qos_enabled(basesink) || priv->low_latency ||
+        1.0 != priv->segment_rate || now_us - priv->qos_last_us < QOS_INTERVAL_US)
+    {
+        return;
+    }
+    priv->qos_last_us = now_us;
+
+    if (ERROR_CODE_OK != video_get_pts(&vpts) || 0 == vpts)
+    {
+        return;
+    }
+    GST_OBJECT_LOCK(amltspvsink);
+    running_time = es_pts_to_running_time(priv, &basesink->segment, vpts);
+    GST_OBJECT_UNLOCK(amltspvsink);
+    if (!GST_CLOCK_TIME_IS_VALID(running_time))
+    {
+        return;
+    }
+
+    clock = gst_element_get_clock(GST_ELEMENT(amltspvsink));
+    if (clock == NULL)
+    {
+        return;
+    }
+    now = gst_clock_get_time(clock);
+    base_time = gst_element_get_base_time(GST_ELEMENT(amltspvsink));
+    gst_object_unref(clock);
+    if (now < base_time)
+    {
+        return;
+    }
+
+    offset = GST_CLOCK_DIFF(running_time, now - base_time);
+    priv->qos_base = MIN(priv->qos_base, offset);
+    jitter = offset - priv->qos_base;
+
+    if (priv->fr > 0.0)
+    {
+        duration = (GstClockTime)(GST_SECOND / priv->fr);
+    }
+    priv->qos_jitter = jitter;
+    priv->qos_proportion = (gdouble)(duration + jitter) / duration;
+
+    if (!priv->qos_dropping && jitter > QOS_DROP_THRESHOLD)
+    {
+        GST_INFO_OBJECT(amltspvsink, "decoder late %" GST_STIME_FORMAT ", drop non reference frames",
+                        GST_STIME_ARGS(jitter));
+        priv->qos_dropping = TRUE;
+    }
+    else if (priv->qos_dropping && jitter < QOS_DROP_THRESHOLD / 2)
+    {
+        GST_INFO_OBJECT(amltspvsink, "decoder on time, %" G_GUINT64_FORMAT " frames dropped",
+                        priv->qos_dropped);
+        priv->qos_dropping = FALSE;
+    }
+
+    gst_pad_push_event(GST_BASE_SINK_PAD(basesink),
+                       gst_event_new_qos(jitter > 0 ? GST_QOS_TYPE_UNDERFLOW : GST_QOS_TYPE_OVERFLOW,
+                                         priv->qos_proportion, jitter, running_time));
 }
 
-static int extradata_get(eExtraDataType type, const unsigned char *in_buf, int in_size, ExtraData *extra_data)
+/* post a qos message for a dropped frame, not under the object lock */
+static void qos_post_drop(GstAmltspvsink *amltspvsink, GstClockTime timestamp)
 {
-    int ret = 0;
-    ExtraData tmp_extra_data = {0};
+    GstBaseSink *basesink = GST_BASE_SINK(amltspvsink);
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    GstClockTime running_time = GST_CLOCK_TIME_NONE;
+    GstClockTime stream_time = GST_CLOCK_TIME_NONE;
+    GstMessage *msg = NULL;
 
-    if ((ED_TYPE_INVALID == type) || (NULL == in_buf) || (0 >= in_size) || (NULL == extra_data))
+    GST_OBJECT_LOCK(amltspvsink);
+    running_time = gst_segment_to_running_time(&basesink->segment, GST_FORMAT_TIME, timestamp);
+    stream_time = gst_segment_to_stream_time(&basesink->segment, GST_FORMAT_TIME, timestamp);
+    GST_OBJECT_UNLOCK(amltspvsink);
+
+    msg = gst_message_new_qos(GST_OBJECT_CAST(amltspvsink), FALSE, running_time, stream_time,
+                              timestamp, GST_CLOCK_TIME_NONE);
+    gst_message_set_qos_values(msg, priv->qos_jitter, priv->qos_proportion, 1000000);
+    gst_message_set_qos_stats(msg, GST_FORMAT_BUFFERS, priv->qos_processed, priv->qos_dropped);
+    gst_element_post_message(GST_ELEMENT(amltspvsink), msg);
+}
+
+static void qos_reset(GstAmltspvsinkPrivate *priv)
+{
+    priv->qos_last_us = 0;
+    priv->qos_base = G_MAXINT64;
+    priv->qos_jitter = 0;
+    priv->qos_proportion = 1.0;
+    priv->qos_dropping = FALSE;
+}
+
+/*
+ * Keep the decoder buffer under latency_target in low latency mode:
+ * above the target play slightly faster, above twice the target drop
+ * delta frames until the next key frame. Returns FALSE to drop buffer.
+ */
+static gboolean low_latency_control(GstAmltspvsink *amltspvsink, gboolean delta)
+{
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    gint32 buffered_ms = 0;
+    gint32 target = (gint32)priv->latency_target;
+
+    /* level unknown, e.g. nothing written since a flush is shown yet */
+    if (ERROR_CODE_OK != video_get_buffered_ms(&buffered_ms))
     {
-        return -1;
+        return TRUE;
     }
 
-    if (ED_TYPE_H264 == type)
+    if (buffered_ms > 2 * target)
     {
-        ret = h264_extradata_parser(in_buf, in_size, &tmp_extra_data);
+        priv->drop_to_key = TRUE;
     }
-    else
+    if (priv->drop_to_key)
     {
-        ret = h265_extradata_parser(in_buf, in_size, &tmp_extra_data);
+        if (delta)
+        {
+            GST_DEBUG_OBJECT(amltspvsink, "drop frame, buffered %d ms", buffered_ms);
+            return FALSE;
+        }
+        priv->drop_to_key = FALSE;
     }
 
-    if (0 == ret)
+    if (!priv->catching_up && buffered_ms > target && 1.0 == priv->segment_rate)
     {
-        SAVE_FREE(extra_data->vps);
-        SAVE_FREE(extra_data->sps);
-        SAVE_FREE(extra_data->pps);
-        memcpy(extra_data, &tmp_extra_data, sizeof(ExtraData));
+        GST_INFO_OBJECT(amltspvsink, "catch up, buffered %d ms", buffered_ms);
+        /* before the rate, the reset takes back a drift correction */
+        session_drift_reset();
+        if (ERROR_CODE_OK == video_set_rate(LOW_LATENCY_CATCHUP_RATE))
+        {
+            priv->catching_up = TRUE;
+        }
+    }
+    else if (priv->catching_up && buffered_ms < target / 2)
+    {
+        GST_INFO_OBJECT(amltspvsink, "caught up, buffered %d ms", buffered_ms);
+        video_set_rate(priv->segment_rate);
+        priv->catching_up = FALSE;
     }
 
-    return ret;
+    return TRUE;
+}
+
+/* feed the session drift estimator, not under the object lock */
+static void drift_sample(GstAmltspvsink *amltspvsink, GstClockTime time)
+{
+    GstBaseSink *basesink = GST_BASE_SINK(amltspvsink);
+    GstClock *clock = NULL;
+    GstClockTime running_time = GST_CLOCK_TIME_NONE;
+    GstClockTime now = GST_CLOCK_TIME_NONE;
+    GstClockTime base_time = GST_CLOCK_TIME_NONE;
+
+    running_time = gst_segment_to_running_time(&basesink->segment, GST_FORMAT_TIME, time);
+    if (!GST_CLOCK_TIME_IS_VALID(running_time))
+    {
+        return;
+    }
+
+    clock = gst_element_get_clock(GST_ELEMENT(amltspvsink));
+    if (clock == NULL)
+    {
+        return;
+    }
+    now = gst_clock_get_time(clock);
+    base_time = gst_element_get_base_time(GST_ELEMENT(amltspvsink));
+    gst_object_unref(clock);
+
+    if (now < base_time)
+    {
+        return;
+    }
+
+    session_drift_update((int64_t)GST_TIME_AS_USECONDS(now - base_time),
+                         (int64_t)GST_TIME_AS_USECONDS(running_time));
 }
 
-static void extradata_release(ExtraData *extra_data)
+/* add the measured decoder delay to the latency answered by basesink */
+static void latency_query_add(GstAmltspvsink *amltspvsink, GstQuery *query)
 {
-    if (NULL == extra_data)
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    gboolean live = FALSE;
+    GstClockTime min = 0;
+    GstClockTime max = GST_CLOCK_TIME_NONE;
+    gint min_ms, max_ms;
+
+    g_mutex_lock(&priv->level_lock);
+    min_ms = priv->latency.min_ms;
+    max_ms = priv->latency.max_ms;
+    g_mutex_unlock(&priv->level_lock);
+    if (min_ms < 0)
     {
         return;
     }
 
-    SAVE_FREE(extra_data->vps);
-    SAVE_FREE(extra_data->sps);
-    SAVE_FREE(extra_data->pps);
-
-    return;
+    gst_query_parse_latency(query, &live, &min, &max);
+    min += min_ms * GST_MSECOND;
+    if (GST_CLOCK_TIME_IS_VALID(max))
+    {
+        max += max_ms * GST_MSECOND;
+    }
+    gst_query_set_latency(query, live, min, max);
+    GST_DEBUG_OBJECT(amltspvsink, "latency, live: %d, min: %" GST_TIME_FORMAT ", max: %" GST_TIME_FORMAT,
+                     live, GST_TIME_ARGS(min), GST_TIME_ARGS(max));
 }
 /*******************************utils end******************************/
 
@@ -632,11 +2610,19 @@ gst_amltspvsink_class_init(GstAmltspvsinkClass *klass)
     GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
     GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
     GstBaseSinkClass *base_sink_class = GST_BASE_SINK_CLASS(klass);
+    GstCaps *caps = NULL;
 
     /* Setting up pads and setting metadata should be moved to
      base_class_init if you intend to subclass this class. */
-    gst_element_class_add_static_pad_template(element_class,
-                                              &gst_amltspvsink_sink_template);
+    caps = probe_sink_caps();
+    gst_element_class_add_pad_template(element_class,
+                                       gst_pad_template_new("sink", GST_PAD_SINK, GST_PAD_ALWAYS, caps));
+    gst_caps_unref(caps);
+    /* closed captions the decoder delivers as user data */
+    caps = gst_caps_from_string(CC_CAPS);
+    gst_element_class_add_pad_template(element_class,
+                                       gst_pad_template_new("cc_src", GST_PAD_SRC, GST_PAD_ALWAYS, caps));
+    gst_caps_unref(caps);
 
     gst_element_class_set_static_metadata(element_class,
                                           "Video Decoder on Tsplayer",
@@ -654,8 +2640,11 @@ gst_amltspvsink_class_init(GstAmltspvsinkClass *klass)
     base_sink_class->set_caps = GST_DEBUG_FUNCPTR(gst_amltspvsink_set_caps);
     base_sink_class->start = GST_DEBUG_FUNCPTR(gst_amltspvsink_start);
     base_sink_class->stop = GST_DEBUG_FUNCPTR(gst_amltspvsink_stop);
+    base_sink_class->unlock = GST_DEBUG_FUNCPTR(gst_amltspvsink_unlock);
+    base_sink_class->unlock_stop = GST_DEBUG_FUNCPTR(gst_amltspvsink_unlock_stop);
     base_sink_class->query = GST_DEBUG_FUNCPTR(gst_amltspvsink_query);
     base_sink_class->event = GST_DEBUG_FUNCPTR(gst_amltspvsink_event);
+    base_sink_class->preroll = GST_DEBUG_FUNCPTR(gst_amltspvsink_preroll);
     base_sink_class->render = GST_DEBUG_FUNCPTR(gst_amltspvsink_render);
 
     g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_WINDOW_SET,
@@ -670,6 +2659,44 @@ gst_amltspvsink_class_init(GstAmltspvsinkClass *klass)
                                     g_param_spec_int("render-angle", "render-angle",
                                                      "Render angle settings:0/90/180/270",
                                                      0, 270, 0, G_PARAM_READWRITE));
+    g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_LOW_LATENCY,
+                                    g_param_spec_boolean("low-latency", "low-latency",
+                                                         "Keep the decoder buffer under latency-target, for live sources",
+                                                         FALSE, (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_LATENCY_TARGET,
+                                    g_param_spec_uint("latency-target", "latency-target",
+                                                      "Max decoder buffer depth in low latency mode, in ms",
+                                                      MIN_LATENCY_TARGET, MAX_LATENCY_TARGET, DEFAULT_LATENCY_TARGET,
+                                                      (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_BUFFERED_TIME,
+                                    g_param_spec_int("buffered-time", "buffered-time",
+                                                     "Decoder buffer depth in ms, -1 if unknown",
+                                                     -1, G_MAXINT, -1, (GParamFlags)(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_SYNC_MODE,
+                                    g_param_spec_enum("sync-mode", "sync-mode",
+                                                      "AV sync master of the tsplayer session",
+                                                      GST_TYPE_AMLTSPVSINK_SYNC_MODE, SESSION_SYNC_AUTO,
+                                                      (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_DRIFT_COMPENSATION,
+                                    g_param_spec_boolean("drift-compensation", "drift-compensation",
+                                                         "Correct the play rate when the stream clock drifts from ours",
+                                                         FALSE, (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_BUFFER_LEVEL,
+                                    g_param_spec_int("buffer-level", "buffer-level",
+                                                     "Decoder es buffer occupancy in percent, -1 if unknown",
+                                                     -1, 100, -1, (GParamFlags)(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_BUFFER_WATERMARKS,
+                                    g_param_spec_string("buffer-watermarks", "buffer-watermarks",
+                                                        "Decoder buffer watermarks in percent, Format: low,high",
+                                                        "10,80", (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_PREROLL_FIRST_FRAME,
+                                    g_param_spec_boolean("preroll-first-frame", "preroll-first-frame",
+                                                         "Decode and show the first frame in PAUSED, PAUSED completes once it is shown",
+                                                         FALSE, (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_GAPLESS,
+                                    g_param_spec_boolean("gapless", "gapless",
+                                                         "Write running time to the decoder so items and segments play back to back",
+                                                         FALSE, (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
     g_signals[SIGNAL_FIRSTFRAME] = g_signal_new("first-video-frame-callback",
                                                 G_TYPE_FROM_CLASS(GST_ELEMENT_CLASS(klass)),
@@ -682,6 +2709,19 @@ gst_amltspvsink_class_init(GstAmltspvsinkClass *klass)
                                                 2,
                                                 G_TYPE_UINT,
                                                 G_TYPE_POINTER);
+    /* window x, y, w, h, angle, crop top, left, bottom, right in one update */
+    g_signals[SIGNAL_UPDATE_GEOMETRY] = g_signal_new_class_handler("update-geometry",
+                                                                   G_TYPE_FROM_CLASS(GST_ELEMENT_CLASS(klass)),
+                                                                   (GSignalFlags)(G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION),
+                                                                   G_CALLBACK(gst_amltspvsink_update_geometry),
+                                                                   NULL, /* accumulator */
+                                                                   NULL, /* accu data */
+                                                                   NULL, /* generic marshaller */
+                                                                   G_TYPE_NONE,
+                                                                   9,
+                                                                   G_TYPE_INT, G_TYPE_INT, G_TYPE_INT, G_TYPE_INT,
+                                                                   G_TYPE_INT,
+                                                                   G_TYPE_INT, G_TYPE_INT, G_TYPE_INT, G_TYPE_INT);
 
     return;
 }
@@ -704,6 +2744,35 @@ gst_amltspvsink_init(GstAmltspvsink *amltspvsink)
     priv->extradata_type = ED_TYPE_INVALID;
     priv->extradata_got = FALSE;
     priv->extradata_injected = TRUE;
+    priv->low_latency = FALSE;
+    priv->latency_target = DEFAULT_LATENCY_TARGET;
+    priv->segment_rate = 1.0;
+    priv->sync_mode = SESSION_SYNC_AUTO;
+    priv->drift_compensation = FALSE;
+    g_mutex_init(&priv->control_lock);
+    g_mutex_init(&priv->geometry_lock);
+    g_cond_init(&priv->geometry_cond);
+    g_mutex_init(&priv->level_lock);
+    g_cond_init(&priv->level_cond);
+    priv->buffer_level = -1;
+    priv->low_watermark = BUFFER_LOW_WATERMARK;
+    priv->high_watermark = BUFFER_HIGH_WATERMARK;
+    priv->level_state = LEVEL_STATE_UNKNOWN;
+    latency_window_reset(&priv->latency, 0);
+    priv->au = gst_buffer_list_new();
+    priv->event_fd = -1;
+    priv->afd = -1;
+    priv->cc_need_events = TRUE;
+    g_mutex_init(&priv->cc_lock);
+    g_cond_init(&priv->cc_cond);
+    g_queue_init(&priv->cc_queue);
+    priv->cc_flushing = TRUE;
+    priv->cc_pad = gst_pad_new_from_template(
+        gst_element_class_get_pad_template(GST_ELEMENT_GET_CLASS(amltspvsink), "cc_src"), "cc_src");
+    gst_pad_use_fixed_caps(priv->cc_pad);
+    gst_element_add_pad(GST_ELEMENT(amltspvsink), priv->cc_pad);
+    qos_reset(priv);
+    gst_base_sink_set_qos_enabled(GST_BASE_SINK(amltspvsink), TRUE);
 
     return;
 }
@@ -729,13 +2798,14 @@ void gst_amltspvsink_set_property(GObject *object, guint property_id,
         }
         else
         {
-            priv->disp_x = atoi(parts[0]);
-            priv->disp_y = atoi(parts[1]);
-            priv->disp_w = atoi(parts[2]);
-            priv->disp_h = atoi(parts[3]);
-            priv->setwindow = TRUE;
-            video_set_region(priv->disp_x, priv->disp_y, priv->disp_w, priv->disp_h);
-            GST_INFO("set window rect (%d,%d,%d,%d)\n", priv->disp_x, priv->disp_y, priv->disp_w, priv->disp_h);
+            Geometry geometry = {0};
+
+            geometry.x = atoi(parts[0]);
+            geometry.y = atoi(parts[1]);
+            geometry.w = atoi(parts[2]);
+            geometry.h = atoi(parts[3]);
+            geometry_request(amltspvsink, GEOMETRY_WINDOW, &geometry);
+            GST_INFO("set window rect (%d,%d,%d,%d)\n", geometry.x, geometry.y, geometry.w, geometry.h);
         }
         g_strfreev(parts);
         break;
@@ -751,11 +2821,10 @@ void gst_amltspvsink_set_property(GObject *object, guint property_id,
         int angle = g_value_get_int(value);
         if (0 == angle || 90 == angle || 180 == angle || 270 == angle)
         {
-            priv->angle = angle;
-            if (ERROR_CODE_OK != video_set_angle(priv->angle))
-            {
-                priv->setangle = TRUE;
-            }
+            Geometry geometry = {0};
+
+            geometry.angle = angle;
+            geometry_request(amltspvsink, GEOMETRY_ANGLE, &geometry);
             GST_INFO("set render angle, %d", angle);
         }
         else
@@ -764,6 +2833,75 @@ void gst_amltspvsink_set_property(GObject *object, guint property_id,
         }
         break;
     }
+    case PROP_LOW_LATENCY:
+    {
+        priv->low_latency = g_value_get_boolean(value);
+        video_set_low_latency(priv->low_latency);
+        /* let basesink drop what is already later than the target */
+        gst_base_sink_set_max_lateness(GST_BASE_SINK(amltspvsink),
+                                       priv->low_latency ? (gint64)priv->latency_target * GST_MSECOND : -1);
+        GST_INFO("set low latency, %d", priv->low_latency);
+        break;
+    }
+    case PROP_LATENCY_TARGET:
+    {
+        priv->latency_target = g_value_get_uint(value);
+        if (priv->low_latency)
+        {
+            gst_base_sink_set_max_lateness(GST_BASE_SINK(amltspvsink),
+                                           (gint64)priv->latency_target * GST_MSECOND);
+        }
+        GST_INFO("set latency target, %u ms", priv->latency_target);
+        break;
+    }
+    case PROP_SYNC_MODE:
+    {
+        priv->sync_mode = g_value_get_enum(value);
+        video_set_sync_mode(priv->sync_mode);
+        GST_INFO("set sync mode, %d", priv->sync_mode);
+        break;
+    }
+    case PROP_DRIFT_COMPENSATION:
+    {
+        priv->drift_compensation = g_value_get_boolean(value);
+        session_drift_reset();
+        GST_INFO("set drift compensation, %d", priv->drift_compensation);
+        break;
+    }
+    case PROP_BUFFER_WATERMARKS:
+    {
+        const gchar *str = g_value_get_string(value);
+        gint low = -1;
+        gint high = -1;
+
+        if (!str || 2 != sscanf(str, "%d,%d", &low, &high) ||
+            low < 0 || high > 100 || low >= high)
+        {
+            GST_ERROR("Bad buffer watermarks string");
+        }
+        else
+        {
+            g_mutex_lock(&priv->level_lock);
+            priv->low_watermark = low;
+            priv->high_watermark = high;
+            g_cond_broadcast(&priv->level_cond);
+            g_mutex_unlock(&priv->level_lock);
+            GST_INFO("set buffer watermarks (%d,%d)", low, high);
+        }
+        break;
+    }
+    case PROP_PREROLL_FIRST_FRAME:
+    {
+        priv->preroll_first_frame = g_value_get_boolean(value);
+        GST_INFO("set preroll first frame, %d", priv->preroll_first_frame);
+        break;
+    }
+    case PROP_GAPLESS:
+    {
+        priv->gapless = g_value_get_boolean(value);
+        GST_INFO("set gapless, %d", priv->gapless);
+        break;
+    }
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
         break;
@@ -787,7 +2925,65 @@ void gst_amltspvsink_get_property(GObject *object, guint property_id,
     }
     case PROP_RENDER_ANGLE:
     {
-        g_value_set_int(value, priv->angle);
+        /* the latest request, it may not be applied yet */
+        g_mutex_lock(&priv->geometry_lock);
+        g_value_set_int(value, priv->geometry.angle);
+        g_mutex_unlock(&priv->geometry_lock);
+        break;
+    }
+    case PROP_LOW_LATENCY:
+    {
+        g_value_set_boolean(value, priv->low_latency);
+        break;
+    }
+    case PROP_LATENCY_TARGET:
+    {
+        g_value_set_uint(value, priv->latency_target);
+        break;
+    }
+    case PROP_BUFFERED_TIME:
+    {
+        gint32 buffered_ms = -1;
+
+        if (ERROR_CODE_OK != video_get_buffered_ms(&buffered_ms))
+        {
+            buffered_ms = -1;
+        }
+        g_value_set_int(value, buffered_ms);
+        break;
+    }
+    case PROP_SYNC_MODE:
+    {
+        g_value_set_enum(value, priv->sync_mode);
+        break;
+    }
+    case PROP_DRIFT_COMPENSATION:
+    {
+        g_value_set_boolean(value, priv->drift_compensation);
+        break;
+    }
+    case PROP_BUFFER_LEVEL:
+    {
+        g_mutex_lock(&priv->level_lock);
+        g_value_set_int(value, priv->buffer_level);
+        g_mutex_unlock(&priv->level_lock);
+        break;
+    }
+    case PROP_BUFFER_WATERMARKS:
+    {
+        g_mutex_lock(&priv->level_lock);
+        g_value_take_string(value, g_strdup_printf("%d,%d", priv->low_watermark, priv->high_watermark));
+        g_mutex_unlock(&priv->level_lock);
+        break;
+    }
+    case PROP_PREROLL_FIRST_FRAME:
+    {
+        g_value_set_boolean(value, priv->preroll_first_frame);
+        break;
+    }
+    case PROP_GAPLESS:
+    {
+        g_value_set_boolean(value, priv->gapless);
         break;
     }
     default:
@@ -821,7 +3017,20 @@ void gst_amltspvsink_finalize(GObject *object)
         GST_INFO("release extradata!");
         extradata_release(&priv->extradata);
     }
+    g_free(priv->convert_buf);
+    priv->convert_buf = NULL;
+    gst_buffer_list_unref(priv->au);
+    priv->au = NULL;
+    gst_buffer_replace(&priv->preroll_buffer, NULL);
     GST_OBJECT_UNLOCK(amltspvsink);
+    g_mutex_clear(&priv->control_lock);
+    g_mutex_clear(&priv->geometry_lock);
+    g_cond_clear(&priv->geometry_cond);
+    g_mutex_clear(&priv->level_lock);
+    g_cond_clear(&priv->level_cond);
+    cc_queue_clear(priv);
+    g_mutex_clear(&priv->cc_lock);
+    g_cond_clear(&priv->cc_cond);
 
     G_OBJECT_CLASS(gst_amltspvsink_parent_class)->finalize(object);
 }
@@ -838,19 +3047,22 @@ gst_amltspvsink_change_state(GstElement *element, GstStateChange transition)
     {
     case GST_STATE_CHANGE_NULL_TO_READY:
     {
-        GST_OBJECT_LOCK(amltspvsink);
         if (ERROR_CODE_OK != video_init())
         {
             GST_ERROR_OBJECT(amltspvsink, "video_init failed!");
-            GST_OBJECT_UNLOCK(amltspvsink);
+            return GST_STATE_CHANGE_FAILURE;
+        }
+        if (0 != start_event_thread(amltspvsink))
+        {
             return GST_STATE_CHANGE_FAILURE;
         }
         if (ERROR_CODE_OK != video_register_callback(video_callback, (void *)amltspvsink))
         {
             GST_ERROR_OBJECT(amltspvsink, "video_register_callback failed!");
-            GST_OBJECT_UNLOCK(amltspvsink);
+            stop_event_thread(amltspvsink);
             return GST_STATE_CHANGE_FAILURE;
         }
+        g_mutex_lock(&priv->control_lock);
         if (TRUE == priv->setwindow)
         {
             video_set_region(priv->disp_x, priv->disp_y, priv->disp_w, priv->disp_h);
@@ -861,35 +3073,56 @@ gst_amltspvsink_change_state(GstElement *element, GstStateChange transition)
             video_set_angle(priv->angle);
             priv->setangle = FALSE;
         }
-        GST_OBJECT_UNLOCK(amltspvsink);
+        /* the session forgets the sync mode when it is released */
+        if (SESSION_SYNC_AUTO != priv->sync_mode)
+        {
+            video_set_sync_mode(priv->sync_mode);
+        }
+        g_mutex_unlock(&priv->control_lock);
+        start_monitor_thread(amltspvsink);
+        start_geometry_thread(amltspvsink);
         break;
     }
     case GST_STATE_CHANGE_READY_TO_PAUSED:
     {
+        priv->preroll_armed = TRUE;
         break;
     }
     case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
     {
-        GST_OBJECT_LOCK(amltspvsink);
+        g_mutex_lock(&priv->control_lock);
         if (TRUE == priv->paused)
         {
             video_resume();
         }
         priv->paused = FALSE;
-        GST_OBJECT_UNLOCK(amltspvsink);
+        g_mutex_unlock(&priv->control_lock);
+        /* the display offset changes across a pause */
+        qos_reset(priv);
         break;
     }
     case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
     {
-        GST_OBJECT_LOCK(amltspvsink);
+        g_mutex_lock(&priv->control_lock);
         priv->paused = TRUE;
         video_pause();
-        GST_OBJECT_UNLOCK(amltspvsink);
+        g_mutex_unlock(&priv->control_lock);
         break;
     }
     case GST_STATE_CHANGE_PAUSED_TO_READY:
     {
         keeposd(TRUE);
+        /* before the cc pad is deactivated, which takes its stream lock */
+        cc_task_halt(amltspvsink, TRUE);
+        gst_buffer_replace(&priv->preroll_buffer, NULL);
+        g_mutex_lock(&priv->level_lock);
+        latency_window_reset(&priv->latency, g_get_monotonic_time());
+        g_mutex_unlock(&priv->level_lock);
+        /* the deactivated cc pad drops its sticky events */
+        g_atomic_int_set(&priv->cc_need_events, TRUE);
+        /* the next stream sets up the decoder again */
+        priv->vdec_started = FALSE;
+        priv->vdec_mime = NULL;
         break;
     }
     default:
@@ -900,12 +3133,33 @@ gst_amltspvsink_change_state(GstElement *element, GstStateChange transition)
 
     switch (transition)
     {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+    {
+        /* the cc pad is active now */
+        if (GST_STATE_CHANGE_FAILURE != ret)
+        {
+            cc_task_start(amltspvsink);
+        }
+        break;
+    }
     case GST_STATE_CHANGE_READY_TO_NULL:
     {
-        GST_OBJECT_LOCK(amltspvsink);
+        stop_monitor_thread(amltspvsink);
+        stop_geometry_thread(amltspvsink);
+        g_mutex_lock(&priv->control_lock);
+        if (priv->cropped)
+        {
+            /* the crop is global, do not leave it to the next player */
+            video_set_crop(0, 0, 0, 0);
+            priv->cropped = FALSE;
+        }
+        g_mutex_unlock(&priv->control_lock);
+        /* streaming has stopped, the data path state is ours */
         video_stop();
         video_deinit();
-        GST_OBJECT_UNLOCK(amltspvsink);
+        stop_event_thread(amltspvsink);
+        priv->vdec_started = FALSE;
+        priv->vdec_mime = NULL;
         break;
     }
     default:
@@ -960,6 +3214,11 @@ gst_amltspvsink_set_caps(GstBaseSink *sink, GstCaps *caps)
     if (!mime)
         return FALSE;
 
+    /* the pending au belongs to the old caps */
+    au_write(amltspvsink);
+    priv->nal_length_size = 0;
+    priv->nal_aligned = FALSE;
+
     /* format */
     len = strlen(mime);
     if (len == 12 && !strncmp("video/x-h264", mime, len))
@@ -968,13 +3227,21 @@ gst_amltspvsink_set_caps(GstBaseSink *sink, GstCaps *caps)
         if (gst_structure_has_field(structure, "alignment"))
         {
             const char *alignment = gst_structure_get_string(structure, "alignment");
-            if (strncmp("au", alignment, strlen(alignment)))
+            if (!strcmp("nal", alignment))
+            {
+                priv->nal_aligned = TRUE;
+            }
+            else if (strncmp("au", alignment, strlen(alignment)))
             {
                 GST_ERROR_OBJECT(amltspvsink, "aligment:%s!", alignment);
                 goto error;
             }
             priv->extradata_type = ED_TYPE_H264;
         }
+        if (0 != stream_format_setup(amltspvsink, structure, ED_TYPE_H264))
+        {
+            goto error;
+        }
     }
     else if (len == 12 && !strncmp("video/x-h265", mime, len))
     {
@@ -982,13 +3249,21 @@ gst_amltspvsink_set_caps(GstBaseSink *sink, GstCaps *caps)
         if (gst_structure_has_field(structure, "alignment"))
         {
             const char *alignment = gst_structure_get_string(structure, "alignment");
-            if (strncmp("au", alignment, strlen(alignment)))
+            if (!strcmp("nal", alignment))
+            {
+                priv->nal_aligned = TRUE;
+            }
+            else if (strncmp("au", alignment, strlen(alignment)))
             {
                 GST_ERROR_OBJECT(amltspvsink, "aligment:%s!", alignment);
                 goto error;
             }
             priv->extradata_type = ED_TYPE_H265;
         }
+        if (0 != stream_format_setup(amltspvsink, structure, ED_TYPE_H265))
+        {
+            goto error;
+        }
     }
     else if (len == 10 && !strncmp("video/mpeg", mime, len))
     {
@@ -1001,14 +3276,31 @@ gst_amltspvsink_set_caps(GstBaseSink *sink, GstCaps *caps)
     {
         /* do nothing */
     }
+    else if ((len == 18 && !strncmp("video/x-gst-av-avs", mime, len)) ||
+             (len == 12 && !strncmp("video/x-cavs", mime, len)))
+    {
+        /* frame based, no extradata to inject */
+    }
     else
     {
         GST_ERROR("not accepting format(%s)", mime);
         goto error;
     }
 
-    video_set_codec(mime, version);
-    video_start();
+    /* gapless items of the same codec keep the decoder session running */
+    if (!priv->gapless || !priv->vdec_started ||
+        strcmp(mime, priv->vdec_mime) || version != priv->vdec_version)
+    {
+        video_set_codec(mime, version);
+        video_start();
+        priv->vdec_started = TRUE;
+        priv->vdec_mime = mime;
+        priv->vdec_version = version;
+    }
+    else
+    {
+        GST_INFO_OBJECT(amltspvsink, "codec unchanged, decoder not restarted");
+    }
 
     /* frame rate */
     if (gst_structure_get_fraction(structure, "framerate", &num, &denom))
@@ -1062,16 +3354,83 @@ gst_amltspvsink_stop(GstBaseSink *sink)
     return TRUE;
 }
 
+/* interrupt a render paced on the decoder buffer level */
+static gboolean
+gst_amltspvsink_unlock(GstBaseSink *sink)
+{
+    GstAmltspvsink *amltspvsink = GST_AMLTSPVSINK(sink);
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    GST_DEBUG_OBJECT(amltspvsink, "unlock");
+    g_mutex_lock(&priv->level_lock);
+    priv->flushing = TRUE;
+    g_cond_broadcast(&priv->level_cond);
+    g_mutex_unlock(&priv->level_lock);
+
+    /* and a write waiting for decoder buffer space */
+    video_set_cancel(1);
+
+    return TRUE;
+}
+
+static gboolean
+gst_amltspvsink_unlock_stop(GstBaseSink *sink)
+{
+    GstAmltspvsink *amltspvsink = GST_AMLTSPVSINK(sink);
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+
+    GST_DEBUG_OBJECT(amltspvsink, "unlock_stop");
+    video_set_cancel(0);
+    g_mutex_lock(&priv->level_lock);
+    priv->flushing = FALSE;
+    g_mutex_unlock(&priv->level_lock);
+
+    return TRUE;
+}
+
 /* notify subclass of query */
 static gboolean
 gst_amltspvsink_query(GstBaseSink *sink, GstQuery *query)
 {
     gboolean res = TRUE;
     GstAmltspvsink *amltspvsink = GST_AMLTSPVSINK(sink);
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
 
     GST_FIXME_OBJECT(amltspvsink, "query--%s", GST_QUERY_TYPE_NAME(query));
 
+    if (GST_QUERY_POSITION == GST_QUERY_TYPE(query))
+    {
+        GstFormat format;
+        guint64 vpts = 0;
+        GstClockTime position = GST_CLOCK_TIME_NONE;
+
+        /* sampled by the monitor thread, the decoder is not touched here */
+        g_mutex_lock(&priv->level_lock);
+        vpts = priv->display_pts;
+        g_mutex_unlock(&priv->level_lock);
+
+        gst_query_parse_position(query, &format, NULL);
+        if (GST_FORMAT_TIME == format && 0 != vpts)
+        {
+            GST_OBJECT_LOCK(sink);
+            position = gst_segment_position_from_running_time(&sink->segment, GST_FORMAT_TIME,
+                                                              es_pts_to_running_time(priv, &sink->segment, vpts));
+            position = gst_segment_to_stream_time(&sink->segment, GST_FORMAT_TIME, position);
+            GST_OBJECT_UNLOCK(sink);
+        }
+        if (GST_CLOCK_TIME_IS_VALID(position))
+        {
+            gst_query_set_position(query, format, (gint64)position);
+            GST_DEBUG_OBJECT(amltspvsink, "query, position: %" GST_TIME_FORMAT, GST_TIME_ARGS(position));
+            return TRUE;
+        }
+    }
+
     res = GST_BASE_SINK_CLASS(parent_class)->query(sink, query);
+    if (res && GST_QUERY_LATENCY == GST_QUERY_TYPE(query))
+    {
+        latency_query_add(amltspvsink, query);
+    }
 
     return res;
 }
@@ -1090,6 +3449,7 @@ gst_amltspvsink_event(GstBaseSink *sink, GstEvent *event)
     case GST_EVENT_EOS:
     {
         gboolean eof = TRUE;
+        au_write(amltspvsink);
         GST_OBJECT_LOCK(sink);
         priv->received_eos = TRUE;
         priv->eos = FALSE;
@@ -1097,22 +3457,49 @@ gst_amltspvsink_event(GstBaseSink *sink, GstEvent *event)
         GST_WARNING_OBJECT(amltspvsink, "EOS received seqnum %d", priv->seqnum);
         /* start wait video eos thread */
         start_eos_thread(amltspvsink);
+        GST_OBJECT_UNLOCK(sink);
         /* notify tsplayer EOF */
         video_set_param(AM_TSPLAYER_KEY_SET_STREAM_EOF, &eof);
-        GST_OBJECT_UNLOCK(sink);
+        /* after the captions still queued */
+        cc_queue_push(amltspvsink, GST_MINI_OBJECT_CAST(gst_event_new_eos()));
         return TRUE;
     }
     case GST_EVENT_FLUSH_START:
     {
+        /* unblock a cc push downstream first, then wait for the task */
+        gst_pad_push_event(priv->cc_pad, gst_event_new_flush_start());
+        cc_task_halt(amltspvsink, FALSE);
         break;
     }
 
     case GST_EVENT_FLUSH_STOP:
     {
+        /*
+         * FLUSH_STOP is serialized: the pad core holds the stream lock
+         * across this handler, so the data path state is ours here.
+         */
         video_flush();
-        GST_OBJECT_LOCK(sink);
         priv->extradata_injected = FALSE;
-        GST_OBJECT_UNLOCK(sink);
+        priv->drop_to_key = FALSE;
+        au_clear(priv);
+        qos_reset(priv);
+        priv->last_pts_valid = FALSE;
+        gst_buffer_replace(&priv->preroll_buffer, NULL);
+        priv->preroll_armed = TRUE;
+        /* the sampled pts is from before the flush */
+        g_mutex_lock(&priv->level_lock);
+        priv->display_pts = 0;
+        priv->first_frame = FALSE;
+        latency_window_reset(&priv->latency, g_get_monotonic_time());
+        g_mutex_unlock(&priv->level_lock);
+        session_drift_reset();
+        /* running time restarts, so does the cc segment */
+        cc_task_halt(amltspvsink, FALSE);
+        GST_PAD_STREAM_LOCK(priv->cc_pad);
+        gst_pad_push_event(priv->cc_pad, gst_event_new_flush_stop(TRUE));
+        g_atomic_int_set(&priv->cc_need_events, TRUE);
+        GST_PAD_STREAM_UNLOCK(priv->cc_pad);
+        cc_task_start(amltspvsink);
         break;
     }
 
@@ -1122,7 +3509,12 @@ gst_amltspvsink_event(GstBaseSink *sink, GstEvent *event)
 
         gst_event_copy_segment(event, &segment);
         GST_FIXME_OBJECT(amltspvsink, "rate--%f", segment.rate);
+        session_drift_reset();
         video_set_rate(segment.rate);
+        GST_OBJECT_LOCK(sink);
+        priv->segment_rate = segment.rate;
+        priv->catching_up = FALSE;
+        GST_OBJECT_UNLOCK(sink);
         break;
     }
 
@@ -1134,6 +3526,144 @@ gst_amltspvsink_event(GstBaseSink *sink, GstEvent *event)
     return res;
 }
 
+/*
+ * preroll-first-frame: write the preroll au while going to PAUSED, or
+ * after a flush, and hold the async state change until the decoder
+ * shows it, then freeze the decoder on it. PAUSED_TO_PLAYING resumes,
+ * and render skips the buffer when basesink hands it over again. With
+ * alignment=nal the preroll buffer ends its au; a preroll nal that is
+ * not part of a picture, e.g. a parameter set, prerolls right away.
+ */
+static GstFlowReturn
+gst_amltspvsink_preroll(GstBaseSink *sink, GstBuffer *buffer)
+{
+    GstAmltspvsink *amltspvsink = GST_AMLTSPVSINK(sink);
+    GstAmltspvsinkPrivate *priv = amltspvsink->priv;
+    GstState target = GST_STATE_VOID_PENDING;
+    GstFlowReturn ret = GST_FLOW_OK;
+    gint64 end_time = 0;
+    gboolean shown = FALSE;
+    gboolean flushing = FALSE;
+    guint64 written = priv->frames_written;
+    gboolean armed = priv->preroll_armed;
+
+    /* only the first preroll after READY_TO_PAUSED or a flush waits */
+    priv->preroll_armed = FALSE;
+    GST_OBJECT_LOCK(sink);
+    target = GST_STATE_TARGET(sink);
+    GST_OBJECT_UNLOCK(sink);
+    if (!priv->preroll_first_frame || !armed || GST_STATE_PAUSED != target)
+    {
+        return GST_FLOW_OK;
+    }
+
+    g_mutex_lock(&priv->level_lock);
+    priv->first_frame = FALSE;
+    g_mutex_unlock(&priv->level_lock);
+
+    ret = gst_amltspvsink_render(sink, buffer);
+    if (GST_FLOW_OK == ret && priv->nal_aligned)
+    {
+        /* the decoder shows nothing of an au still open */
+        ret = au_write(amltspvsink);
+    }
+    if (GST_FLOW_OK != ret)
+    {
+        return ret;
+    }
+    /* gathered nals are consumed either way, a dropped frame is retried by render */
+    if (priv->nal_aligned || written != priv->frames_written)
+    {
+        gst_buffer_replace(&priv->preroll_buffer, buffer);
+    }
+    if (written == priv->frames_written)
+    {
+        GST_INFO_OBJECT(amltspvsink, "no picture written by preroll, do not wait for it");
+        return GST_FLOW_OK;
+    }
+
+    end_time = g_get_monotonic_time() + PREROLL_FIRST_FRAME_TIMEOUT_US;
+    g_mutex_lock(&priv->level_lock);
+    while (!priv->first_frame && !priv->flushing)
+    {
+        if (!g_cond_wait_until(&priv->level_cond, &priv->level_lock, end_time))
+        {
+            break;
+        }
+    }
+    shown = priv->first_frame;
+    flushing = priv->flushing;
+    g_mutex_unlock(&priv->level_lock);
+
+    if (flushing)
+    {
+        return GST_FLOW_FLUSHING;
+    }
+    if (shown)
+    {
+        GST_INFO_OBJECT(amltspvsink, "first frame prerolled");
+    }
+    else
+    {
+        GST_WARNING_OBJECT(amltspvsink, "no first frame in %d ms, preroll anyway",
+                           PREROLL_FIRST_FRAME_TIMEOUT_US / 1000);
+    }
+
+    g_mutex_lock(&priv->control_lock);
+    if (FALSE == priv->paused)
+    {
+        video_pause();
+        priv->paused = TRUE;
+    }
+    g_mutex_unlock(&priv->control_lock);
+
+    return GST_FLOW_OK;
+}
+
+/*
+ * "update-geometry" action: window, angle and crop in one request. A
+ * w or h <= 0 keeps the window, a negative angle keeps the angle and a
+ * negative crop edge keeps the crop.
+ */
+static void
+gst_amltspvsink_update_geometry(GstAmltspvsink *amltspvsink,
+                                gint x, gint y, gint w, gint h, gint angle,
+                                gint crop_top, gint crop_left,
+                                gint crop_bottom, gint crop_right)
+{
+    Geometry geometry = {x, y, w, h, angle, crop_top, crop_left, crop_bottom, crop_right};
+    guint parts = 0;
+
+    if (w > 0 && h > 0)
+    {
+        parts |= GEOMETRY_WINDOW;
+    }
+    if (0 == angle || 90 == angle || 180 == angle || 270 == angle)
+    {
+        parts |= GEOMETRY_ANGLE;
+    }
+    else if (angle >= 0)
+    {
+        GST_ERROR_OBJECT(amltspvsink, "Bad render angle value, %d", angle);
+    }
+    if (crop_top >= 0 && crop_left >= 0 && crop_bottom >= 0 && crop_right >= 0)
+    {
+        parts |= GEOMETRY_CROP;
+    }
+
+    GST_INFO_OBJECT(amltspvsink, "update geometry 0x%x, window (%d,%d,%d,%d), angle %d, crop (%d,%d,%d,%d)",
+                    parts, x, y, w, h, angle, crop_top, crop_left, crop_bottom, crop_right);
+    if (parts)
+    {
+        geometry_request(amltspvsink, parts, &geometry);
+    }
+}
+
+/*
+ * Data path, under the sink pad stream lock that basesink holds. No
+ * other lock is held across the decoder writes, which may wait for
+ * buffer space until the sink is unlocked.
+ */
 static GstFlowReturn
 gst_amltspvsink_render(GstBaseSink *sink, GstBuffer *buffer)
 {
@@ -1141,26 +3671,108 @@ gst_amltspvsink_render(GstBaseSink *sink, GstBuffer *buffer)
     GstAmltspvsinkPrivate *priv = amltspvsink->priv;
     GstClockTime time = 0;
     guint64 pts = 0;
+    GstFlowReturn flow = GST_FLOW_OK;
+    int ret = ERROR_CODE_OK;
+
+    if (priv->preroll_buffer)
+    {
+        /* basesink hands the preroll buffer over again, consumed already */
+        gboolean consumed = (buffer == priv->preroll_buffer);
+
+        gst_buffer_replace(&priv->preroll_buffer, NULL);
+        if (consumed)
+        {
+            return GST_FLOW_OK;
+        }
+    }
 
     time = GST_BUFFER_TIMESTAMP(buffer);
     if (GST_BUFFER_PTS_IS_VALID(buffer))
     {
-        pts = time * 9 / 100000;
+        pts = es_pts(amltspvsink, time);
+        if (1.0 == priv->segment_rate)
+        {
+            pts_continuity(amltspvsink, buffer, pts);
+        }
     }
     /* staging max vpts */
     priv->final_vpts = (pts > priv->final_vpts) ? pts : priv->final_vpts;
 
-    GST_OBJECT_LOCK(sink);
+    if (priv->drift_compensation && !priv->catching_up &&
+        1.0 == priv->segment_rate && GST_BUFFER_PTS_IS_VALID(buffer))
+    {
+        drift_sample(amltspvsink, time);
+    }
+
+    /* low latency mode drops instead of waiting for room */
+    if (!priv->low_latency && !wait_for_buffer_space(amltspvsink))
+    {
+        return GST_FLOW_FLUSHING;
+    }
+    qos_update(amltspvsink);
+
+    /* vfm path switch on a key frame, au_begin does it for gathered nals */
+    if (!priv->nal_aligned && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) &&
+        video_path_switch_pending() && !vfm_path_switch(amltspvsink, pts))
+    {
+        return GST_FLOW_FLUSHING;
+    }
+
+    /* nal aligned aus are decided on once, at their first slice */
+    if (priv->nal_aligned)
+    {
+        return au_gather(amltspvsink, buffer, pts);
+    }
+    if (priv->low_latency &&
+        !low_latency_control(amltspvsink, GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)))
+    {
+        return GST_FLOW_OK;
+    }
     {
         GstMapInfo map;
+        guint8 *data = NULL;
+        gsize size = 0;
+        gboolean in_place = FALSE;
+
+        /* length prefixed aus are converted to annex-b, in place if possible */
+        if (priv->nal_length_size && buffer_is_rewritable(buffer) &&
+            gst_buffer_map(buffer, &map, (GstMapFlags)GST_MAP_READWRITE))
+        {
+            in_place = TRUE;
+        }
+        else
+        {
+            gst_buffer_map(buffer, &map, (GstMapFlags)GST_MAP_READ);
+        }
+        data = map.data;
+        size = map.size;
+        if (priv->nal_length_size)
+        {
+            data = nal_to_annexb(priv, map.data, map.size, in_place, &size);
+            if (NULL == data)
+            {
+                GST_WARNING_OBJECT(amltspvsink, "bad length prefixed au, drop it");
+                gst_buffer_unmap(buffer, &map);
+                return GST_FLOW_OK;
+            }
+        }
+        GST_DEBUG_OBJECT(amltspvsink, "render---size: 0x%zx, vpts:%llu!", size, pts);
 
-        gst_buffer_map(buffer, &map, (GstMapFlags)GST_MAP_READ);
-        GST_DEBUG_OBJECT(amltspvsink, "render---size: 0x%zx, vpts:%llu!", map.size, pts);
+        if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) &&
+            priv->extradata_injected && qos_droppable(priv, data, size))
+        {
+            GST_DEBUG_OBJECT(amltspvsink, "qos, drop non reference frame, vpts:%llu", pts);
+            priv->qos_dropped++;
+            gst_buffer_unmap(buffer, &map);
+            qos_post_drop(amltspvsink, time);
+            return GST_FLOW_OK;
+        }
+        priv->qos_processed++;
 
         /* get extradata when "priv->extradata_type!=ED_TYPE_INVALID" and "priv->extradata_got==false" */
         if ((ED_TYPE_INVALID != priv->extradata_type) && (FALSE == priv->extradata_got))
         {
-            if (0 == extradata_get(priv->extradata_type, (const unsigned char *)map.data, map.size, &priv->extradata))
+            if (0 == extradata_get(priv->extradata_type, (const unsigned char *)data, size, &priv->extradata))
             {
                 GST_INFO("got extradata!");
                 priv->extradata_got = TRUE;
@@ -1169,38 +3781,53 @@ gst_amltspvsink_render(GstBaseSink *sink, GstBuffer *buffer)
         /* inject extradata when "priv->extradata_injected==false" */
         if (priv->extradata_got && !priv->extradata_injected)
         {
-            GST_INFO("injected extradata!");
-            priv->extradata_injected = TRUE;
-            if (priv->extradata.vps) /* only for h265 */
-                video_write_frame(priv->extradata.vps, priv->extradata.vps_size, (uint64_t)pts);
-            if (priv->extradata.sps)
-                video_write_frame(priv->extradata.sps, priv->extradata.sps_size, (uint64_t)pts);
-            if (priv->extradata.pps)
-                video_write_frame(priv->extradata.pps, priv->extradata.pps_size, (uint64_t)pts);
+            ret = extradata_inject(priv, pts);
+            if (ERROR_CODE_OK != ret)
+            {
+                /* the frame does not decode without them, try again with the next one */
+                GST_DEBUG_OBJECT(amltspvsink, "extradata write failed: %d, drop frame", ret);
+                priv->drop_to_key = TRUE;
+                gst_buffer_unmap(buffer, &map);
+                return (ERROR_CODE_CANCELLED == ret) ? GST_FLOW_FLUSHING : GST_FLOW_OK;
+            }
 #ifdef DUMP_TO_FILE
             if (getenv("AMLTSPVSINK_ES_DUMP"))
             {
                 dump("/tmp/ss", (const uint8_t *)priv->extradata.vps, priv->extradata.vps_size, FALSE, 0);
                 dump("/tmp/ss", (const uint8_t *)priv->extradata.sps, priv->extradata.sps_size, FALSE, 0);
                 dump("/tmp/ss", (const uint8_t *)priv->extradata.pps, priv->extradata.pps_size, FALSE, 0);
-                dump("/tmp/ss", map.data, map.size, FALSE, 0);
+                dump("/tmp/ss", data, size, FALSE, 0);
             }
 #endif
         }
 
-        video_write_frame(map.data, (int32_t)map.size, (uint64_t)pts);
+        ret = video_write_frame(data, (int32_t)size, (uint64_t)pts);
+        if (ERROR_CODE_RETRY == ret)
+        {
+            /* decoder is full in low latency mode, resync on a key frame */
+            GST_DEBUG_OBJECT(amltspvsink, "decoder full, drop frame");
+            priv->drop_to_key = TRUE;
+        }
+        else if (ERROR_CODE_CANCELLED == ret)
+        {
+            GST_DEBUG_OBJECT(amltspvsink, "write cancelled, drop frame");
+            flow = GST_FLOW_FLUSHING;
+        }
+        else if (ERROR_CODE_OK == ret)
+        {
+            priv->frames_written++;
+        }
 
 #ifdef DUMP_TO_FILE
         if (getenv("AMLTSPVSINK_ES_DUMP"))
         {
-            dump("/tmp/es", map.data, map.size, FALSE, 0);
+            dump("/tmp/es", data, size, FALSE, 0);
         }
 #endif
         gst_buffer_unmap(buffer, &map);
     }
-    GST_OBJECT_UNLOCK(sink);
 
-    return GST_FLOW_OK;
+    return flow;
 }
 
 static gboolean
@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "AmTsPlayer.h"
@@ -39,21 +40,99 @@ typedef int BOOL;
 #define FALSE 0
 #define TRUE 1
 
-#define WRITE_TIME_OUT_MS 100
+#define WRITE_TIME_OUT_MS 20
+#define WRITE_RETRY_COUNT 5000
 #define RETRY_SLEEP_TIME_US 50
+#define LOW_LATENCY_WRITE_TIME_OUT_MS 10
+
+/* vfm paths behind the decoder, ppmgr is only needed to rotate */
+#define VFM_PATH_DIRECT "amvideo"
+#define VFM_PATH_PPMGR "ppmgr amvideo"
 
 #define LOG(fmt, arg...) fprintf(stdout, "[video_adaptor] %s:%d " fmt, __FUNCTION__, __LINE__, ##arg);
 
+/*
+ * Locking, outer to inner: write_lock, lock, cancel_lock.
+ * write_lock is the data path lock. video_write_frame() holds it across
+ * the decoder write, and the calls that change what the decoder accepts
+ * (codec, stop, flush, deinit) take it before lock. lock guards the
+ * session state and is held only for short decoder controls, so window,
+ * angle, rate and pause never wait behind a blocked write.
+ */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* global var */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static BOOL inited = FALSE;
-static BOOL in_deinit = FALSE;
 static BOOL ready = FALSE;
 static BOOL rotate = FALSE;
+/*
+ * The vfm path is bound when the decoder starts. video_set_angle() only
+ * records the wanted path, it is switched while the decoder is stopped
+ * in video_start() and video_flush(), or by video_switch_path().
+ */
+static BOOL ppmgr_path = FALSE;
+static BOOL want_ppmgr_path = FALSE;
+/* low latency: do not wait for decoder buffer space */
+static BOOL low_latency = FALSE;
+/* pts of the first and the last frame accepted since the decoder (re)started */
+static uint64_t first_write_pts = 0;
+static uint64_t last_write_pts = 0;
 /* tsplayer session */
 static am_tsplayer_handle session = 0;
 static am_tsplayer_video_codec g_vcodec = AV_VIDEO_CODEC_AUTO;
 
+/*
+ * Cancellation of a blocked video_write_frame(), set by the sink on
+ * flush or state change and by video_deinit(). The writer checks it
+ * between write attempts and is woken from its retry sleep at once.
+ */
+static pthread_mutex_t cancel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cancel_cond = PTHREAD_COND_INITIALIZER;
+static BOOL cancelled = FALSE;
+static BOOL in_deinit = FALSE;
+
+static BOOL write_cancelled()
+{
+    BOOL ret = FALSE;
+
+    pthread_mutex_lock(&cancel_lock);
+    ret = cancelled || in_deinit;
+    pthread_mutex_unlock(&cancel_lock);
+
+    return ret;
+}
+
+/* sleep between write attempts, returns TRUE when cancelled */
+static BOOL wait_cancel(uint32_t us)
+{
+    struct timespec ts;
+    BOOL ret = FALSE;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)us * 1000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&cancel_lock);
+    if (!cancelled && !in_deinit)
+    {
+        pthread_cond_timedwait(&cancel_cond, &cancel_lock, &ts);
+    }
+    ret = cancelled || in_deinit;
+    pthread_mutex_unlock(&cancel_lock);
+
+    return ret;
+}
+
+static void set_in_deinit(BOOL deinit)
+{
+    pthread_mutex_lock(&cancel_lock);
+    in_deinit = deinit;
+    pthread_cond_broadcast(&cancel_cond);
+    pthread_mutex_unlock(&cancel_lock);
+}
+
 int video_init()
 {
     int ret = 0;
@@ -104,7 +183,10 @@ int video_init()
         }
         else
         {
-            set_vdec_path("ppmgr amvideo");
+            /* frames skip ppmgr until a rotation asks for it */
+            set_vdec_path(VFM_PATH_DIRECT);
+            ppmgr_path = FALSE;
+            want_ppmgr_path = FALSE;
             rotate = TRUE;
             LOG("init rotate success\n");
         }
@@ -119,24 +201,32 @@ int video_init()
 int video_deinit()
 {
     int ret = ERROR_CODE_OK;
-    in_deinit = TRUE;
+    set_in_deinit(TRUE);
 
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
     LOG("enter!\n");
     if (TRUE == inited)
     {
+        /* the session may outlive us, shared with audio: no more events to the sink */
+        if (AM_TSPLAYER_OK != AmTsPlayer_registerCb(session, NULL, NULL))
+        {
+            LOG("AmTsPlayer_registerCb unregister failed\n");
+        }
         ret = release_session();
         if (ret != ERROR_CODE_OK)
         {
             pthread_mutex_unlock(&lock);
+            pthread_mutex_unlock(&write_lock);
             LOG("release tsplayer session failed: %d\n", ret);
-            in_deinit = FALSE;
+            set_in_deinit(FALSE);
             return ERROR_CODE_BASE_ERROR;
         }
         inited = FALSE;
     }
-    in_deinit = FALSE;
     pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&write_lock);
+    set_in_deinit(FALSE);
 
     return ERROR_CODE_OK;
 }
@@ -166,6 +256,23 @@ int video_register_callback(event_callback pfunc, void *param)
     return ERROR_CODE_OK;
 }
 
+/* switch to the wanted vfm path, with lock held and the decoder stopped */
+static void apply_vfm_path()
+{
+    if ((FALSE == rotate) || (want_ppmgr_path == ppmgr_path))
+    {
+        return;
+    }
+
+    if (0 != set_vdec_path(want_ppmgr_path ? VFM_PATH_PPMGR : VFM_PATH_DIRECT))
+    {
+        LOG("set vfm path failed!\n");
+        return;
+    }
+    ppmgr_path = want_ppmgr_path;
+    LOG("vfm path: %s\n", ppmgr_path ? VFM_PATH_PPMGR : VFM_PATH_DIRECT);
+}
+
 static am_tsplayer_video_codec get_vcodec_enum(const char *codec, int version)
 {
     if (codec == NULL)
@@ -225,6 +332,7 @@ static am_tsplayer_video_codec get_vcodec_enum(const char *codec, int version)
 
 int video_set_codec(const char *codec, int version)
 {
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
 
     g_vcodec = get_vcodec_enum(codec, version);
@@ -236,6 +344,7 @@ int video_set_codec(const char *codec, int version)
     if (FALSE == inited)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("uninitialized!\n");
         return ERROR_CODE_INVALID_OPERATION;
     }
@@ -244,10 +353,12 @@ int video_set_codec(const char *codec, int version)
     if (AM_TSPLAYER_OK != ret)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("AmTsPlayer_setVideoParams failed: %d\n", ret);
         return ERROR_CODE_BASE_ERROR;
     }
     pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&write_lock);
 
     return ERROR_CODE_OK;
 }
@@ -314,10 +425,41 @@ int video_set_angle(int32_t angle)
         return ERROR_CODE_BASE_ERROR;
     }
 
+    want_ppmgr_path = (0 != angle) ? TRUE : FALSE;
+    if (want_ppmgr_path != ppmgr_path)
+    {
+        LOG("vfm path switch pending\n");
+    }
+
     pthread_mutex_unlock(&lock);
     return ERROR_CODE_OK;
 }
 
+/* source pixels cut from each edge, all 0 shows the whole frame */
+int video_set_crop(int32_t top, int32_t left, int32_t bottom, int32_t right)
+{
+    int ret = 0;
+
+    if (top < 0 || left < 0 || bottom < 0 || right < 0)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    LOG("enter, top:%d,left:%d,bottom:%d,right:%d!\n", top, left, bottom, right);
+    ret = set_video_crop(top, left, bottom, right);
+    if (0 != ret)
+    {
+        pthread_mutex_unlock(&lock);
+        LOG("set_video_crop failed: %d\n", ret);
+        return ERROR_CODE_BASE_ERROR;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
 int video_set_param(am_tsplayer_parameter type, void* arg)
 {
     int ret = 0;
@@ -380,6 +522,123 @@ int video_set_rate(float rate)
     return ERROR_CODE_OK;
 }
 
+/* SESSION_SYNC_*, pcr master also switches tsync to pcr recovery */
+int video_set_sync_mode(int32_t mode)
+{
+    int ret = ERROR_CODE_OK;
+
+    LOG("enter, mode:%d!\n", mode);
+    ret = set_session_sync_mode(mode);
+    if (ERROR_CODE_OK != ret)
+    {
+        LOG("set_session_sync_mode failed: %d\n", ret);
+        return ret;
+    }
+
+    switch (mode)
+    {
+    case SESSION_SYNC_VMASTER:
+        set_tsync_mode(TSYNC_MODE_VIDEO);
+        break;
+    case SESSION_SYNC_AMASTER:
+        set_tsync_mode(TSYNC_MODE_AUDIO);
+        break;
+    case SESSION_SYNC_PCRMASTER:
+        set_tsync_mode(TSYNC_MODE_PCRSCR);
+        break;
+    default:
+        break;
+    }
+
+    return ERROR_CODE_OK;
+}
+
+int video_set_low_latency(int enable)
+{
+    pthread_mutex_lock(&lock);
+    LOG("enter, enable:%d!\n", enable);
+    low_latency = enable ? TRUE : FALSE;
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
+/*
+ * Decoder buffer depth: pts of the last written frame minus current vpts.
+ * ERROR_CODE_RETRY until the decoder shows a frame written since it started.
+ */
+int video_get_buffered_ms(int32_t *buffered_ms)
+{
+    am_tsplayer_result ret = AM_TSPLAYER_OK;
+    uint64_t vpts = 0;
+
+    if (buffered_ms == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    if ((FALSE == inited) || (FALSE == ready))
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    ret = AmTsPlayer_getPts(session, TS_STREAM_VIDEO, &vpts);
+    if (ret != AM_TSPLAYER_OK)
+    {
+        pthread_mutex_unlock(&lock);
+        LOG("AmTsPlayer_getPts failed: %d\n", ret);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    /* the decoder has not shown anything written since the (re)start yet */
+    if (vpts == 0 || first_write_pts == 0 || vpts < first_write_pts)
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_RETRY;
+    }
+
+    *buffered_ms = (last_write_pts > vpts) ? (int32_t)((last_write_pts - vpts) / 90) : 0;
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
+int video_get_buffer_level(int32_t *level)
+{
+    am_tsplayer_result ret = AM_TSPLAYER_OK;
+    am_tsplayer_buffer_stat stat;
+
+    if (level == NULL)
+    {
+        LOG("bad parameter!\n");
+        return ERROR_CODE_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&lock);
+    if ((FALSE == inited) || (FALSE == ready))
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_INVALID_OPERATION;
+    }
+
+    /* polled periodically, so stay quiet on failure */
+    memset(&stat, 0, sizeof(stat));
+    ret = AmTsPlayer_getBufferStat(session, TS_STREAM_VIDEO, &stat);
+    if ((ret != AM_TSPLAYER_OK) || (stat.size == 0))
+    {
+        pthread_mutex_unlock(&lock);
+        return ERROR_CODE_BASE_ERROR;
+    }
+
+    *level = (int32_t)((uint64_t)stat.data_len * 100 / stat.size);
+    pthread_mutex_unlock(&lock);
+
+    return ERROR_CODE_OK;
+}
+
 int video_get_pts(uint64_t *vpts)
 {
     am_tsplayer_result ret = AM_TSPLAYER_OK;
@@ -417,6 +676,7 @@ int video_start()
         return ERROR_CODE_INVALID_OPERATION;
     }
 
+    apply_vfm_path();
     ret = AmTsPlayer_startVideoDecoding(session);
     if (AM_TSPLAYER_OK != ret)
     {
@@ -486,11 +746,13 @@ int video_stop()
 {
     am_tsplayer_result ret = AM_TSPLAYER_OK;
 
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
     LOG("enter!\n");
     if (FALSE == inited)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("uninitialized!\n");
         return ERROR_CODE_INVALID_OPERATION;
     }
@@ -499,11 +761,15 @@ int video_stop()
     if (ret != AM_TSPLAYER_OK)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("AmTsPlayer_stopVideoDecoding failed: %d\n", ret);
         return ERROR_CODE_BASE_ERROR;
     }
     ready = FALSE;
+    first_write_pts = 0;
+    last_write_pts = 0;
     pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&write_lock);
 
     return ERROR_CODE_OK;
 }
@@ -512,6 +778,7 @@ int video_flush()
 {
     am_tsplayer_result ret = AM_TSPLAYER_OK;
 
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
     LOG("enter!\n");
     am_tsplayer_video_params param = {g_vcodec, 0x100};
@@ -519,30 +786,43 @@ int video_flush()
     if (FALSE == inited)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("uninitialized!\n");
         return ERROR_CODE_INVALID_OPERATION;
     }
 
     ret = AmTsPlayer_stopVideoDecoding(session);
+    apply_vfm_path();
     ret |= AmTsPlayer_setVideoParams(session, &param);
     ret |= AmTsPlayer_startVideoDecoding(session);
     if (ret != AM_TSPLAYER_OK)
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("AmTsPlayer flush video failed: %d\n", ret);
         return ERROR_CODE_BASE_ERROR;
     }
+    first_write_pts = 0;
+    last_write_pts = 0;
     pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&write_lock);
 
     return ERROR_CODE_OK;
 }
 
-int video_write_frame(void *data, int32_t size, uint64_t pts)
+/*
+ * Write one chunk to the decoder. In low latency mode a full decoder
+ * returns ERROR_CODE_RETRY at once when droppable is set, otherwise the
+ * write is retried for a while, or until cancelled.
+ */
+static int write_frame(void *data, int32_t size, uint64_t pts, BOOL droppable)
 {
     am_tsplayer_input_frame_buffer frame =
         {TS_INPUT_BUFFER_TYPE_NORMAL, data, size, pts, 1};
     am_tsplayer_result ret = AM_TSPLAYER_OK;
-    int retry = 1000;
+    am_tsplayer_handle handle = 0;
+    BOOL may_drop = FALSE;
+    int retry = WRITE_RETRY_COUNT;
 
     if (data == NULL || size < 0)
     {
@@ -550,34 +830,116 @@ int video_write_frame(void *data, int32_t size, uint64_t pts)
         return ERROR_CODE_BAD_PARAMETER;
     }
 
+    if (TRUE == write_cancelled())
+    {
+        return ERROR_CODE_CANCELLED;
+    }
+
+    pthread_mutex_lock(&write_lock);
     pthread_mutex_lock(&lock);
     if ((FALSE == inited) || (FALSE == ready))
     {
         pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("uninitialized or not ready!\n");
         return ERROR_CODE_INVALID_OPERATION;
     }
+    /* the session stays valid while write_lock is held */
+    handle = session;
+    may_drop = low_latency && droppable;
+    pthread_mutex_unlock(&lock);
 
-    do
+    if (TRUE == may_drop)
     {
-        ret = AmTsPlayer_writeFrameData(session, &frame, WRITE_TIME_OUT_MS);
-        if ((AM_TSPLAYER_ERROR_RETRY == ret) && (FALSE == in_deinit))
+        /* a full decoder buffer means we are late, let the caller drop */
+        ret = AmTsPlayer_writeFrameData(handle, &frame, LOW_LATENCY_WRITE_TIME_OUT_MS);
+        if (AM_TSPLAYER_ERROR_RETRY == ret)
         {
-            usleep(RETRY_SLEEP_TIME_US);
+            pthread_mutex_unlock(&write_lock);
+            return ERROR_CODE_RETRY;
         }
-        else
+    }
+    else
+    {
+        do
         {
-            break;
-        }
-    } while (ret || (retry-- > 0));
+            ret = AmTsPlayer_writeFrameData(handle, &frame, WRITE_TIME_OUT_MS);
+            if (AM_TSPLAYER_ERROR_RETRY != ret)
+            {
+                break;
+            }
+            if (TRUE == wait_cancel(RETRY_SLEEP_TIME_US))
+            {
+                pthread_mutex_unlock(&write_lock);
+                LOG("write cancelled, pts: %llu\n", (unsigned long long)pts);
+                return ERROR_CODE_CANCELLED;
+            }
+        } while (retry-- > 0);
+    }
 
     if (ret != AM_TSPLAYER_OK)
     {
-        pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&write_lock);
         LOG("AmTsPlayer_writeFrameData failed: %d\n", ret);
         return ERROR_CODE_BASE_ERROR;
     }
+    pthread_mutex_lock(&lock);
+    if (first_write_pts == 0)
+    {
+        first_write_pts = pts;
+    }
+    last_write_pts = pts;
     pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&write_lock);
+
+    return ERROR_CODE_OK;
+}
+
+int video_write_frame(void *data, int32_t size, uint64_t pts)
+{
+    return write_frame(data, size, pts, TRUE);
+}
+
+/* never dropped: the rest of a frame whose start is in the decoder, or parameter sets */
+int video_write_frame_continued(void *data, int32_t size, uint64_t pts)
+{
+    return write_frame(data, size, pts, FALSE);
+}
+
+/* cancel, or re-arm with 0, a blocked video_write_frame() */
+int video_set_cancel(int cancel)
+{
+    pthread_mutex_lock(&cancel_lock);
+    cancelled = cancel ? TRUE : FALSE;
+    pthread_cond_broadcast(&cancel_cond);
+    pthread_mutex_unlock(&cancel_lock);
 
     return ERROR_CODE_OK;
 }
+
+/* whether a render-angle change waits for the decoder to restart */
+int video_path_switch_pending()
+{
+    int pending = 0;
+
+    pthread_mutex_lock(&lock);
+    pending = (TRUE == rotate) && (want_ppmgr_path != ppmgr_path);
+    pthread_mutex_unlock(&lock);
+
+    return pending;
+}
+
+/*
+ * Restart the decoder on the wanted vfm path, if it changed. Frames
+ * queued in the decoder are dropped, so call it ahead of a key frame.
+ */
+int video_switch_path()
+{
+    if (0 == video_path_switch_pending())
+    {
+        return ERROR_CODE_OK;
+    }
+
+    LOG("restart decoder for the vfm path switch\n");
+    return video_flush();
+}
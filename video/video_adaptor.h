@@ -23,11 +23,14 @@
 
 #include <stdint.h>
 #include "AmTsPlayer.h"
+#include "mediasession.h"
 
 #define ERROR_CODE_OK 0
 #define ERROR_CODE_BAD_PARAMETER -1
 #define ERROR_CODE_INVALID_OPERATION -2
 #define ERROR_CODE_BASE_ERROR -3
+#define ERROR_CODE_RETRY -4
+#define ERROR_CODE_CANCELLED -5
 
 int video_init();
 
@@ -41,10 +44,24 @@ int video_set_region(int32_t x, int32_t y, int32_t w, int32_t h);
 
 int video_set_angle(int32_t angle);
 
+int video_set_crop(int32_t top, int32_t left, int32_t bottom, int32_t right);
+
+int video_path_switch_pending();
+
+int video_switch_path();
+
 int video_set_param(am_tsplayer_parameter type, void* arg);
 
 int video_set_rate(float rate);
 
+int video_set_low_latency(int enable);
+
+int video_set_sync_mode(int32_t mode);
+
+int video_get_buffered_ms(int32_t *buffered_ms);
+
+int video_get_buffer_level(int32_t *level);
+
 int video_get_pts(uint64_t *vpts);
 
 int video_start();
@@ -58,5 +75,8 @@ int video_stop();
 int video_flush();
 
 int video_write_frame(void *data, int32_t size, uint64_t pts);
+int video_write_frame_continued(void *data, int32_t size, uint64_t pts);
+
+int video_set_cancel(int cancel);
 
 #endif // __VIDEO_ADAPTOR_H__